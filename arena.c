@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "defs.h"
+#include "log.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct ce_arena_chunk {
+    ce_arena_chunk *next;
+    char *pos;
+    char *end;
+};
+
+#define CHUNK_HEADER ALIGN_UP(sizeof(ce_arena_chunk))
+#define CHUNK_DATA (ARENA_CHUNK_SIZE - CHUNK_HEADER)
+
+/*
+  chunks of ARENA_CHUNK_SIZE released by coroutines,
+  shared by all arenas of the unique scheduler in the process
+*/
+static ce_arena_chunk *chunk_cache = NULL;
+static int cache_cnt = 0;
+
+static ce_arena_chunk *new_chunk(size_t data_size)
+{
+    ce_arena_chunk *chunk;
+
+    if (data_size <= CHUNK_DATA && chunk_cache != NULL) {
+        chunk = chunk_cache;
+        chunk_cache = chunk->next;
+        cache_cnt--;
+    } else {
+        if (data_size < CHUNK_DATA) {
+            data_size = CHUNK_DATA;
+        }
+        chunk = (ce_arena_chunk *)malloc(CHUNK_HEADER + data_size);
+        if (chunk == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for arena chunk");
+            return NULL;
+        }
+        chunk->end = (char *)chunk + CHUNK_HEADER + data_size;
+    }
+    chunk->pos = (char *)chunk + CHUNK_HEADER;
+    chunk->next = NULL;
+
+    return chunk;
+}
+
+static void free_chunk(ce_arena_chunk *chunk)
+{
+    // oversized chunks of single large allocations are not kept
+    if (cache_cnt >= ARENA_CACHE_SIZE
+        || chunk->end - (char *)chunk != ARENA_CHUNK_SIZE) {
+        free(chunk);
+        return;
+    }
+    chunk->next = chunk_cache;
+    chunk_cache = chunk;
+    cache_cnt++;
+}
+
+void *ce_arena_alloc(ce_arena_chunk **arena, size_t size)
+{
+    ce_arena_chunk *chunk = *arena;
+    char *ptr;
+
+    size = ALIGN_UP(size > 0 ? size : 1);
+    if (chunk == NULL || (size_t)(chunk->end - chunk->pos) < size) {
+        chunk = new_chunk(size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        if (size > CHUNK_DATA && *arena != NULL) {
+            // a large allocation gets a chunk of its own,
+            // the head chunk keeps being filled by the small ones
+            chunk->next = (*arena)->next;
+            (*arena)->next = chunk;
+            chunk->pos = chunk->end;
+            return chunk->end - size;
+        }
+        // the head chunk is the one being filled
+        chunk->next = *arena;
+        *arena = chunk;
+    }
+    ptr = chunk->pos;
+    chunk->pos += size;
+
+    return ptr;
+}
+
+void ce_arena_reset(ce_arena_chunk **arena)
+{
+    ce_arena_chunk *chunk = *arena;
+    ce_arena_chunk *next;
+
+    if (chunk == NULL) {
+        return;
+    }
+    // keep one chunk, so that a loop reusing the arena doesn't touch the cache
+    for (next = chunk->next; next != NULL; next = chunk->next) {
+        chunk->next = next->next;
+        free_chunk(next);
+    }
+    if (chunk->end - (char *)chunk != ARENA_CHUNK_SIZE) {
+        free(chunk);
+        *arena = NULL;
+        return;
+    }
+    chunk->pos = (char *)chunk + CHUNK_HEADER;
+}
+
+void ce_arena_release(ce_arena_chunk **arena)
+{
+    ce_arena_chunk *chunk = *arena;
+    ce_arena_chunk *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        free_chunk(chunk);
+        chunk = next;
+    }
+    *arena = NULL;
+}
+
+void ce_arena_clear_cache()
+{
+    ce_arena_chunk *next;
+
+    while (chunk_cache != NULL) {
+        next = chunk_cache->next;
+        free(chunk_cache);
+        chunk_cache = next;
+    }
+    cache_cnt = 0;
+}
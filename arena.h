@@ -0,0 +1,14 @@
+#ifndef _COEVT_ARENA_H_
+#define _COEVT_ARENA_H_
+
+#include <stddef.h>
+
+typedef struct ce_arena_chunk ce_arena_chunk;
+
+// an arena is the head of its chunk list, NULL until the first allocation
+void *ce_arena_alloc(ce_arena_chunk **arena, size_t size);
+void ce_arena_reset(ce_arena_chunk **arena);
+void ce_arena_release(ce_arena_chunk **arena);
+void ce_arena_clear_cache();
+
+#endif
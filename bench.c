@@ -0,0 +1,300 @@
+/*
+ * microbenchmarks of the scheduler, channels and poller
+ * every result is printed as one JSON object per line
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "coevt.h"
+#include "coroutine.h"
+#include "channel.h"
+#include "stats.h"
+#include "timer.h"
+#include "profile.h"
+
+#define DEFAULT_ITERS 100000
+#define ALLOCS_PER_TASK 16
+
+static long iters = DEFAULT_ITERS;
+static int run_stacks = RUN_STACK_NUM;
+
+static void report(const char *name, const char *param, long ops,
+                   unsigned long long elapsed_ns, ce_stats *before)
+{
+    ce_stats after;
+    ce_stats_snapshot(&after);
+
+    printf("{\"bench\":\"%s\",\"param\":\"%s\",\"ops\":%ld,"
+           "\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,"
+           "\"resumes_per_op\":%.2f,\"stack_bytes_per_op\":%.1f}\n",
+           name, param, ops,
+           (double)elapsed_ns / ops,
+           ops * 1e9 / elapsed_ns,
+           (double)(after.resumes - before->resumes) / ops,
+           (double)(after.stack_saved_bytes - before->stack_saved_bytes
+                    + after.stack_restored_bytes - before->stack_restored_bytes) / ops);
+    fflush(stdout);
+}
+
+static void empty_task(void *arg)
+{
+}
+
+static void bench_create_exit()
+{
+    ce_stats before;
+    unsigned long long start;
+    long i;
+
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    for (i = 0; i < iters; i++) {
+        ce_task(empty_task, NULL);
+    }
+    ce_run();
+    report("create_exit", "", iters, ce_stats_now_ns() - start, &before);
+}
+
+static void yield_task(void *arg)
+{
+    long i;
+    for (i = 0; i < iters; i++) {
+        ce_yield();
+    }
+}
+
+static void bench_yield()
+{
+    ce_stats before;
+    unsigned long long start;
+
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    ce_task(yield_task, NULL);
+    ce_task(yield_task, NULL);
+    ce_run();
+    report("yield", "tasks=2", iters * 2, ce_stats_now_ns() - start, &before);
+}
+
+static int pipe_ab[2];
+static int pipe_ba[2];
+
+static void pipe_ping(void *arg)
+{
+    char c = 'p';
+    long i;
+    for (i = 0; i < iters; i++) {
+        ce_write(pipe_ab[1], &c, 1);
+        ce_read(pipe_ba[0], &c, 1);
+    }
+}
+
+static void pipe_pong(void *arg)
+{
+    char c;
+    long i;
+    for (i = 0; i < iters; i++) {
+        ce_read(pipe_ab[0], &c, 1);
+        ce_write(pipe_ba[1], &c, 1);
+    }
+}
+
+static void bench_poller_wake()
+{
+    ce_stats before;
+    unsigned long long start;
+
+    if (pipe(pipe_ab) != 0 || pipe(pipe_ba) != 0) {
+        printf("ERROR: Failed to create pipes\n");
+        return;
+    }
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    ce_task(pipe_ping, NULL);
+    ce_task(pipe_pong, NULL);
+    ce_run();
+    report("poller_pingpong", "pipe", iters, ce_stats_now_ns() - start, &before);
+    close(pipe_ab[0]);
+    close(pipe_ab[1]);
+    close(pipe_ba[0]);
+    close(pipe_ba[1]);
+}
+
+static ce_channel *chan_ab;
+static ce_channel *chan_ba;
+
+static void chan_ping(void *arg)
+{
+    long i, n;
+    for (i = 0; i < iters; i++) {
+        ce_chan_sendl(chan_ab, i);
+        ce_chan_recvl(chan_ba, &n);
+    }
+}
+
+static void chan_pong(void *arg)
+{
+    long i, n;
+    for (i = 0; i < iters; i++) {
+        ce_chan_recvl(chan_ab, &n);
+        ce_chan_sendl(chan_ba, n);
+    }
+}
+
+static void bench_chan(int bufsize, int handoff)
+{
+    ce_stats before;
+    unsigned long long start;
+    char param[32];
+
+    chan_ab = ce_chan_create(bufsize);
+    chan_ba = ce_chan_create(bufsize);
+    ce_chan_set_handoff(chan_ab, handoff);
+    ce_chan_set_handoff(chan_ba, handoff);
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    ce_task(chan_ping, NULL);
+    ce_task(chan_pong, NULL);
+    ce_run();
+    snprintf(param, sizeof(param), "bufsize=%d%s", bufsize,
+             handoff ? ",handoff" : "");
+    report("chan_pingpong", param, iters, ce_stats_now_ns() - start, &before);
+    ce_chan_destroy(&chan_ab);
+    ce_chan_destroy(&chan_ba);
+}
+
+// ~256 bytes of stack per frame
+static long deep_yield(int depth)
+{
+    volatile char frame[240];
+    long i;
+
+    frame[0] = (char)depth;
+    if (depth > 0) {
+        return deep_yield(depth - 1) + frame[0];
+    }
+    for (i = 0; i < iters; i++) {
+        ce_yield();
+    }
+    return frame[0];
+}
+
+static void deep_task(void *arg)
+{
+    deep_yield((int)(long)arg);
+}
+
+static void bench_stack_depth(int depth)
+{
+    ce_stats before;
+    unsigned long long start;
+    char param[32];
+
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    ce_task(deep_task, (void *)(long)depth);
+    ce_task(deep_task, (void *)(long)depth);
+    ce_run();
+    snprintf(param, sizeof(param), "depth=%d", depth);
+    report("stack_save", param, iters * 2, ce_stats_now_ns() - start, &before);
+}
+
+// a request handler's temporaries, all dead when the task exits
+static void malloc_task(void *arg)
+{
+    void *ptrs[ALLOCS_PER_TASK];
+    int i;
+
+    for (i = 0; i < ALLOCS_PER_TASK; i++) {
+        ptrs[i] = malloc(32 + i * 16);
+        memset(ptrs[i], 0, 32);
+    }
+    for (i = 0; i < ALLOCS_PER_TASK; i++) {
+        free(ptrs[i]);
+    }
+}
+
+static void arena_task(void *arg)
+{
+    int i;
+
+    for (i = 0; i < ALLOCS_PER_TASK; i++) {
+        memset(ce_task_alloc(32 + i * 16), 0, 32);
+    }
+}
+
+static void bench_task_alloc(int arena)
+{
+    ce_stats before;
+    unsigned long long start;
+    long i;
+
+    ce_stats_snapshot(&before);
+    start = ce_stats_now_ns();
+    for (i = 0; i < iters; i++) {
+        ce_task(arena ? arena_task : malloc_task, NULL);
+    }
+    ce_run();
+    report("task_alloc", arena ? "arena" : "malloc", iters,
+           ce_stats_now_ns() - start, &before);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *profile_fp = NULL;
+
+    if (argc > 1) {
+        iters = atol(argv[1]);
+        if (iters <= 0) {
+            printf("Usage: %s [iterations] [run_stacks] [profile_file]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+    if (argc > 2) {
+        run_stacks = atoi(argv[2]);
+        if (ce_set_run_stack_num(run_stacks) != 0) {
+            printf("ERROR: Invalid number of run stacks %s\n", argv[2]);
+            return -1;
+        }
+    }
+    // folded stacks of all the benches, for flamegraph.pl or speedscope
+    if (argc > 3) {
+        profile_fp = fopen(argv[3], "w");
+        if (profile_fp == NULL || ce_profile_start(CE_PROFILE_HZ) != CE_SUCCESS) {
+            printf("ERROR: Failed to profile into %s\n", argv[3]);
+            return -1;
+        }
+    }
+
+    bench_create_exit();
+    bench_yield();
+    bench_poller_wake();
+    bench_chan(0, 0);
+    bench_chan(1, 0);
+    bench_chan(64, 0);
+    bench_chan(0, 1);
+    // the two tasks only share a run stack, and copy it, when there is one
+    if (run_stacks == 1) {
+        bench_stack_depth(0);
+        bench_stack_depth(16);
+        bench_stack_depth(64);
+        bench_stack_depth(256);
+    } else {
+        printf("{\"bench\":\"stack_save\",\"skipped\":"
+               "\"needs 1 run stack, got %d\"}\n", run_stacks);
+    }
+    bench_task_alloc(0);
+    bench_task_alloc(1);
+
+    if (profile_fp != NULL) {
+        ce_profile_stop();
+        ce_profile_dump(profile_fp);
+        fclose(profile_fp);
+    }
+
+    return 0;
+}
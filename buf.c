@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "defs.h"
+#include "log.h"
+#include "buf.h"
+
+#define BUF_HEADER ((sizeof(ce_buf) + 15) & ~(size_t)15)
+
+/*
+  free buffers by size class, shared by all tasks of the unique scheduler
+  in the process; sizes beyond the largest class are allocated exactly
+  and never cached
+*/
+static ce_buf *free_bufs[CE_BUF_CLASSES];
+static int free_cnt[CE_BUF_CLASSES];
+static int in_use = 0;
+static size_t bytes_in_use = 0;
+
+static int class_of(size_t size)
+{
+    int cls = 0;
+
+    while (cls < CE_BUF_CLASSES && ((size_t)1 << (CE_BUF_MIN_SHIFT + cls)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+// the capacity a request of size is rounded up to
+size_t ce_buf_class_size(size_t size)
+{
+    int cls = class_of(size);
+
+    return cls < CE_BUF_CLASSES ? (size_t)1 << (CE_BUF_MIN_SHIFT + cls) : size;
+}
+
+ce_buf *ce_buf_get(size_t size)
+{
+    int cls = class_of(size);
+    size_t cap = ce_buf_class_size(size);
+    ce_buf *buf;
+
+    if (cls < CE_BUF_CLASSES && free_bufs[cls] != NULL) {
+        buf = free_bufs[cls];
+        free_bufs[cls] = buf->next;
+        free_cnt[cls]--;
+    } else {
+        buf = (ce_buf *)malloc(BUF_HEADER + cap);
+        if (buf == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for ce_buf of %zu bytes", cap);
+            return NULL;
+        }
+        buf->cap = cap;
+        buf->cls = cls;
+    }
+    buf->data = (char *)buf + BUF_HEADER;
+    buf->len = 0;
+    buf->refs = 1;
+    buf->next = NULL;
+    in_use++;
+    bytes_in_use += buf->cap;
+
+    return buf;
+}
+
+ce_buf *ce_buf_ref(ce_buf *buf)
+{
+    if (buf != NULL) {
+        buf->refs++;
+    }
+    return buf;
+}
+
+// drops one reference, the last one returns the buffer to the pool
+void ce_buf_put(ce_buf *buf)
+{
+    if (buf == NULL || --buf->refs > 0) {
+        return;
+    }
+    in_use--;
+    bytes_in_use -= buf->cap;
+    if (buf->cls >= CE_BUF_CLASSES || free_cnt[buf->cls] >= CE_BUF_CACHE_SIZE) {
+        free(buf);
+        return;
+    }
+    buf->next = free_bufs[buf->cls];
+    free_bufs[buf->cls] = buf;
+    free_cnt[buf->cls]++;
+}
+
+int ce_buf_in_use()
+{
+    return in_use;
+}
+
+size_t ce_buf_bytes_in_use()
+{
+    return bytes_in_use;
+}
+
+void ce_buf_clear_cache()
+{
+    ce_buf *buf;
+    int cls;
+
+    for (cls = 0; cls < CE_BUF_CLASSES; cls++) {
+        while ((buf = free_bufs[cls]) != NULL) {
+            free_bufs[cls] = buf->next;
+            free(buf);
+        }
+        free_cnt[cls] = 0;
+    }
+}
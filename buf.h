@@ -0,0 +1,33 @@
+#ifndef _COEVT_BUF_H_
+#define _COEVT_BUF_H_
+
+#include <stddef.h>
+
+#define CE_BUF_MIN_SHIFT 8      // the smallest class holds 256 bytes
+#define CE_BUF_CLASSES 6        // up to 256 << 5, 8K
+#define CE_BUF_CACHE_SIZE 256   // free buffers kept per class
+#define CE_BUF_MAX_SIZE ((size_t)1 << (CE_BUF_MIN_SHIFT + CE_BUF_CLASSES - 1))
+
+/*
+  a reference counted buffer from the pool shared by all tasks,
+  data and len describe the valid bytes and may be narrowed by the owner
+*/
+typedef struct ce_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int refs;
+    int cls;
+    struct ce_buf *next;
+} ce_buf;
+
+ce_buf *ce_buf_get(size_t size);
+ce_buf *ce_buf_ref(ce_buf *buf);
+void ce_buf_put(ce_buf *buf);
+size_t ce_buf_class_size(size_t size);
+
+int ce_buf_in_use();
+size_t ce_buf_bytes_in_use();
+void ce_buf_clear_cache();
+
+#endif
@@ -2,15 +2,27 @@
 #include <stdio.h>
 #include <string.h>
 #include "defs.h"
+#include "log.h"
 #include "coroutine.h"
+#include "trace.h"
 #include "channel.h"
 
 #define CE_SEND 1
 #define CE_RECV 2
 
+#define CE_BLKD_WAITING 0
+#define CE_BLKD_WOKEN 1
+#define CE_BLKD_DESTROYED 2
+
+/*
+  a blocked coroutine waits on an element allocated on the heap,
+  data is handed over through the element instead of the receiver's stack,
+  because the stack of a blocked coroutine is swapped out of run stack
+*/
 typedef struct ce_blkd {
     int crtn_id;
-    void **data_ptr;
+    int status;
+    void *data;
     struct ce_blkd *next;
 } ce_blkd;
 
@@ -22,6 +34,7 @@ typedef struct ce_blkd_q {
 
 struct ce_channel {
     int cap;
+    int handoff;  // the woken counterpart runs as soon as this one pauses
     int head;
     int size;
     ce_blkd_q send_q;
@@ -37,7 +50,7 @@ ce_channel *ce_chan_create(int bufsize)
     size_in_bytes = sizeof(ce_channel);
     chan = (ce_channel *)malloc(size_in_bytes);
     if (chan == NULL) {
-        printf("ERROR: Failed to allocate space for ce_channel\n");
+        CE_LOG_ERROR("Failed to allocate space for ce_channel");
         return NULL;
     }
     memset(chan, 0, size_in_bytes);
@@ -46,7 +59,7 @@ ce_channel *ce_chan_create(int bufsize)
         size_in_bytes = sizeof(void *) * bufsize;
         chan->buf = (void **)malloc(size_in_bytes);
         if (chan->buf == NULL) {
-            printf("ERROR: Failed to allocate space for buffer of channel\n");
+            CE_LOG_ERROR("Failed to allocate space for buffer of channel");
             free(chan);
             return NULL;
         }
@@ -75,7 +88,7 @@ static ce_blkd *dequeue(ce_blkd_q *q)
 {
     ce_blkd *ele;
     if (q->size == 0) {
-        printf("ERROR: Failed to dequeue, queue is empty\n");
+        CE_LOG_ERROR("Failed to dequeue, queue is empty");
         return NULL;
     }
     ele = q->head;
@@ -85,10 +98,30 @@ static ce_blkd *dequeue(ce_blkd_q *q)
     return ele;
 }
 
-static void unblock_task(ce_channel *chan, int op_type)
+int ce_chan_set_handoff(ce_channel *chan, int on)
+{
+    if (chan == NULL) {
+        return CE_FAILURE;
+    }
+    chan->handoff = on ? TRUE : FALSE;
+
+    return CE_SUCCESS;
+}
+
+// buffered items, not counting senders blocked on a full buffer
+int ce_chan_len(ce_channel *chan)
+{
+    return chan == NULL ? 0 : chan->size;
+}
+
+int ce_chan_cap(ce_channel *chan)
+{
+    return chan == NULL ? 0 : chan->cap;
+}
+
+static ce_blkd *unblock_task(ce_channel *chan, int op_type, int status)
 {
     ce_blkd_q *q;
-    int crtn_id;
     ce_blkd *ele;
 
     if (op_type == CE_SEND) {
@@ -97,29 +130,30 @@ static void unblock_task(ce_channel *chan, int op_type)
         q = &(chan->recv_q);
     }
     if (q->size == 0) {
-        printf("ERROR: Could not unblock a task of op_type %d\n", op_type);
-        return;
+        CE_LOG_ERROR("Could not unblock a task of op_type %d", op_type);
+        return NULL;
     }
+    // the element is freed by the woken coroutine
     ele = dequeue(q);
-    crtn_id = ele->crtn_id;
-    free(ele);
-    ce_set_coroutine_status(crtn_id, CE_COROUTINE_SUSPENDED);
-}
-
+    ele->status = status;
+    CE_TRACE_EVT(CE_TRACE_CHAN_UNBLOCK, ele->crtn_id, (long)chan);
+    ce_set_coroutine_status(ele->crtn_id, CE_COROUTINE_SUSPENDED);
+    if (chan->handoff && status == CE_BLKD_WOKEN) {
+        ce_coroutine_run_next(ele->crtn_id);
+    }
 
-static void unblock_one_recver(ce_channel *chan)
-{
-    unblock_task(chan, CE_RECV);
+    return ele;
 }
 
 static void send_to_recver(ce_channel *chan, void *data)
 {
     ce_blkd *recver = peek(&(chan->recv_q));
     if (recver == NULL) {
-        printf("ERROR: There's no receiver, so could not send data to any receiver\n");
+        CE_LOG_ERROR("There's no receiver, so could not send data to any receiver");
         return;
     }
-    *(recver->data_ptr) = data;
+    recver->data = data;
+    unblock_task(chan, CE_RECV, CE_BLKD_WOKEN);
 }
 
 static void send_to_buffer(ce_channel *chan, void *data)
@@ -127,7 +161,7 @@ static void send_to_buffer(ce_channel *chan, void *data)
     int offset;
 
     if (chan->size == chan->cap) {
-        printf("ERROR: Buffer of channel is full, could not send data to buffer\n");
+        CE_LOG_ERROR("Buffer of channel is full, could not send data to buffer");
         return;
     }
 
@@ -136,27 +170,39 @@ static void send_to_buffer(ce_channel *chan, void *data)
     ++chan->size;
 }
 
-static void blkd_wait(ce_channel *chan, void **data_ptr, int op_type)
+static int blkd_wait(ce_channel *chan, void **data_ptr, int op_type)
 {
+    int status;
     ce_blkd *ele = (ce_blkd *)malloc(sizeof(ce_blkd));
     if (ele == NULL) {
-        printf("ERROR: Could not allocate space for a ce_blkd\n");
-        return;
+        CE_LOG_ERROR("Could not allocate space for a ce_blkd");
+        return CE_FAILURE;
     }
     ele->crtn_id = ce_cur_coroutine();
-    ele->data_ptr = data_ptr;
+    ele->status = CE_BLKD_WAITING;
+    ele->data = NULL;
     ele->next = NULL;
     if (op_type == CE_SEND) {
         enqueue(&(chan->send_q), ele);
     } else {
         enqueue(&(chan->recv_q), ele);
     }
+    CE_TRACE_EVT(CE_TRACE_CHAN_BLOCK, ele->crtn_id, (long)chan);
     ce_coroutine_block();
+
+    // chan may be freed already if it was destroyed while blocking
+    status = ele->status;
+    if (status == CE_BLKD_WOKEN && data_ptr != NULL) {
+        *data_ptr = ele->data;
+    }
+    free(ele);
+
+    return status == CE_BLKD_WOKEN ? CE_SUCCESS : CE_FAILURE;
 }
 
-static void sender_wait(ce_channel *chan)
+static int sender_wait(ce_channel *chan)
 {
-    blkd_wait(chan, NULL, CE_SEND);
+    return blkd_wait(chan, NULL, CE_SEND);
 }
 
 int ce_chan_send(ce_channel *chan, void *data)
@@ -172,7 +218,6 @@ int ce_chan_send(ce_channel *chan, void *data)
         // send to one directly and unblock it
         if (chan->recv_q.size > 0) {
             send_to_recver(chan, data);
-            unblock_one_recver(chan);
             return CE_SUCCESS;
         }
 
@@ -184,14 +229,17 @@ int ce_chan_send(ce_channel *chan, void *data)
         }
 
         // if the channel is unbuffered or buffer is full,
-        // block the current coroutine and add to senders waiting queue
-        sender_wait(chan);
+        // block the current coroutine and add to senders waiting queue,
+        // try again after a receiver unblocks it
+        if (sender_wait(chan) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
     }
 }
 
-static void unblock_one_sender(ce_channel *chan)
+static void unblock_one_sender(ce_channel *chan, int status)
 {
-    unblock_task(chan, CE_SEND);
+    unblock_task(chan, CE_SEND, status);
 }
 
 static void *recv_from_buffer(ce_channel *chan)
@@ -199,23 +247,26 @@ static void *recv_from_buffer(ce_channel *chan)
     int offset;
 
     if (chan->cap == 0) {
-        printf("ERROR: Channel is unbeffered, could not receive data from buffer\n");
+        CE_LOG_ERROR("Channel is unbeffered, could not receive data from buffer");
+        return NULL;
     }
     if (chan->size == 0) {
-        printf("ERROR: Channel is empty, could not receive data from buffer\n");
+        CE_LOG_ERROR("Channel is empty, could not receive data from buffer");
+        return NULL;
     }
 
     offset = chan->head;
     chan->head = (chan->head + 1) % chan->cap;
+    --chan->size;
     return *(chan->buf + offset);
 }
 
-static void recver_wait(ce_channel *chan, void **data_ptr)
+static int recver_wait(ce_channel *chan, void **data_ptr)
 {
-    blkd_wait(chan, data_ptr, CE_SEND);
+    return blkd_wait(chan, data_ptr, CE_RECV);
 }
 
-int ce_chan_recv(ce_channel *chan, void *data)
+int ce_chan_recv(ce_channel *chan, void **data)
 {
     // if channel is destroyed, return FAILURE
     if (chan == NULL) {
@@ -226,9 +277,9 @@ int ce_chan_recv(ce_channel *chan, void *data)
     // receive data from buffer,
     // and unblock a sender if there is.
     if (chan->cap > 0 && chan->size > 0) {
-        data = recv_from_buffer(chan);
+        *data = recv_from_buffer(chan);
         if (chan->send_q.size > 0) {
-            unblock_one_sender(chan);
+            unblock_one_sender(chan, CE_BLKD_WOKEN);
         }
         return CE_SUCCESS;
     }
@@ -237,14 +288,9 @@ int ce_chan_recv(ce_channel *chan, void *data)
     // but before that should first unblock a sender if there is,
     // otherwise waiting senders will be blocked forever.
     if (chan->send_q.size > 0) {
-        unblock_one_sender(chan);
+        unblock_one_sender(chan, CE_BLKD_WOKEN);
     }
-    recver_wait(chan, &data);
-    // check again whether channel is destroyed
-    if (chan == NULL) {
-        return CE_FAILURE;
-    }
-    return CE_SUCCESS;
+    return recver_wait(chan, data);
 }
 
 void ce_chan_destroy(ce_channel **chan_ptr)
@@ -257,12 +303,12 @@ void ce_chan_destroy(ce_channel **chan_ptr)
         free((*chan_ptr)->buf);
     }
     // unblock all pending coroutines,
-    // when they resume, they will find chan is null and return CE_FAILURE
+    // when they resume, they will find the channel destroyed and return CE_FAILURE
     while ((*chan_ptr)->recv_q.size > 0) {
-        unblock_one_recver(*chan_ptr);
+        unblock_task(*chan_ptr, CE_RECV, CE_BLKD_DESTROYED);
     }
     while ((*chan_ptr)->send_q.size > 0) {
-        unblock_one_sender(*chan_ptr);
+        unblock_task(*chan_ptr, CE_SEND, CE_BLKD_DESTROYED);
     }
     free(*chan_ptr);
 
@@ -279,7 +325,7 @@ int ce_chan_sendl(ce_channel *chan, long n)
 int ce_chan_recvl(ce_channel *chan, long *p)
 {
     void *n = NULL;
-    int ret = ce_chan_recv(chan, n);
+    int ret = ce_chan_recv(chan, &n);
     *p = (long)n;
     return ret;
 }
@@ -5,8 +5,11 @@ typedef struct ce_channel ce_channel;
 
 ce_channel *ce_chan_create(int bufsize);
 int ce_chan_send(ce_channel *chan, void *data);
-int ce_chan_recv(ce_channel *chan, void *data);
+int ce_chan_recv(ce_channel *chan, void **data);
 void ce_chan_destroy(ce_channel **chan_ptr);
+int ce_chan_set_handoff(ce_channel *chan, int on);
+int ce_chan_len(ce_channel *chan);
+int ce_chan_cap(ce_channel *chan);
 
 int ce_chan_sendl(ce_channel *chan, long n);
 int ce_chan_recvl(ce_channel *chan, long *p);
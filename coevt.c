@@ -1,27 +1,107 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include "defs.h"
+#include "log.h"
 #include "poller.h"
 #include "coroutine.h"
+#include "timer.h"
+#include "stats.h"
+#include "buf.h"
 #include "coevt.h"
 
+/*
+  eventfd in the poller, readable while the loop has work that isn't an
+  fd event, so that a host loop watching ce_backend_fd calls ce_run_once
+*/
+static int wakeup_fd = -1;
+static int wakeup_armed = FALSE;
+static int in_run_once = FALSE;
+
+static void arm_wakeup()
+{
+    uint64_t one = 1;
+
+    if (wakeup_fd < 0 || wakeup_armed) {
+        return;
+    }
+    if (write(wakeup_fd, &one, sizeof(one)) == sizeof(one)) {
+        wakeup_armed = TRUE;
+    }
+}
+
+static void drain_wakeup()
+{
+    uint64_t cnt;
+
+    if (wakeup_armed && read(wakeup_fd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+        wakeup_armed = FALSE;
+    }
+}
+
+// work added by the host between two calls of ce_run_once
+static void note_work()
+{
+    if (!in_run_once) {
+        arm_wakeup();
+    }
+}
+
 int ce_task(task_func func, void *arg)
 {
     int crtn_id;
     if ((crtn_id = ce_coroutine_create(func, arg)) == CE_DUMMY_COROUTINE_ID) {
         return CE_FAILURE;
     }
+    note_work();
 
     return CE_SUCCESS;
     // Don't resume immediately so that can create task within another task
 }
 
+int ce_task_inline(task_func func, size_t size, task_func dtor, void **space)
+{
+    if (ce_coroutine_create_inline(func, size, dtor, space)
+        == CE_DUMMY_COROUTINE_ID) {
+        return CE_FAILURE;
+    }
+    note_work();
+
+    return CE_SUCCESS;
+}
+
 int ce_cur_task()
 {
     return ce_cur_coroutine();
 }
 
+void *ce_task_alloc(size_t size)
+{
+    ce_arena_chunk **arena = ce_coroutine_arena(ce_cur_coroutine());
+
+    if (arena == NULL) {
+        CE_LOG_ERROR("ce_task_alloc is only available within a task");
+        return NULL;
+    }
+
+    return ce_arena_alloc(arena, size);
+}
+
+void ce_task_arena_reset()
+{
+    ce_arena_chunk **arena = ce_coroutine_arena(ce_cur_coroutine());
+
+    if (arena != NULL) {
+        ce_arena_reset(arena);
+    }
+}
+
 int ce_listen(int fd, int event)
 {
     if (!ce_poller_initialized()) {
@@ -30,8 +110,9 @@ int ce_listen(int fd, int event)
         }
     }
 
+    // other coroutines may wait for the same event, each one is queued
     if (ce_poller_lookup(fd, event) == CE_SUCCESS) {
-        printf("INFO: Event already listened on fd %d\n", fd);
+        CE_LOG_DEBUG("Event already listened on fd %d", fd);
         return CE_SUCCESS;
     }
 
@@ -42,15 +123,26 @@ int ce_listen(int fd, int event)
     return CE_SUCCESS;
 }
 
+int ce_set_wake_mode(int fd, int wake_mode)
+{
+    if (!ce_poller_initialized()) {
+        if (ce_poller_init(MAX_FD_NUM) != 0) {
+            return CE_FAILURE;
+        }
+    }
+
+    return ce_poller_set_wake_mode(fd, wake_mode);
+}
+
 int ce_unlisten(int fd, int event)
 {
     if (!ce_poller_initialized()) {
-        printf("INFO: Poller is not initialized\n");
+        CE_LOG_INFO("Poller is not initialized");
         return CE_FAILURE;
     }
 
     if (ce_poller_lookup(fd, event) != CE_SUCCESS) {
-        printf("INFO: Event is not listened on fd %d\n", fd);
+        CE_LOG_INFO("Event is not listened on fd %d", fd);
         return CE_FAILURE;
     }
 
@@ -73,25 +165,307 @@ int ce_wait()
     return CE_SUCCESS;
 }
 
-int ce_run()
+int ce_wait_timeout(int timeout_ms)
+{
+    return ce_coroutine_block_timeout(timeout_ms);
+}
+
+int ce_sleep(int ms)
 {
-    while (ce_coroutine_cnt() > 0) {
-        int crtn_id;
+    // nobody else wakes the coroutine up, so it always times out
+    if (ce_coroutine_block_timeout(ms > 0 ? ms : 0) == CE_FAILURE) {
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
 
-        if (ce_poller_poll(POLL_TIMEOUT) != CE_SUCCESS) {
+int ce_task_prio(task_func func, void *arg, int prio)
+{
+    if (ce_coroutine_create_prio(func, arg, prio) == CE_DUMMY_COROUTINE_ID) {
+        return CE_FAILURE;
+    }
+    note_work();
+
+    return CE_SUCCESS;
+}
+
+static int prio_share = PRIO_SHARE;
+
+int ce_set_prio_share(int share)
+{
+    if (share <= 0) {
+        return CE_FAILURE;
+    }
+    prio_share = share;
+
+    return CE_SUCCESS;
+}
+
+typedef struct ce_deferred {
+    ready_func func;
+    void *arg;
+    int closed;  // a ce_on_ready callback dropped by ce_close
+} ce_deferred;
+
+/*
+  calls made by the run loop on the next tick, and the number of holds
+  keeping it running, for work that isn't a coroutine (stackless tasks)
+*/
+static ce_deferred *deferred = NULL;
+static int deferred_cnt = 0;
+static int deferred_cap = 0;
+static int holds = 0;
+static int running_closed = FALSE;
+
+static int push_deferred(ready_func func, void *arg, int closed)
+{
+    ce_deferred *new_arr;
+    int new_cap;
+
+    if (deferred_cnt == deferred_cap) {
+        new_cap = deferred_cap > 0 ? deferred_cap * 2 : INIT_CAPACITY;
+        new_arr = (ce_deferred *)realloc(deferred, sizeof(ce_deferred) * new_cap);
+        if (new_arr == NULL) {
+            CE_LOG_ERROR("Failed to enlarge deferred calls");
             return CE_FAILURE;
         }
-        if (ce_poller_react() != CE_SUCCESS) {
+        deferred = new_arr;
+        deferred_cap = new_cap;
+    }
+    deferred[deferred_cnt].func = func;
+    deferred[deferred_cnt].arg = arg;
+    deferred[deferred_cnt].closed = closed;
+    deferred_cnt++;
+    note_work();
+
+    return CE_SUCCESS;
+}
+
+int ce_defer(ready_func func, void *arg)
+{
+    return push_deferred(func, arg, FALSE);
+}
+
+int ce_after(int ms, ready_func func, void *arg)
+{
+    if (ce_timer_add(ms > 0 ? ms : 0, func, arg) == NULL) {
+        return CE_FAILURE;
+    }
+    // a host loop may be waiting longer than this timer
+    note_work();
+
+    return CE_SUCCESS;
+}
+
+void ce_hold()
+{
+    holds++;
+}
+
+void ce_release()
+{
+    holds--;
+}
+
+int ce_on_ready(int fd, int event, ready_func func, void *arg)
+{
+    if (!ce_poller_initialized()) {
+        if (ce_poller_init(MAX_FD_NUM) != 0) {
             return CE_FAILURE;
         }
-        for (crtn_id = 0; crtn_id < ce_coroutine_cnt(); crtn_id++) {
-        // must use ce_coroutine_cnt to get coroutine counts dynamiclly 
+    }
+
+    return ce_poller_add_cb(fd, event, func, arg);
+}
+
+int ce_ready_closed()
+{
+    return running_closed;
+}
+
+static void run_deferred()
+{
+    ce_deferred call;
+    int cnt = deferred_cnt;
+    int i;
+
+    // calls deferred by these ones wait for the next tick
+    for (i = 0; i < cnt; i++) {
+        call = deferred[i];
+        running_closed = call.closed;
+        call.func(call.arg);
+        running_closed = FALSE;
+    }
+    memmove(deferred, deferred + cnt, sizeof(ce_deferred) * (deferred_cnt - cnt));
+    deferred_cnt -= cnt;
+}
+
+static int poll_and_react(int timeout)
+{
+    if (ce_poller_poll(deferred_cnt > 0 ? 0 : timeout) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    if (ce_poller_react() != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    if (ce_timer_process() != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    run_deferred();
+
+    return CE_SUCCESS;
+}
+
+static void run_level(int prio)
+{
+    int idx;
+
+    ce_coroutine_level_begin_scan(prio);
+    for (idx = 0; idx < ce_coroutine_level_cnt(prio); idx++) {
+    // must use ce_coroutine_level_cnt to get coroutine counts dynamiclly
+        int crtn_id = ce_coroutine_level_at(prio, idx);
+        int status = ce_get_coroutine_status(crtn_id);
+        if (status == CE_COROUTINE_READY
+            || status == CE_COROUTINE_SUSPENDED) {
+            ce_coroutine_resume(crtn_id);
+        }
+    }
+    ce_coroutine_level_end_scan(prio);
+}
+
+static int has_higher_level(int prio)
+{
+    int higher;
+
+    for (higher = 0; higher < prio; higher++) {
+        if (ce_coroutine_level_cnt(higher) > 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static int run_tick()
+{
+    int prio, higher, idx;
+    int since_check = 0;
+
+    // higher levels are drained first, a lower level gets prio_share
+    // resumes before events are polled again and higher levels rerun
+    for (prio = 0; prio < CE_PRIO_NUM; prio++) {
+        int check = has_higher_level(prio);
+
+        // exits leave holes until the scan is over, so none is skipped
+        ce_coroutine_level_begin_scan(prio);
+        for (idx = 0; idx < ce_coroutine_level_cnt(prio); idx++) {
+            int crtn_id = ce_coroutine_level_at(prio, idx);
             int status = ce_get_coroutine_status(crtn_id);
-            if (status == CE_COROUTINE_READY
-                || status == CE_COROUTINE_SUSPENDED) {
-                ce_coroutine_resume(crtn_id);
+            if (status != CE_COROUTINE_READY
+                && status != CE_COROUTINE_SUSPENDED) {
+                continue;
+            }
+            ce_coroutine_resume(crtn_id);
+            if (check && ++since_check >= prio_share) {
+                since_check = 0;
+                if (poll_and_react(0) != CE_SUCCESS) {
+                    ce_coroutine_level_end_scan(prio);
+                    return CE_FAILURE;
+                }
+                for (higher = 0; higher < prio; higher++) {
+                    run_level(higher);
+                }
             }
         }
+        ce_coroutine_level_end_scan(prio);
+    }
+
+    return CE_SUCCESS;
+}
+
+// parked fds spawn coroutines later, so they keep the loop running too
+static int has_work()
+{
+    return ce_coroutine_cnt() > 0 || ce_poller_handler_cnt() > 0
+           || holds > 0 || deferred_cnt > 0;
+}
+
+int ce_backend_fd()
+{
+    if (!ce_poller_initialized()) {
+        if (ce_poller_init(MAX_FD_NUM) != 0) {
+            return CE_FAILURE;
+        }
+    }
+    if (wakeup_fd < 0) {
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd == -1) {
+            CE_LOG_ERROR("Failed to create wakeup fd of the run loop");
+            return CE_FAILURE;
+        }
+        if (ce_poller_add_wakeup(wakeup_fd) != CE_SUCCESS) {
+            close(wakeup_fd);
+            wakeup_fd = -1;
+            return CE_FAILURE;
+        }
+    }
+    if (ce_coroutine_runnable() > 0 || deferred_cnt > 0) {
+        arm_wakeup();
+    }
+
+    return ce_poller_fd();
+}
+
+int ce_backend_timeout()
+{
+    if (ce_coroutine_runnable() > 0 || deferred_cnt > 0) {
+        return 0;
+    }
+
+    return ce_timer_next_ms();
+}
+
+/*
+  one round of the run loop, waits for events no longer than timeout ms,
+  nor when there is runnable work or a timer is due first;
+  TRUE while there is work left, the scheduler is kept unlike ce_run
+*/
+int ce_run_once(int timeout)
+{
+    unsigned long long tick_start = CE_STATS_NOW();
+    int wait = ce_backend_timeout();
+    int ret = CE_SUCCESS;
+
+    if (wait < 0 || (timeout >= 0 && timeout < wait)) {
+        wait = timeout;
+    }
+    in_run_once = TRUE;
+    drain_wakeup();
+    if (poll_and_react(wait) != CE_SUCCESS || run_tick() != CE_SUCCESS) {
+        ret = CE_FAILURE;
+    }
+    in_run_once = FALSE;
+    if (ret != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    CE_STATS_RECORD(tick_ns, CE_STATS_NOW() - tick_start);
+    CE_STATS_ADD(ticks, 1);
+
+    // keep the backend fd readable for what is still runnable
+    if (ce_coroutine_runnable() > 0 || deferred_cnt > 0) {
+        arm_wakeup();
+    }
+
+    return has_work();
+}
+
+int ce_run()
+{
+    while (has_work()) {
+        if (ce_run_once(POLL_TIMEOUT) == CE_FAILURE) {
+            return CE_FAILURE;
+        }
     }
 
     return ce_close_scheduler();
@@ -104,60 +478,385 @@ int ce_set_nonblock(int fd)
     flags |= O_NONBLOCK;
     flags |= O_NDELAY;
     if (fcntl(fd, F_SETFL, flags) != 0) {
-        printf("ERROR: Failed to set fd %d to nonblock\n", fd);
+        CE_LOG_ERROR("Failed to set fd %d to nonblock", fd);
         return CE_FAILURE;
     }
 
     return CE_SUCCESS;
 }
 
-ssize_t ce_read(int fd, void *buf, size_t count)
+/*
+  tried before parking, and again after every wakeup, since another
+  coroutine waiting on the same fd may have taken the data first
+*/
+static ssize_t io_wait(int fd, void *buf, size_t count, int event)
 {
     ssize_t ret;
 
+    while (TRUE) {
+        if (event == CE_READ) {
+            ret = read(fd, buf, count);
+        } else {
+            ret = write(fd, buf, count);
+        }
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return CE_FAILURE;
+        }
+
+        if (ce_listen(fd, event) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        if (ce_wait() != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        ce_unlisten(fd, event);
+    }
+}
+
+ssize_t ce_read(int fd, void *buf, size_t count)
+{
     if (ce_set_nonblock(fd) == CE_FAILURE) {
-        printf("ERROR: Failed to set read fd nonblock\n");
+        CE_LOG_ERROR("Failed to set read fd nonblock");
+        return CE_FAILURE;
+    }
+
+    return io_wait(fd, buf, count, CE_READ);
+}
+
+static int wait_readable(int fd)
+{
+    if (ce_listen(fd, CE_READ) != CE_SUCCESS) {
         return CE_FAILURE;
     }
-    ce_listen(fd, CE_READ);
     if (ce_wait() != CE_SUCCESS) {
         return CE_FAILURE;
     }
-
-    ret = read(fd, buf, count);
     ce_unlisten(fd, CE_READ);
 
-    return ret;
+    return CE_SUCCESS;
 }
 
-ssize_t ce_write(int fd, const void *buf, size_t count)
+/*
+  no buffer is held while the task waits, one sized by the bytes queued
+  on the fd is taken from the pool once they are there; the caller owns
+  the returned reference, *buf_ptr is NULL on EOF or failure
+*/
+ssize_t ce_read_pooled(int fd, ce_buf **buf_ptr)
 {
+    int ready = FALSE;
+    int avail;
+    size_t size;
     ssize_t ret;
+    ce_buf *buf;
 
+    *buf_ptr = NULL;
     if (ce_set_nonblock(fd) == CE_FAILURE) {
-        printf("ERROR: Failed to set write fd nonblock\n");
+        CE_LOG_ERROR("Failed to set read fd nonblock");
         return CE_FAILURE;
     }
-    ce_listen(fd, CE_WRITE);
-    if (ce_wait() != CE_SUCCESS) {
+
+    while (TRUE) {
+        if (ioctl(fd, FIONREAD, &avail) != 0) {
+            avail = -1;
+        }
+        if (avail == 0 && !ready) {
+            if (wait_readable(fd) != CE_SUCCESS) {
+                return CE_FAILURE;
+            }
+            ready = TRUE;
+            continue;
+        }
+
+        // readable with nothing queued is EOF or an error, a small buffer
+        // finds out which; an unknown amount takes the largest class
+        size = avail < 0 ? CE_BUF_MAX_SIZE : (size_t)avail;
+        if (size > CE_BUF_MAX_SIZE) {
+            size = CE_BUF_MAX_SIZE;
+        }
+        buf = ce_buf_get(size);
+        if (buf == NULL) {
+            return CE_FAILURE;
+        }
+        ret = read(fd, buf->data, buf->cap);
+        if (ret > 0) {
+            buf->len = ret;
+            *buf_ptr = buf;
+            return ret;
+        }
+        ce_buf_put(buf);
+        if (ret == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return CE_FAILURE;
+        }
+        if (wait_readable(fd) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        ready = TRUE;
+    }
+}
+
+ssize_t ce_write(int fd, const void *buf, size_t count)
+{
+    if (ce_set_nonblock(fd) == CE_FAILURE) {
+        CE_LOG_ERROR("Failed to set write fd nonblock");
         return CE_FAILURE;
     }
 
-    ret = write(fd, buf, count);
-    ce_unlisten(fd, CE_WRITE);
+    return io_wait(fd, (void *)buf, count, CE_WRITE);
+}
+
+ssize_t ce_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    // the fd must be nonblocking, a socket is writable most of the time
+    // so park only when the send buffer is full
+    while (TRUE) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return CE_FAILURE;
+        }
 
-    return ret;
+        if (ce_listen(fd, CE_WRITE) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        if (ce_wait() != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        ce_unlisten(fd, CE_WRITE);
+    }
 }
 
 int ce_close(int fd)
 {
-    if (ce_poller_lookup(fd, CE_READ) != CE_SUCCESS
-        && ce_poller_lookup(fd, CE_WRITE) != CE_SUCCESS) {
+    ready_func funcs[2];
+    void *args[2];
+    int cnt, i;
+
+    if (ce_poller_initialized()) {
+        // drops the registration of ce_on_readable and the wake mode
+        ce_poller_set_handler(fd, NULL, NULL);
+        ce_poller_set_wake_mode(fd, CE_WAKE_ONE);
+        // callbacks of ce_on_ready still run, on the next tick, where
+        // ce_ready_closed tells them the fd is gone; the fd leaves epoll
+        // before a new one can take its number
+        cnt = ce_poller_drop_cbs(fd, funcs, args);
+        for (i = 0; i < cnt; i++) {
+            if (push_deferred(funcs[i], args[i], TRUE) != CE_SUCCESS) {
+                CE_LOG_ERROR("Failed to resume a waiter of closed fd %d", fd);
+            }
+        }
+    }
+    if (ce_poller_waiters(fd, CE_READ) == 0
+        && ce_poller_waiters(fd, CE_WRITE) == 0) {
         if (close(fd) != 0) {
-            printf("ERROR: Failed to close fd\n");
+            CE_LOG_ERROR("Failed to close fd");
             return CE_FAILURE;
         }
     }
 
     return CE_SUCCESS;
 }
+
+int ce_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int cli_fd;
+
+    // the listening fd must be nonblocking, otherwise accept4 blocks the
+    // scheduler once the backlog is drained
+    while (TRUE) {
+        cli_fd = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cli_fd != -1) {
+            return cli_fd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            CE_LOG_ERROR("Failed to accept connection on fd %d", fd);
+            return CE_FAILURE;
+        }
+
+        // backlog is drained, park until the listening fd is readable again
+        if (ce_listen(fd, CE_READ) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        if (ce_wait() != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+        ce_unlisten(fd, CE_READ);
+    }
+}
+
+typedef struct ce_server {
+    conn_handler handler;
+    void *handler_arg;
+    int max_conns;
+    int active;
+    int acceptor;
+} ce_server;
+
+typedef struct ce_conn_arg {
+    ce_server *server;
+    int fd;
+} ce_conn_arg;
+
+static void wake_acceptor(ce_server *server)
+{
+    if (server->acceptor != CE_DUMMY_COROUTINE_ID) {
+        ce_set_coroutine_status(server->acceptor, CE_COROUTINE_SUSPENDED);
+        server->acceptor = CE_DUMMY_COROUTINE_ID;
+    }
+}
+
+static void serve_conn(void *arg)
+{
+    ce_conn_arg *conn = (ce_conn_arg *)arg;
+    ce_server *server = conn->server;
+    int fd = conn->fd;
+
+    free(conn);
+    server->handler(fd, server->handler_arg);
+    server->active--;
+    wake_acceptor(server);
+}
+
+static void wait_for_slot(ce_server *server, int max_active)
+{
+    while (server->active > max_active) {
+        server->acceptor = ce_cur_task();
+        ce_wait();
+    }
+}
+
+int ce_serve(int listen_fd, conn_handler handler, void *arg,
+             int max_concurrency)
+{
+    ce_server *server;
+    ce_conn_arg *conn;
+    int cli_fd;
+
+    if (ce_set_nonblock(listen_fd) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+
+    // server state is shared with the connection tasks,
+    // so it can't live on the (copied) stack of the accepting task
+    server = (ce_server *)malloc(sizeof(ce_server));
+    if (server == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_server");
+        return CE_FAILURE;
+    }
+    server->handler = handler;
+    server->handler_arg = arg;
+    server->max_conns = max_concurrency;
+    server->active = 0;
+    server->acceptor = CE_DUMMY_COROUTINE_ID;
+
+    while (TRUE) {
+        if (server->max_conns > 0) {
+            wait_for_slot(server, server->max_conns - 1);
+        }
+
+        cli_fd = ce_accept(listen_fd, NULL, NULL);
+        if (cli_fd == CE_FAILURE) {
+            break;
+        }
+
+        conn = (ce_conn_arg *)malloc(sizeof(ce_conn_arg));
+        if (conn == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for ce_conn_arg");
+            close(cli_fd);
+            continue;
+        }
+        conn->server = server;
+        conn->fd = cli_fd;
+        if (ce_task(serve_conn, conn) != CE_SUCCESS) {
+            CE_LOG_ERROR("Failed to create task for fd %d", cli_fd);
+            free(conn);
+            close(cli_fd);
+            continue;
+        }
+        server->active++;
+    }
+
+    // running connection tasks still refer to the server
+    wait_for_slot(server, 0);
+    free(server);
+
+    return CE_FAILURE;
+}
+
+int ce_on_readable(int fd, readable_handler handler, void *arg)
+{
+    if (!ce_poller_initialized()) {
+        if (ce_poller_init(MAX_FD_NUM) != 0) {
+            return CE_FAILURE;
+        }
+    }
+    if (ce_set_nonblock(fd) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+
+    // only the fd and the callback are kept until input arrives
+    return ce_poller_set_handler(fd, handler, arg);
+}
+
+int ce_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+               int timeout_ms)
+{
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    int ret;
+
+    if (ce_set_nonblock(fd) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    if (connect(fd, addr, addrlen) == 0) {
+        return CE_SUCCESS;
+    }
+    if (errno != EINPROGRESS && errno != EINTR) {
+        return CE_FAILURE;
+    }
+
+    // connection completes (or fails) when the fd becomes writable
+    if (ce_listen(fd, CE_WRITE) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    ret = ce_wait_timeout(timeout_ms);
+    ce_unlisten(fd, CE_WRITE);
+    if (ret == CE_TIMEOUT) {
+        errno = ETIMEDOUT;
+        return CE_FAILURE;
+    }
+    if (ret != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) {
+        return CE_FAILURE;
+    }
+    if (err != 0) {
+        errno = err;
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
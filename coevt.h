@@ -2,20 +2,75 @@
 #define _COEVT_H_
 
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "buf.h"
+
+// results of the calls below
+#define CE_SUCCESS 0
+#define CE_FAILURE -1
+#define CE_TIMEOUT -2
+
+// events of ce_listen and ce_on_ready
+#define CE_READ 1
+#define CE_WRITE 2
+
+// ce_set_wake_mode, waking tasks blocked on the same fd and event
+#define CE_WAKE_ONE 0 // the longest waiting one, the default
+#define CE_WAKE_ALL 1
+
+// levels of ce_task_prio, lower value runs first
+#define CE_PRIO_HIGH 0
+#define CE_PRIO_NORMAL 1
+#define CE_PRIO_LOW 2
+#define CE_PRIO_NUM 3
 
 typedef void (*task_func)(void *arg);
+typedef void (*conn_handler)(int fd, void *arg);
+typedef int (*readable_handler)(int fd, void *arg);
+typedef void (*ready_func)(void *arg);
 int ce_task(task_func func, void *arg);
+int ce_task_prio(task_func func, void *arg, int prio);
+int ce_task_inline(task_func func, size_t size, task_func dtor, void **space);
+int ce_set_prio_share(int share);
 int ce_cur_task();
+void *ce_task_alloc(size_t size);
+void ce_task_arena_reset();
 
 int ce_listen(int fd, int event);
 int ce_unlisten(int fd, int event);
+int ce_set_wake_mode(int fd, int wake_mode);
 void ce_yield();
 int ce_wait();
+int ce_wait_timeout(int timeout_ms);
+int ce_sleep(int ms);
 int ce_run();
 
-int ce_set_block(int fd);
+// for a host event loop that polls ce_backend_fd and calls in when ready
+int ce_run_once(int timeout);
+int ce_backend_fd();
+int ce_backend_timeout();
+
+// building blocks for tasks without a stack of their own
+int ce_on_ready(int fd, int event, ready_func func, void *arg);
+int ce_ready_closed();
+int ce_defer(ready_func func, void *arg);
+int ce_after(int ms, ready_func func, void *arg);
+void ce_hold();
+void ce_release();
+
+int ce_set_nonblock(int fd);
 ssize_t ce_read(int fd, void *buf, size_t count);
 ssize_t ce_write(int fd, const void *buf, size_t count);
+ssize_t ce_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t ce_read_pooled(int fd, ce_buf **buf_ptr);
 int ce_close(int fd);
 
+int ce_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ce_serve(int listen_fd, conn_handler handler, void *arg,
+             int max_concurrency);
+int ce_on_readable(int fd, readable_handler handler, void *arg);
+int ce_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+               int timeout_ms);
+
 #endif
@@ -0,0 +1,323 @@
+#ifndef _COEVT_HPP_
+#define _COEVT_HPP_
+
+/*
+  header only C++ layer over coevt
+  everything here must be used within tasks, like the C API it wraps
+*/
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "defs.h"
+#include "coevt.h"
+#include "coroutine.h"
+}
+
+namespace ce {
+
+namespace detail {
+
+template <typename F>
+void run_callable(void *space) noexcept
+{
+    F *f = static_cast<F *>(space);
+
+    (*f)();
+    f->~F();
+}
+
+// for a task dropped before the callable returned
+template <typename F>
+void destroy_callable(void *space) noexcept
+{
+    static_cast<F *>(space)->~F();
+}
+
+// coroutines waiting on a typed channel, woken by id
+class wait_queue {
+public:
+    void wait()
+    {
+        ids_.push_back(ce_cur_task());
+        ce_wait();
+    }
+
+    void wake_one()
+    {
+        while (!ids_.empty()) {
+            int id = ids_.front();
+            ids_.pop_front();
+            if (ce_get_coroutine_status(id) == CE_COROUTINE_BLOCKED) {
+                ce_set_coroutine_status(id, CE_COROUTINE_SUSPENDED);
+                return;
+            }
+        }
+    }
+
+    void wake_all()
+    {
+        while (!ids_.empty()) {
+            wake_one();
+        }
+    }
+
+private:
+    std::deque<int> ids_;
+};
+
+// moves values in and out of uninitialized ring slots
+template <typename T, bool = std::is_trivially_copyable<T>::value>
+struct slot_ops {
+    static void put(T *slot, T &&value)
+    {
+        new (slot) T(std::move(value));
+    }
+
+    static void take(T *slot, T &out)
+    {
+        out = std::move(*slot);
+        slot->~T();
+    }
+
+    static void destroy(T *slot)
+    {
+        slot->~T();
+    }
+};
+
+template <typename T>
+struct slot_ops<T, true> {
+    static void put(T *slot, const T &value)
+    {
+        std::memcpy(static_cast<void *>(slot), &value, sizeof(T));
+    }
+
+    static void take(T *slot, T &out)
+    {
+        std::memcpy(static_cast<void *>(&out), slot, sizeof(T));
+    }
+
+    static void destroy(T *)
+    {
+    }
+};
+
+} // namespace detail
+
+/*
+  the callable is moved into the coroutine descriptor (or the heap when it
+  is larger than CE_INLINE_ARG_SIZE) and destroyed when the task returns,
+  or when the scheduler drops a task that never did
+*/
+template <typename F>
+bool spawn(F &&f)
+{
+    typedef typename std::decay<F>::type Fn;
+    void *space;
+
+    static_assert(alignof(Fn) <= 16, "callable is over-aligned for a task");
+    if (ce_task_inline(&detail::run_callable<Fn>, sizeof(Fn),
+                       &detail::destroy_callable<Fn>, &space) != CE_SUCCESS) {
+        return false;
+    }
+    new (space) Fn(std::forward<F>(f));
+
+    return true;
+}
+
+inline int run()
+{
+    return ce_run();
+}
+
+inline void yield()
+{
+    ce_yield();
+}
+
+inline int sleep(int ms)
+{
+    return ce_sleep(ms);
+}
+
+/*
+  buffered channel of T, a copyable handle to state on the heap,
+  since a task's stack is swapped out while it waits
+*/
+template <typename T>
+class chan {
+public:
+    explicit chan(size_t cap = 1) : st_(std::make_shared<state>(cap > 0 ? cap : 1))
+    {
+    }
+
+    // blocks while the ring is full, false once the channel is closed
+    bool send(T value)
+    {
+        state &st = *st_;
+
+        while (st.size == st.cap && !st.closed) {
+            st.senders.wait();
+        }
+        if (st.closed) {
+            return false;
+        }
+        ops::put(&st.ring[(st.head + st.size) % st.cap], std::move(value));
+        st.size++;
+        st.receivers.wake_one();
+
+        return true;
+    }
+
+    // blocks while the ring is empty, false once it is closed and drained
+    bool recv(T &out)
+    {
+        state &st = *st_;
+
+        while (st.size == 0 && !st.closed) {
+            st.receivers.wait();
+        }
+        if (st.size == 0) {
+            return false;
+        }
+        ops::take(&st.ring[st.head], out);
+        st.head = (st.head + 1) % st.cap;
+        st.size--;
+        st.senders.wake_one();
+
+        return true;
+    }
+
+    void close()
+    {
+        st_->closed = true;
+        st_->senders.wake_all();
+        st_->receivers.wake_all();
+    }
+
+    size_t size() const
+    {
+        return st_->size;
+    }
+
+private:
+    typedef detail::slot_ops<T> ops;
+
+    struct state {
+        explicit state(size_t c)
+            : ring(std::allocator<T>().allocate(c)), cap(c), head(0), size(0),
+              closed(false)
+        {
+        }
+
+        ~state()
+        {
+            for (; size > 0; size--) {
+                ops::destroy(&ring[head]);
+                head = (head + 1) % cap;
+            }
+            std::allocator<T>().deallocate(ring, cap);
+        }
+
+        T *ring;
+        size_t cap;
+        size_t head;
+        size_t size;
+        bool closed;
+        detail::wait_queue senders;
+        detail::wait_queue receivers;
+    };
+
+    std::shared_ptr<state> st_;
+};
+
+// owns an fd, ce_close on destruction
+class fd {
+public:
+    explicit fd(int f = -1) noexcept : fd_(f)
+    {
+    }
+
+    fd(fd &&other) noexcept : fd_(other.release())
+    {
+    }
+
+    fd &operator=(fd &&other) noexcept
+    {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    fd(const fd &) = delete;
+    fd &operator=(const fd &) = delete;
+
+    ~fd()
+    {
+        reset();
+    }
+
+    int get() const noexcept
+    {
+        return fd_;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return fd_ >= 0;
+    }
+
+    int release() noexcept
+    {
+        int f = fd_;
+        fd_ = -1;
+        return f;
+    }
+
+    void reset(int f = -1) noexcept
+    {
+        if (fd_ >= 0) {
+            ce_close(fd_);
+        }
+        fd_ = f;
+    }
+
+    ssize_t read(void *buf, size_t count)
+    {
+        return ce_read(fd_, buf, count);
+    }
+
+    ssize_t write(const void *buf, size_t count)
+    {
+        return ce_write(fd_, buf, count);
+    }
+
+    bool write_all(const void *buf, size_t count)
+    {
+        const char *p = static_cast<const char *>(buf);
+        ssize_t bytes;
+
+        while (count > 0) {
+            bytes = ce_write(fd_, p, count);
+            if (bytes <= 0) {
+                return false;
+            }
+            p += bytes;
+            count -= bytes;
+        }
+        return true;
+    }
+
+private:
+    int fd_;
+};
+
+} // namespace ce
+
+#endif
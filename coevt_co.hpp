@@ -0,0 +1,544 @@
+#ifndef _COEVT_CO_HPP_
+#define _COEVT_CO_HPP_
+
+/*
+  stackless C++20 tasks driven by the poller and run loop of coevt
+  a suspended task keeps only its coroutine frame on the heap, nothing is
+  copied when it switches; build with -std=c++20
+  fds must be nonblocking, IO is tried first and waits only on EAGAIN
+*/
+#include <cerrno>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <unistd.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include "coevt.h"
+}
+
+namespace ce {
+namespace co {
+
+namespace detail {
+
+inline void resume_handle(void *addr)
+{
+    std::coroutine_handle<>::from_address(addr).resume();
+}
+
+// resumed by the run loop on its next tick, never from within the waker
+inline void schedule(std::coroutine_handle<> h)
+{
+    if (ce_defer(resume_handle, h.address()) != CE_SUCCESS) {
+        std::terminate();
+    }
+}
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    struct final_awaiter {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            promise_base &p = h.promise();
+            std::coroutine_handle<> next = p.continuation;
+
+            if (p.detached) {
+                h.destroy();
+                ce_release();
+            }
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        std::terminate();
+    }
+};
+
+template <typename T>
+struct promise_value : promise_base {
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U &&v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T take()
+    {
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise_value<void> : promise_base {
+    void return_void() noexcept
+    {
+    }
+
+    void take()
+    {
+    }
+};
+
+} // namespace detail
+
+// lazily started, runs when awaited or spawned
+template <typename T = void>
+class task {
+public:
+    struct promise_type : detail::promise_value<T> {
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {}))
+    {
+    }
+
+    task(const task &) = delete;
+
+    ~task()
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+    {
+        h_.promise().continuation = cont;
+        return h_;
+    }
+
+    T await_resume()
+    {
+        return h_.promise().take();
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept
+    {
+        return std::exchange(h_, {});
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h)
+    {
+    }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+// detached, the frame is freed when it finishes; ce_run waits for it
+inline void spawn(task<void> t)
+{
+    std::coroutine_handle<task<void>::promise_type> h = t.release();
+
+    h.promise().detached = true;
+    ce_hold();
+    detail::schedule(h);
+}
+
+inline int run()
+{
+    return ce_run();
+}
+
+class io_awaiter {
+public:
+    io_awaiter(int fd, int event, void *buf, size_t count)
+        : fd_(fd), event_(event), buf_(buf), count_(count), result_(-1),
+          done_(false)
+    {
+    }
+
+    bool await_ready()
+    {
+        return attempt();
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        if (ce_on_ready(fd_, event_, detail::resume_handle, h.address())
+            != CE_SUCCESS) {
+            result_ = -1;
+            done_ = true;
+            detail::schedule(h);
+        }
+    }
+
+    ssize_t await_resume()
+    {
+        if (!done_ && ce_ready_closed()) {
+            // ce_close took the fd away while this task waited on it
+            errno = EBADF;
+        } else if (!done_) {
+            attempt();
+        }
+        return result_;
+    }
+
+private:
+    bool attempt()
+    {
+        if (event_ == CE_READ) {
+            result_ = ::read(fd_, buf_, count_);
+        } else {
+            result_ = ::write(fd_, buf_, count_);
+        }
+        done_ = result_ >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        return done_;
+    }
+
+    int fd_;
+    int event_;
+    void *buf_;
+    size_t count_;
+    ssize_t result_;
+    bool done_;
+};
+
+inline io_awaiter read(int fd, void *buf, size_t count)
+{
+    return io_awaiter(fd, CE_READ, buf, count);
+}
+
+inline io_awaiter write(int fd, const void *buf, size_t count)
+{
+    return io_awaiter(fd, CE_WRITE, const_cast<void *>(buf), count);
+}
+
+// waits without reading, so no buffer is kept while the fd is idle
+class ready_awaiter {
+public:
+    ready_awaiter(int fd, int event) : fd_(fd), event_(event), ok_(true)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        if (ce_on_ready(fd_, event_, detail::resume_handle, h.address())
+            != CE_SUCCESS) {
+            ok_ = false;
+            detail::schedule(h);
+        }
+    }
+
+    // false as well when ce_close took the fd away while waiting
+    bool await_resume() const noexcept
+    {
+        return ok_ && !ce_ready_closed();
+    }
+
+private:
+    int fd_;
+    int event_;
+    bool ok_;
+};
+
+inline ready_awaiter readable(int fd)
+{
+    return ready_awaiter(fd, CE_READ);
+}
+
+inline ready_awaiter writable(int fd)
+{
+    return ready_awaiter(fd, CE_WRITE);
+}
+
+// accepted fds are nonblocking already
+class accept_awaiter {
+public:
+    explicit accept_awaiter(int fd) : fd_(fd), result_(-1)
+    {
+    }
+
+    bool await_ready()
+    {
+        return attempt();
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        if (ce_on_ready(fd_, CE_READ, detail::resume_handle, h.address())
+            != CE_SUCCESS) {
+            detail::schedule(h);
+        }
+    }
+
+    int await_resume()
+    {
+        if (result_ < 0 && ce_ready_closed()) {
+            errno = EBADF;
+        } else if (result_ < 0) {
+            attempt();
+        }
+        return result_;
+    }
+
+private:
+    bool attempt()
+    {
+        result_ = accept4(fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        return result_ >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+
+    int fd_;
+    int result_;
+};
+
+inline accept_awaiter accept(int fd)
+{
+    return accept_awaiter(fd);
+}
+
+class sleep_awaiter {
+public:
+    explicit sleep_awaiter(int ms) : ms_(ms)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        if (ms_ <= 0 || ce_after(ms_, detail::resume_handle, h.address()) != CE_SUCCESS) {
+            detail::schedule(h);
+        }
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    int ms_;
+};
+
+inline sleep_awaiter sleep(int ms)
+{
+    return sleep_awaiter(ms);
+}
+
+inline sleep_awaiter yield()
+{
+    return sleep_awaiter(0);
+}
+
+/*
+  channel of T between stackless tasks, a copyable handle to heap state
+  values are handed to a waiting receiver directly, so a woken task never
+  finds its value taken by another one; capacity 0 is a rendezvous
+*/
+template <typename T>
+class chan {
+    struct state;
+
+public:
+    class recv_awaiter {
+    public:
+        explicit recv_awaiter(state *st) : st_(st)
+        {
+        }
+
+        bool await_ready()
+        {
+            return st_->try_recv(value_);
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle_ = h;
+            st_->receivers.push_back(this);
+        }
+
+        std::optional<T> await_resume()
+        {
+            return std::move(value_);
+        }
+
+    private:
+        friend struct state;
+        state *st_;
+        std::optional<T> value_;
+        std::coroutine_handle<> handle_;
+    };
+
+    class send_awaiter {
+    public:
+        send_awaiter(state *st, T value) : st_(st), value_(std::move(value)), ok_(false)
+        {
+        }
+
+        bool await_ready()
+        {
+            return st_->try_send(value_, ok_);
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle_ = h;
+            st_->senders.push_back(this);
+        }
+
+        bool await_resume() const noexcept
+        {
+            return ok_;
+        }
+
+    private:
+        friend struct state;
+        state *st_;
+        T value_;
+        bool ok_;
+        std::coroutine_handle<> handle_;
+    };
+
+    explicit chan(size_t cap = 0) : st_(std::make_shared<state>(cap))
+    {
+    }
+
+    // co_await resumes with false once the channel is closed
+    send_awaiter send(T value)
+    {
+        return send_awaiter(st_.get(), std::move(value));
+    }
+
+    // co_await resumes with nullopt once the channel is closed and drained
+    recv_awaiter recv()
+    {
+        return recv_awaiter(st_.get());
+    }
+
+    void close()
+    {
+        st_->close();
+    }
+
+private:
+    struct state {
+        explicit state(size_t c) : cap(c), closed(false)
+        {
+        }
+
+        bool try_send(T &value, bool &ok)
+        {
+            recv_awaiter *r;
+
+            if (closed) {
+                ok = false;
+                return true;
+            }
+            if (!receivers.empty()) {
+                r = receivers.front();
+                receivers.pop_front();
+                r->value_.emplace(std::move(value));
+                detail::schedule(r->handle_);
+            } else if (ring.size() < cap) {
+                ring.push_back(std::move(value));
+            } else {
+                return false;
+            }
+            ok = true;
+            return true;
+        }
+
+        bool try_recv(std::optional<T> &value)
+        {
+            send_awaiter *s;
+
+            if (!ring.empty()) {
+                value.emplace(std::move(ring.front()));
+                ring.pop_front();
+                if (!senders.empty()) {
+                    s = senders.front();
+                    senders.pop_front();
+                    ring.push_back(std::move(s->value_));
+                    s->ok_ = true;
+                    detail::schedule(s->handle_);
+                }
+                return true;
+            }
+            if (!senders.empty()) {
+                s = senders.front();
+                senders.pop_front();
+                value.emplace(std::move(s->value_));
+                s->ok_ = true;
+                detail::schedule(s->handle_);
+                return true;
+            }
+            return closed;
+        }
+
+        void close()
+        {
+            closed = true;
+            for (recv_awaiter *r : receivers) {
+                detail::schedule(r->handle_);
+            }
+            receivers.clear();
+            for (send_awaiter *s : senders) {
+                s->ok_ = false;
+                detail::schedule(s->handle_);
+            }
+            senders.clear();
+        }
+
+        std::deque<T> ring;
+        size_t cap;
+        bool closed;
+        std::deque<recv_awaiter *> receivers;
+        std::deque<send_awaiter *> senders;
+    };
+
+    std::shared_ptr<state> st_;
+};
+
+} // namespace co
+} // namespace ce
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "defs.h"
+#include "log.h"
+#include "coroutine.h"
+#include "coevt.h"
+#include "connpool.h"
+
+typedef struct ce_pool_waiter {
+    int crtn_id;
+    struct ce_pool_waiter *next;
+} ce_pool_waiter;
+
+typedef struct ce_endpoint {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int active;       // connections handed out or being connected
+    int idle_cnt;
+    int *idle_fds;
+    ce_pool_waiter *wait_head;
+    ce_pool_waiter *wait_tail;
+    struct ce_endpoint *next;
+} ce_endpoint;
+
+struct ce_connpool {
+    int max_active;   // per endpoint, no limit if <= 0
+    int max_idle;     // per endpoint
+    int connect_timeout;
+    ce_endpoint *endpoints;
+    ce_endpoint **fd_owner;
+    int fd_cap;
+};
+
+ce_connpool *ce_connpool_create(int max_active, int max_idle,
+                                int connect_timeout_ms)
+{
+    ce_connpool *pool = (ce_connpool *)malloc(sizeof(ce_connpool));
+    if (pool == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_connpool");
+        return NULL;
+    }
+    memset(pool, 0, sizeof(ce_connpool));
+    pool->max_active = max_active;
+    pool->max_idle = max_idle > 0 ? max_idle : 0;
+    pool->connect_timeout = connect_timeout_ms;
+
+    return pool;
+}
+
+static ce_endpoint *find_endpoint(ce_connpool *pool,
+                                  const struct sockaddr *addr, socklen_t addrlen)
+{
+    ce_endpoint *ep;
+
+    for (ep = pool->endpoints; ep != NULL; ep = ep->next) {
+        if (ep->addrlen == addrlen && memcmp(&ep->addr, addr, addrlen) == 0) {
+            return ep;
+        }
+    }
+
+    if (addrlen > sizeof(ep->addr)) {
+        CE_LOG_ERROR("Address is too long for an endpoint");
+        return NULL;
+    }
+    ep = (ce_endpoint *)malloc(sizeof(ce_endpoint));
+    if (ep == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_endpoint");
+        return NULL;
+    }
+    memset(ep, 0, sizeof(ce_endpoint));
+    memcpy(&ep->addr, addr, addrlen);
+    ep->addrlen = addrlen;
+    if (pool->max_idle > 0) {
+        ep->idle_fds = (int *)malloc(sizeof(int) * pool->max_idle);
+        if (ep->idle_fds == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for idle connections");
+            free(ep);
+            return NULL;
+        }
+    }
+    ep->next = pool->endpoints;
+    pool->endpoints = ep;
+
+    return ep;
+}
+
+static int set_owner(ce_connpool *pool, int fd, ce_endpoint *ep)
+{
+    if (fd >= pool->fd_cap) {
+        int new_cap = pool->fd_cap > 0 ? pool->fd_cap : INIT_CAPACITY;
+        ce_endpoint **new_owner;
+        while (new_cap <= fd) {
+            new_cap *= 2;
+        }
+        new_owner = (ce_endpoint **)realloc(pool->fd_owner,
+                                            sizeof(ce_endpoint *) * new_cap);
+        if (new_owner == NULL) {
+            CE_LOG_ERROR("Failed to enlarge connection owner table");
+            return CE_FAILURE;
+        }
+        memset(new_owner + pool->fd_cap, 0,
+               sizeof(ce_endpoint *) * (new_cap - pool->fd_cap));
+        pool->fd_owner = new_owner;
+        pool->fd_cap = new_cap;
+    }
+    pool->fd_owner[fd] = ep;
+
+    return CE_SUCCESS;
+}
+
+static int park_caller(ce_endpoint *ep)
+{
+    ce_pool_waiter *waiter = (ce_pool_waiter *)malloc(sizeof(ce_pool_waiter));
+    if (waiter == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_pool_waiter");
+        return CE_FAILURE;
+    }
+    waiter->crtn_id = ce_cur_task();
+    waiter->next = NULL;
+    if (ep->wait_tail == NULL) {
+        ep->wait_head = ep->wait_tail = waiter;
+    } else {
+        ep->wait_tail->next = waiter;
+        ep->wait_tail = waiter;
+    }
+
+    return ce_wait();
+}
+
+static void wake_one_caller(ce_endpoint *ep)
+{
+    ce_pool_waiter *waiter = ep->wait_head;
+    if (waiter == NULL) {
+        return;
+    }
+    ep->wait_head = waiter->next;
+    if (ep->wait_head == NULL) {
+        ep->wait_tail = NULL;
+    }
+    ce_set_coroutine_status(waiter->crtn_id, CE_COROUTINE_SUSPENDED);
+    free(waiter);
+}
+
+static int conn_alive(int fd)
+{
+    char c;
+    // an idle keep-alive connection must have nothing to read,
+    // EOF means the peer closed it, data means a stale response
+    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+int ce_connpool_get(ce_connpool *pool,
+                    const struct sockaddr *addr, socklen_t addrlen)
+{
+    ce_endpoint *ep = find_endpoint(pool, addr, addrlen);
+    int fd;
+
+    if (ep == NULL) {
+        return CE_FAILURE;
+    }
+
+    while (TRUE) {
+        while (ep->idle_cnt > 0) {
+            fd = ep->idle_fds[--ep->idle_cnt];
+            if (conn_alive(fd)) {
+                ep->active++;
+                pool->fd_owner[fd] = ep;
+                return fd;
+            }
+            close(fd);
+        }
+        if (pool->max_active <= 0 || ep->active < pool->max_active) {
+            break;
+        }
+        // all connections to the endpoint are in use, wait for one back
+        if (park_caller(ep) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+    }
+
+    // reserve the slot before connecting, ce_connect parks the caller
+    ep->active++;
+    fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        CE_LOG_ERROR("Failed to create socket for connection pool");
+        goto fail;
+    }
+    if (ce_connect(fd, addr, addrlen, pool->connect_timeout) != CE_SUCCESS) {
+        close(fd);
+        goto fail;
+    }
+    if (set_owner(pool, fd, ep) != CE_SUCCESS) {
+        close(fd);
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    ep->active--;
+    wake_one_caller(ep);
+    return CE_FAILURE;
+}
+
+void ce_connpool_put(ce_connpool *pool, int fd, int reusable)
+{
+    ce_endpoint *ep;
+
+    if (fd < 0 || fd >= pool->fd_cap || pool->fd_owner[fd] == NULL) {
+        CE_LOG_ERROR("fd %d is not taken from the connection pool", fd);
+        return;
+    }
+    ep = pool->fd_owner[fd];
+    pool->fd_owner[fd] = NULL;
+    ep->active--;
+
+    if (reusable && ep->idle_cnt < pool->max_idle) {
+        ep->idle_fds[ep->idle_cnt++] = fd;
+    } else {
+        close(fd);
+    }
+    wake_one_caller(ep);
+}
+
+void ce_connpool_destroy(ce_connpool **pool_ptr)
+{
+    ce_connpool *pool = *pool_ptr;
+    ce_endpoint *ep;
+
+    if (pool == NULL) {
+        return;
+    }
+    // callers must not be parked in ce_connpool_get anymore,
+    // connections still handed out are left to their owners
+    while (pool->endpoints != NULL) {
+        ep = pool->endpoints;
+        pool->endpoints = ep->next;
+        while (ep->idle_cnt > 0) {
+            close(ep->idle_fds[--ep->idle_cnt]);
+        }
+        while (ep->wait_head != NULL) {
+            ce_pool_waiter *waiter = ep->wait_head;
+            ep->wait_head = waiter->next;
+            free(waiter);
+        }
+        free(ep->idle_fds);
+        free(ep);
+    }
+    free(pool->fd_owner);
+    free(pool);
+
+    *pool_ptr = NULL;
+}
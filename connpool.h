@@ -0,0 +1,15 @@
+#ifndef _COEVT_CONNPOOL_H_
+#define _COEVT_CONNPOOL_H_
+
+#include <sys/socket.h>
+
+typedef struct ce_connpool ce_connpool;
+
+ce_connpool *ce_connpool_create(int max_active, int max_idle,
+                                int connect_timeout_ms);
+int ce_connpool_get(ce_connpool *pool,
+                    const struct sockaddr *addr, socklen_t addrlen);
+void ce_connpool_put(ce_connpool *pool, int fd, int reusable);
+void ce_connpool_destroy(ce_connpool **pool_ptr);
+
+#endif
@@ -4,26 +4,78 @@
 #include <stdint.h>
 #include <ucontext.h>
 #include "defs.h"
+#include "log.h"
+#include "timer.h"
+#include "stats.h"
+#include "trace.h"
+#include "arena.h"
 #include "coroutine.h"
 
+/*
+  coroutines run on a pool of shared run stacks,
+  the frames of a paused coroutine stay on its run stack until another
+  coroutine needs that stack, so resuming the owner again needs no copy
+*/
+typedef struct ce_run_stack {
+    char *mem;
+    int owner;
+} ce_run_stack;
+
+// ids of the coroutines of one priority level
+typedef struct ce_prio_level {
+    int *ids;
+    int size;
+    int cap;
+    int scans;  // run loop passes walking ids by index right now
+    int holes;  // ids of coroutines that exited during those passes
+} ce_prio_level;
+
 struct ce_scheduler {
     int capacity;
-    int size;
-    char *run_stack;
+    int size;       // number of live coroutines
+    int runnable;   // number of them that are ready or suspended
+    int slots;      // number of slots ever handed out
+    int *free_ids;  // released slots, reused before taking new ones
+    int free_cnt;
+    ce_coroutine **crtn_cache;  // exited descriptors, reused by create
+    int cache_cnt;
+    ce_run_stack *run_stacks;
+    int stack_num;
+    int next_stack;
     int stack_size;
     ucontext_t ctx;
     ce_coroutine **coroutine_list;
+    ce_prio_level levels[CE_PRIO_NUM];
     int cur_running;
+    int run_next;    // switched to directly when the running one pauses
+    int handoff_to;  // resumed by the scheduler right after the current one
+    unsigned long switches;  // read by the watchdog thread
+    volatile int switching;  // in swapcontext, read by the SIGPROF handler
+    // task function of the running coroutine, NULL in the run loop; the
+    // SIGPROF handler reads it instead of coroutine_list, which moves
+    volatile coroutine_func running_func;
 };
 
 struct ce_coroutine {
     ucontext_t ctx;
-    char *stack;
+    char *stack;      // copy of the frames when evicted from its run stack
     int stack_size;
+    int stack_cap;
+    int stack_idx;
+    char *stack_sp;   // lowest address in use when paused
     coroutine_func func;
     void *arg;
     int status;
     int self_id;
+    int prio;
+    int prio_pos;     // index in the ids of its priority level
+    int flags;
+    ce_arena_chunk *arena;  // ce_task_alloc memory, released on exit
+    void *arg_heap;         // argument too large for inline_arg
+    coroutine_func arg_dtor;  // destroys an inline argument never returned from
+    _Alignas(16) char inline_arg[CE_INLINE_ARG_SIZE];
+    ce_timer *wait_timer;
+    int timed_out;
 };
 
 /*
@@ -31,43 +83,126 @@ struct ce_coroutine {
   use multiple processes in multicore arch
 */
 static ce_scheduler scheduler;
+static int run_stack_num = RUN_STACK_NUM;
+
+int ce_set_run_stack_num(int num)
+{
+    if (scheduler.capacity || num <= 0) {
+        // the pool can't be resized once coroutines were created
+        return CE_FAILURE;
+    }
+    run_stack_num = num;
+
+    return CE_SUCCESS;
+}
 
 int ce_init_scheduler(int stack_size, int init_cap)
 {
     size_t size_in_bytes;
+    int i;
 
     scheduler.capacity = init_cap;
     scheduler.size = 0;
-    size_in_bytes = sizeof(char) * stack_size;
-    scheduler.run_stack = (char *)malloc(size_in_bytes);
-    if (scheduler.run_stack == NULL) {
-        printf("ERROR: Failed to allocate space for stack of scheduler\n");
+    size_in_bytes = sizeof(ce_run_stack) * run_stack_num;
+    scheduler.run_stacks = (ce_run_stack *)malloc(size_in_bytes);
+    if (scheduler.run_stacks == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for run stacks of scheduler");
         return CE_FAILURE;
     }
+    memset(scheduler.run_stacks, 0, size_in_bytes);
+    scheduler.stack_num = run_stack_num;
+    scheduler.next_stack = 0;
+    size_in_bytes = sizeof(char) * stack_size;
+    for (i = 0; i < scheduler.stack_num; i++) {
+        scheduler.run_stacks[i].mem = (char *)malloc(size_in_bytes);
+        if (scheduler.run_stacks[i].mem == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for stack of scheduler");
+            return CE_FAILURE;
+        }
+        scheduler.run_stacks[i].owner = CE_DUMMY_COROUTINE_ID;
+    }
     scheduler.stack_size = size_in_bytes;
-    memset(scheduler.run_stack, 0, size_in_bytes);
 
     size_in_bytes = sizeof(ce_coroutine *) * init_cap;
     scheduler.coroutine_list = (ce_coroutine **)malloc(size_in_bytes);
     if (scheduler.coroutine_list == NULL) {
-        printf("ERROR: Failed to allocate space for coroutine list\n");
+        CE_LOG_ERROR("Failed to allocate space for coroutine list");
         return CE_FAILURE;
     }
     memset(scheduler.coroutine_list, 0, size_in_bytes);
 
+    scheduler.free_ids = (int *)malloc(sizeof(int) * init_cap);
+    if (scheduler.free_ids == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for free coroutine ids");
+        return CE_FAILURE;
+    }
+    scheduler.slots = 0;
+    scheduler.free_cnt = 0;
+
+    scheduler.crtn_cache = (ce_coroutine **)malloc(sizeof(ce_coroutine *)
+                                                   * CRTN_CACHE_SIZE);
+    if (scheduler.crtn_cache == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for coroutine cache");
+        return CE_FAILURE;
+    }
+    scheduler.cache_cnt = 0;
+
     scheduler.cur_running = CE_DUMMY_COROUTINE_ID;
+    scheduler.handoff_to = CE_DUMMY_COROUTINE_ID;
+    scheduler.run_next = CE_DUMMY_COROUTINE_ID;
     return CE_SUCCESS;
 }
 
+// the argument of a coroutine that is dropped before its function returned
+static void release_arg(ce_coroutine *crtn)
+{
+    if (crtn->arg_dtor != NULL) {
+        crtn->arg_dtor(crtn->arg);
+        crtn->arg_dtor = NULL;
+    }
+    free(crtn->arg_heap);
+    crtn->arg_heap = NULL;
+}
+
 int ce_close_scheduler()
 {
     int i;
-    for (i = 0; i < scheduler.size; i++) {
+    // destructors run while every coroutine still exists
+    for (i = 0; i < scheduler.slots; i++) {
+        if (scheduler.coroutine_list[i] != NULL) {
+            release_arg(scheduler.coroutine_list[i]);
+        }
+    }
+    for (i = 0; i < scheduler.slots; i++) {
         ce_coroutine *crtn = scheduler.coroutine_list[i];
+        if (crtn == NULL) {
+            continue;
+        }
+        ce_arena_release(&crtn->arena);
         free(crtn->stack);
         free(crtn);
     }
-    free(scheduler.run_stack);
+    ce_arena_clear_cache();
+    for (i = 0; i < scheduler.stack_num; i++) {
+        free(scheduler.run_stacks[i].mem);
+    }
+    free(scheduler.run_stacks);
+    free(scheduler.coroutine_list);
+    free(scheduler.free_ids);
+    for (i = 0; i < scheduler.cache_cnt; i++) {
+        free(scheduler.crtn_cache[i]->stack);
+        free(scheduler.crtn_cache[i]);
+    }
+    free(scheduler.crtn_cache);
+    for (i = 0; i < CE_PRIO_NUM; i++) {
+        free(scheduler.levels[i].ids);
+    }
+
+    // so that the scheduler is initialized again by the next coroutine
+    memset(&scheduler, 0, sizeof(ce_scheduler));
+    scheduler.cur_running = CE_DUMMY_COROUTINE_ID;
+    scheduler.handoff_to = CE_DUMMY_COROUTINE_ID;
+    scheduler.run_next = CE_DUMMY_COROUTINE_ID;
 
     return CE_SUCCESS;
 }
@@ -82,6 +217,122 @@ int ce_coroutine_cnt()
     return scheduler.size;
 }
 
+unsigned long ce_coroutine_switches()
+{
+    return __atomic_load_n(&scheduler.switches, __ATOMIC_RELAXED);
+}
+
+int ce_coroutine_switching()
+{
+    return scheduler.switching;
+}
+
+coroutine_func ce_coroutine_running_func()
+{
+    return scheduler.running_func;
+}
+
+int ce_coroutine_slots()
+{
+    return scheduler.slots;
+}
+
+int ce_coroutine_level_cnt(int prio)
+{
+    return scheduler.levels[prio].size;
+}
+
+// CE_DUMMY_COROUTINE_ID where a coroutine exited during a scan
+int ce_coroutine_level_at(int prio, int idx)
+{
+    return scheduler.levels[prio].ids[idx];
+}
+
+/*
+  while a level is scanned, coroutines exiting leave a hole instead of
+  moving the last id into their slot, which the scan would skip
+*/
+void ce_coroutine_level_begin_scan(int prio)
+{
+    scheduler.levels[prio].scans++;
+}
+
+void ce_coroutine_level_end_scan(int prio)
+{
+    ce_prio_level *level = &scheduler.levels[prio];
+    int i, size = 0;
+
+    if (--level->scans > 0 || level->holes == 0) {
+        return;
+    }
+    for (i = 0; i < level->size; i++) {
+        if (level->ids[i] == CE_DUMMY_COROUTINE_ID) {
+            continue;
+        }
+        level->ids[size] = level->ids[i];
+        scheduler.coroutine_list[level->ids[size]]->prio_pos = size;
+        size++;
+    }
+    level->size = size;
+    level->holes = 0;
+}
+
+static int is_runnable(int status)
+{
+    return status == CE_COROUTINE_READY || status == CE_COROUTINE_SUSPENDED;
+}
+
+// keeps the number of runnable coroutines in step with their status
+static void set_status(ce_coroutine *crtn, int status)
+{
+    scheduler.runnable += is_runnable(status) - is_runnable(crtn->status);
+    crtn->status = status;
+}
+
+int ce_coroutine_runnable()
+{
+    return scheduler.runnable;
+}
+
+static int join_level(ce_coroutine *crtn)
+{
+    ce_prio_level *level = &scheduler.levels[crtn->prio];
+
+    if (level->size == level->cap) {
+        int new_cap = level->cap > 0 ? level->cap * 2 : INIT_CAPACITY;
+        int *new_ids = (int *)realloc(level->ids, sizeof(int) * new_cap);
+        if (new_ids == NULL) {
+            CE_LOG_ERROR("Failed to enlarge priority level %d", crtn->prio);
+            return CE_FAILURE;
+        }
+        level->ids = new_ids;
+        level->cap = new_cap;
+    }
+    crtn->prio_pos = level->size;
+    level->ids[level->size++] = crtn->self_id;
+
+    return CE_SUCCESS;
+}
+
+static void leave_level(ce_coroutine *crtn)
+{
+    ce_prio_level *level = &scheduler.levels[crtn->prio];
+    int last_id;
+
+    if (level->scans > 0) {
+        level->ids[crtn->prio_pos] = CE_DUMMY_COROUTINE_ID;
+        level->holes++;
+        return;
+    }
+    last_id = level->ids[--level->size];
+
+    // move the last one into the hole, order inside a level doesn't matter
+    if (crtn->prio_pos < level->size) {
+        level->ids[crtn->prio_pos] = last_id;
+        scheduler.coroutine_list[last_id]->prio_pos = crtn->prio_pos;
+    }
+}
+
 static int enlarge_coroutine_list()
 {
     size_t size_in_bytes
@@ -89,67 +340,169 @@ static int enlarge_coroutine_list()
     scheduler.coroutine_list = (ce_coroutine **)realloc(scheduler.coroutine_list,
                                                         size_in_bytes);
     if (scheduler.coroutine_list == NULL) {
-        printf("ERROR: Failed to re-allocate space for coroutine list\n");
+        CE_LOG_ERROR("Failed to re-allocate space for coroutine list");
         return CE_FAILURE;
     }
     memset(scheduler.coroutine_list + scheduler.capacity,
            0, size_in_bytes / 2);
+
+    scheduler.free_ids = (int *)realloc(scheduler.free_ids,
+                                        sizeof(int) * scheduler.capacity * 2);
+    if (scheduler.free_ids == NULL) {
+        CE_LOG_ERROR("Failed to re-allocate space for free coroutine ids");
+        return CE_FAILURE;
+    }
     scheduler.capacity *= 2;
 
     return CE_SUCCESS;
 }
 
+/*
+  short lived coroutines (one per request or per readable fd) take their
+  descriptor and its stack copy buffer from the cache instead of malloc
+*/
+static ce_coroutine *alloc_crtn()
+{
+    ce_coroutine *crtn;
+
+    if (scheduler.cache_cnt > 0) {
+        crtn = scheduler.crtn_cache[--scheduler.cache_cnt];
+    } else {
+        crtn = (ce_coroutine *)malloc(sizeof(ce_coroutine));
+        if (crtn == NULL) {
+            return NULL;
+        }
+        crtn->stack = NULL;
+        crtn->stack_cap = 0;
+    }
+    crtn->stack_size = 0;
+
+    return crtn;
+}
+
+static void release_crtn(ce_coroutine *crtn)
+{
+    if (scheduler.cache_cnt == CRTN_CACHE_SIZE) {
+        free(crtn->stack);
+        free(crtn);
+        return;
+    }
+    if (crtn->stack_cap > CRTN_CACHE_STACK) {
+        free(crtn->stack);
+        crtn->stack = NULL;
+        crtn->stack_cap = 0;
+    }
+    scheduler.crtn_cache[scheduler.cache_cnt++] = crtn;
+}
+
 int ce_coroutine_create(coroutine_func func, void *arg)
 {
-    size_t size_in_bytes;
+    return ce_coroutine_create_prio(func, arg, CE_PRIO_NORMAL);
+}
+
+int ce_coroutine_create_prio(coroutine_func func, void *arg, int prio)
+{
     ce_coroutine *new_crtn;
     int new_id;
 
+    if (prio < 0 || prio >= CE_PRIO_NUM) {
+        CE_LOG_ERROR("Invalid coroutine priority %d", prio);
+        return CE_DUMMY_COROUTINE_ID;
+    }
+
     if (!scheduler.capacity) {
         if (ce_init_scheduler(STACK_SIZE, INIT_CAPACITY) != 0) {
-            printf("ERROR: Failed to initialize scheduler\n");
+            CE_LOG_ERROR("Failed to initialize scheduler");
             return CE_DUMMY_COROUTINE_ID;
         }
     }
 
-    if (scheduler.size == scheduler.capacity) {
+    if (scheduler.free_cnt == 0 && scheduler.slots == scheduler.capacity) {
         if (enlarge_coroutine_list() != 0) {
-            printf("ERROR: Failed to enlarge coroutine list\n");
+            CE_LOG_ERROR("Failed to enlarge coroutine list");
             return CE_DUMMY_COROUTINE_ID;
         }
     }
 
-    size_in_bytes = sizeof(ce_coroutine);
-    new_crtn = (ce_coroutine *)malloc(size_in_bytes);
+    new_crtn = alloc_crtn();
     if (new_crtn == NULL) {
-        printf("ERROR: Failed to allocate space for new coroutine\n");
+        CE_LOG_ERROR("Failed to allocate space for new coroutine");
         return CE_DUMMY_COROUTINE_ID;
     }
-    new_crtn->stack = NULL;
-    new_crtn->stack_size = 0;
+    new_crtn->stack_sp = NULL;
+    // round robin, so that coroutines created together don't share a stack
+    new_crtn->stack_idx = scheduler.next_stack;
+    scheduler.next_stack = (scheduler.next_stack + 1) % scheduler.stack_num;
     new_crtn->func = func;
     new_crtn->arg = arg;
-    new_crtn->status = CE_COROUTINE_READY;
-    new_id = scheduler.size++;
+    new_crtn->status = CE_COROUTINE_IDLE;
+    new_crtn->prio = prio;
+    new_crtn->flags = 0;
+    new_crtn->arena = NULL;
+    new_crtn->arg_heap = NULL;
+    new_crtn->arg_dtor = NULL;
+    new_crtn->wait_timer = NULL;
+    new_crtn->timed_out = FALSE;
+    if (scheduler.free_cnt > 0) {
+        new_id = scheduler.free_ids[--scheduler.free_cnt];
+    } else {
+        new_id = scheduler.slots++;
+    }
     new_crtn->self_id = new_id;
+    if (join_level(new_crtn) != CE_SUCCESS) {
+        scheduler.free_ids[scheduler.free_cnt++] = new_id;
+        release_crtn(new_crtn);
+        return CE_DUMMY_COROUTINE_ID;
+    }
+    scheduler.size++;
     scheduler.coroutine_list[new_id] = new_crtn;
+    set_status(new_crtn, CE_COROUTINE_READY);
+    CE_STATS_ADD(creates, 1);
+    CE_TRACE_EVT(CE_TRACE_CREATE, new_id, 0);
 
     return new_id;
 }
 
-static void fill_slot_with_last(int idx)
+/*
+  the argument of func is size bytes of space owned by the coroutine,
+  the caller fills it in through space before the coroutine first runs;
+  func destroys it before returning, dtor (may be NULL) does when the
+  coroutine is dropped before that
+*/
+int ce_coroutine_create_inline(coroutine_func func, size_t size,
+                               coroutine_func dtor, void **space)
 {
-    if (scheduler.size >= 1) {
-        if (idx < scheduler.size - 1) {
-            scheduler.coroutine_list[idx]
-                = scheduler.coroutine_list[scheduler.size - 1];
-            scheduler.coroutine_list[idx]->self_id = idx;
-        }
-        scheduler.coroutine_list[scheduler.size--] = NULL;
+    ce_coroutine *crtn;
+    int crtn_id;
+
+    crtn_id = ce_coroutine_create(func, NULL);
+    if (crtn_id == CE_DUMMY_COROUTINE_ID) {
+        return CE_DUMMY_COROUTINE_ID;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
+    if (size <= CE_INLINE_ARG_SIZE) {
+        crtn->arg = crtn->inline_arg;
     } else {
-        // last coroutine finished
-        scheduler.coroutine_list[0] = NULL;
+        crtn->arg_heap = malloc(size);
+        if (crtn->arg_heap == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for coroutine argument");
+            ce_coroutine_exit(crtn_id);
+            return CE_DUMMY_COROUTINE_ID;
+        }
+        crtn->arg = crtn->arg_heap;
     }
+    crtn->arg_dtor = dtor;
+    *space = crtn->arg;
+
+    return crtn_id;
+}
+
+static void release_slot(int idx)
+{
+    leave_level(scheduler.coroutine_list[idx]);
+    scheduler.coroutine_list[idx] = NULL;
+    scheduler.free_ids[scheduler.free_cnt++] = idx;
+    scheduler.size--;
 }
 
 static void wrap_crtn_func(uint32_t low_bits, uint32_t high_bits)
@@ -158,41 +511,117 @@ static void wrap_crtn_func(uint32_t low_bits, uint32_t high_bits)
     ce_coroutine *crtn = (ce_coroutine *)arg_ptr;
     int crtn_id;
 
+    scheduler.switching = FALSE;
     crtn->func(crtn->arg);
-    free(crtn->stack);
-    free(crtn);
+    CE_TRACE_EVT(CE_TRACE_EXIT, scheduler.cur_running, 0);
+    // frames on the run stack are dead from now on
+    scheduler.run_stacks[crtn->stack_idx].owner = CE_DUMMY_COROUTINE_ID;
 
-    // after coroutine finished, swap the last coroutine to this slot,
-    // so can avoid looking for idle slot when create new coroutine
+    // keep ids stable while coroutines are alive, the poller and channels
+    // refer to blocked coroutines by id; the freed slot is reused later
     crtn_id = scheduler.cur_running;
-    fill_slot_with_last(crtn_id);
+    release_slot(crtn_id);
+    ce_arena_release(&crtn->arena);
+    free(crtn->arg_heap);
+    release_crtn(crtn);
+    CE_STATS_ADD(exits, 1);
 
     scheduler.cur_running = CE_DUMMY_COROUTINE_ID;
+    scheduler.running_func = NULL;
+    // uc_link is resumed by setcontext, the scheduler clears it
+    scheduler.switching = TRUE;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
-void ce_coroutine_resume(int crtn_id)
+/*
+  swapcontext moves the stack pointer before the frames it points to are
+  complete, a signal handler unwinding in between would follow garbage
+*/
+static void swap_context(ucontext_t *from, ucontext_t *to)
 {
-    ce_coroutine *crtn;
+    scheduler.switching = TRUE;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    swapcontext(from, to);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    scheduler.switching = FALSE;
+}
 
-    if (crtn_id == CE_DUMMY_COROUTINE_ID) {
-        printf("ERROR: Could not resume a dummy coroutine\n");
-        return;
+static int save_stack(ce_coroutine *crtn)
+{
+    char *stack_top = scheduler.run_stacks[crtn->stack_idx].mem
+                      + scheduler.stack_size;
+
+    crtn->stack_size = stack_top - crtn->stack_sp;
+    if (crtn->stack_size > crtn->stack_cap) {
+        free(crtn->stack);
+        crtn->stack = (char *)malloc(sizeof(char) * crtn->stack_size);
+        if (crtn->stack == NULL) {
+            CE_LOG_ERROR("Failed to new space to save stack");
+            crtn->stack_cap = 0;
+            return CE_FAILURE;
+        }
+        crtn->stack_cap = crtn->stack_size;
     }
-    crtn = scheduler.coroutine_list[crtn_id];
-    if (crtn == NULL) {
-        printf("ERROR: Could not resume a null coroutine\n");
-        return;
+    memcpy(crtn->stack, crtn->stack_sp, sizeof(char) * crtn->stack_size);
+    CE_STATS_ADD(stack_saved_bytes, crtn->stack_size);
+
+    return CE_SUCCESS;
+}
+
+// make the run stack of crtn hold its frames, evicting the previous owner
+static int acquire_run_stack(ce_coroutine *crtn)
+{
+    ce_run_stack *rs = &scheduler.run_stacks[crtn->stack_idx];
+    ce_coroutine *owner;
+
+    if (rs->owner == crtn->self_id) {
+        CE_STATS_ADD(stack_reuses, 1);
+        return CE_SUCCESS;
+    }
+    if (rs->owner != CE_DUMMY_COROUTINE_ID) {
+        owner = scheduler.coroutine_list[rs->owner];
+        if (save_stack(owner) != CE_SUCCESS) {
+            CE_LOG_ERROR("Failed to save stack of coroutine %d", rs->owner);
+            return CE_FAILURE;
+        }
+    }
+    if (crtn->status == CE_COROUTINE_SUSPENDED) {
+        memcpy(rs->mem + scheduler.stack_size - crtn->stack_size,
+               crtn->stack,
+               crtn->stack_size);
+        CE_STATS_ADD(stack_restored_bytes, crtn->stack_size);
     }
+    rs->owner = crtn->self_id;
 
+    return CE_SUCCESS;
+}
+
+// start or continue crtn, the context switched away from is saved in from
+static void switch_in(ce_coroutine *crtn, ucontext_t *from)
+{
+    ce_run_stack *rs;
+    uintptr_t arg_ptr;
+
+    // a hint left by a coroutine that exited instead of pausing
+    scheduler.run_next = CE_DUMMY_COROUTINE_ID;
     switch (crtn->status) {
     case CE_COROUTINE_READY:
+        if (acquire_run_stack(crtn) != CE_SUCCESS) {
+            return;
+        }
+        rs = &scheduler.run_stacks[crtn->stack_idx];
         getcontext(&crtn->ctx);
         crtn->ctx.uc_stack.ss_size = scheduler.stack_size;
-        crtn->ctx.uc_stack.ss_sp = scheduler.run_stack;
+        crtn->ctx.uc_stack.ss_sp = rs->mem;
         crtn->ctx.uc_link = &scheduler.ctx;
-        crtn->status = CE_COROUTINE_RUNNING;
-        scheduler.cur_running = crtn_id;
-        uintptr_t arg_ptr = (uintptr_t)crtn;
+        set_status(crtn, CE_COROUTINE_RUNNING);
+        scheduler.cur_running = crtn->self_id;
+        scheduler.running_func = crtn->func;
+        __atomic_store_n(&scheduler.switches, scheduler.switches + 1,
+                         __ATOMIC_RELAXED);
+        CE_STATS_ADD(resumes, 1);
+        CE_TRACE_EVT(CE_TRACE_RESUME, crtn->self_id, 0);
+        arg_ptr = (uintptr_t)crtn;
         // split crtn ptr to low bits and high bits,
         // so that it can work on both 32bits arch and 64bits arch
         // but it is said that compatibility is guaranteed since glibc 2.8
@@ -201,15 +630,20 @@ void ce_coroutine_resume(int crtn_id)
                     2,
                     (uint32_t)arg_ptr,
                     (uint32_t)(arg_ptr >> 32));
-        swapcontext(&scheduler.ctx, &crtn->ctx);
+        swap_context(from, &crtn->ctx);
         break;
     case CE_COROUTINE_SUSPENDED:
-        memcpy(scheduler.run_stack + scheduler.stack_size - crtn->stack_size,
-               crtn->stack,
-               crtn->stack_size);
-        crtn->status = CE_COROUTINE_RUNNING;
-        scheduler.cur_running = crtn_id;
-        swapcontext(&scheduler.ctx, &crtn->ctx);
+        if (acquire_run_stack(crtn) != CE_SUCCESS) {
+            return;
+        }
+        set_status(crtn, CE_COROUTINE_RUNNING);
+        scheduler.cur_running = crtn->self_id;
+        scheduler.running_func = crtn->func;
+        __atomic_store_n(&scheduler.switches, scheduler.switches + 1,
+                         __ATOMIC_RELAXED);
+        CE_STATS_ADD(resumes, 1);
+        CE_TRACE_EVT(CE_TRACE_RESUME, crtn->self_id, 0);
+        swap_context(from, &crtn->ctx);
         break;
     default:
         // other status that shouldn't be resumed
@@ -217,56 +651,164 @@ void ce_coroutine_resume(int crtn_id)
     }
 }
 
-static int save_stack(ce_coroutine *crtn, ce_scheduler *sched)
+void ce_coroutine_resume(int crtn_id)
 {
-    char dummy = 0;
-    free(crtn->stack);
-    crtn->stack_size = sched->run_stack + sched->stack_size - &dummy;
-    crtn->stack = (char *)malloc(sizeof(char) * crtn->stack_size);
-    if (crtn->stack == NULL) {
-        printf("Failed to new space to save stack\n");
-        return CE_FAILURE;
+    ce_coroutine *crtn;
+
+    if (crtn_id == CE_DUMMY_COROUTINE_ID) {
+        CE_LOG_ERROR("Could not resume a dummy coroutine");
+        return;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
+    if (crtn == NULL) {
+        CE_LOG_ERROR("Could not resume a null coroutine");
+        return;
     }
-    memcpy(crtn->stack, &dummy, sizeof(char) * crtn->stack_size);
+    switch_in(crtn, &scheduler.ctx);
+
+    // handoffs between coroutines sharing a run stack come back here
+    while (scheduler.handoff_to != CE_DUMMY_COROUTINE_ID) {
+        crtn = scheduler.coroutine_list[scheduler.handoff_to];
+        scheduler.handoff_to = CE_DUMMY_COROUTINE_ID;
+        if (crtn != NULL) {
+            switch_in(crtn, &scheduler.ctx);
+        }
+    }
+}
 
-    return CE_SUCCESS;
+static __attribute__((noinline)) void mark_stack(ce_coroutine *crtn)
+{
+    // everything above this frame is in use by the paused coroutine
+    crtn->stack_sp = (char *)__builtin_frame_address(0);
 }
 
+/*
+  the current coroutine pauses with to_status, the run_next one (if still
+  runnable) is switched to without going back to the run loop
+*/
 static void ce_coroutine_pause(int to_status)
 {
     int crtn_id = scheduler.cur_running;
     ce_coroutine *crtn = scheduler.coroutine_list[crtn_id];
-    if ((char *)&crtn <= scheduler.run_stack) {
+    ce_coroutine *next = NULL;
+    int next_id = scheduler.run_next;
+
+    if ((char *)&crtn <= scheduler.run_stacks[crtn->stack_idx].mem) {
         // current coroutine has run out of available stack
-        printf("ERROR: Current coroutine has run out of available stack\n");
+        CE_LOG_ERROR("Current coroutine has run out of available stack");
         return;
     }
-    if (save_stack(crtn, &scheduler) != 0) {
-        printf("ERROR: Failed to save stack before pausing a coroutine\n");
-        return;
+    scheduler.run_next = CE_DUMMY_COROUTINE_ID;
+    if (next_id >= 0 && next_id < scheduler.slots && next_id != crtn_id) {
+        next = scheduler.coroutine_list[next_id];
+        if (next != NULL && next->status != CE_COROUTINE_READY
+            && next->status != CE_COROUTINE_SUSPENDED) {
+            next = NULL;
+        }
     }
-    crtn->status = to_status;
+    // frames are saved lazily, when another coroutine takes the run stack
+    mark_stack(crtn);
+    set_status(crtn, to_status);
     scheduler.cur_running = CE_DUMMY_COROUTINE_ID;
-    swapcontext(&crtn->ctx, &scheduler.ctx);
+    scheduler.running_func = NULL;
+    CE_TRACE_EVT(CE_TRACE_PAUSE, crtn_id, to_status);
+    if (next == NULL) {
+        swap_context(&crtn->ctx, &scheduler.ctx);
+        return;
+    }
+    CE_STATS_ADD(handoffs, 1);
+    if (next->stack_idx == crtn->stack_idx) {
+        // our frames are still in use, so they can't be saved to make room
+        // for next; the scheduler switches to it from its own stack
+        scheduler.handoff_to = next_id;
+        swap_context(&crtn->ctx, &scheduler.ctx);
+        return;
+    }
+    switch_in(next, &crtn->ctx);
+    if (crtn->status != CE_COROUTINE_RUNNING) {
+        // next could not be switched to, wait for the run loop instead
+        swap_context(&crtn->ctx, &scheduler.ctx);
+    }
 }
 
 void ce_coroutine_yield()
 {
+    CE_STATS_ADD(yields, 1);
     ce_coroutine_pause(CE_COROUTINE_SUSPENDED);
 }
 
 void ce_coroutine_block()
 {
+    CE_STATS_ADD(blocks, 1);
     ce_coroutine_pause(CE_COROUTINE_BLOCKED);
 }
 
+/*
+  crtn_id was just woken by the running coroutine, it runs as soon as the
+  running one pauses instead of waiting for the run loop to reach it
+*/
+void ce_coroutine_run_next(int crtn_id)
+{
+    if (scheduler.cur_running != CE_DUMMY_COROUTINE_ID) {
+        scheduler.run_next = crtn_id;
+    }
+}
+
+static void wake_timed_out(void *arg)
+{
+    ce_coroutine *crtn = (ce_coroutine *)arg;
+
+    crtn->wait_timer = NULL;
+    if (crtn->status == CE_COROUTINE_BLOCKED) {
+        crtn->timed_out = TRUE;
+        set_status(crtn, CE_COROUTINE_SUSPENDED);
+    }
+}
+
+int ce_coroutine_block_timeout(int timeout_ms)
+{
+    ce_coroutine *crtn;
+
+    if (timeout_ms < 0) {
+        ce_coroutine_block();
+        return CE_SUCCESS;
+    }
+
+    crtn = scheduler.coroutine_list[scheduler.cur_running];
+    crtn->timed_out = FALSE;
+    crtn->wait_timer = ce_timer_add(timeout_ms, wake_timed_out, crtn);
+    if (crtn->wait_timer == NULL) {
+        CE_LOG_ERROR("Failed to add timer for blocking coroutine");
+        return CE_FAILURE;
+    }
+    ce_coroutine_block();
+
+    // woken up by someone else before the deadline
+    if (crtn->wait_timer != NULL) {
+        ce_timer_cancel(crtn->wait_timer);
+        crtn->wait_timer = NULL;
+    }
+
+    return crtn->timed_out ? CE_TIMEOUT : CE_SUCCESS;
+}
+
 void ce_coroutine_exit(int crtn_id)
 {
     ce_coroutine *crtn = scheduler.coroutine_list[crtn_id];
     if (crtn != NULL) {
-        free(crtn->stack);
-        free(crtn);
-        fill_slot_with_last(crtn_id);
+        CE_TRACE_EVT(CE_TRACE_EXIT, crtn_id, 0);
+        if (crtn->wait_timer != NULL) {
+            ce_timer_cancel(crtn->wait_timer);
+        }
+        set_status(crtn, CE_COROUTINE_IDLE);
+        if (scheduler.run_stacks[crtn->stack_idx].owner == crtn_id) {
+            scheduler.run_stacks[crtn->stack_idx].owner = CE_DUMMY_COROUTINE_ID;
+        }
+        release_slot(crtn_id);
+        ce_arena_release(&crtn->arena);
+        release_arg(crtn);
+        release_crtn(crtn);
+        CE_STATS_ADD(exits, 1);
     }
 }
 
@@ -274,7 +816,7 @@ int ce_get_coroutine_status(int crtn_id)
 {
     ce_coroutine *crtn;
 
-    if (crtn_id < 0) {
+    if (crtn_id < 0 || crtn_id >= scheduler.slots) {
         return CE_COROUTINE_IDLE;
     }
 
@@ -288,11 +830,62 @@ int ce_get_coroutine_status(int crtn_id)
 
 int ce_set_coroutine_status(int crtn_id, int status)
 {
-    ce_coroutine *crtn = scheduler.coroutine_list[crtn_id];
+    ce_coroutine *crtn;
+
+    if (crtn_id < 0 || crtn_id >= scheduler.slots) {
+        return CE_FAILURE;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
     if (crtn == NULL) {
         return CE_FAILURE;
     }
-    crtn->status = status;
-    
+    set_status(crtn, status);
+
+    return CE_SUCCESS;
+}
+
+ce_arena_chunk **ce_coroutine_arena(int crtn_id)
+{
+    ce_coroutine *crtn;
+
+    if (crtn_id < 0 || crtn_id >= scheduler.slots) {
+        return NULL;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
+    if (crtn == NULL) {
+        return NULL;
+    }
+
+    return &crtn->arena;
+}
+
+int ce_get_coroutine_flags(int crtn_id)
+{
+    ce_coroutine *crtn;
+
+    if (crtn_id < 0 || crtn_id >= scheduler.slots) {
+        return 0;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
+    if (crtn == NULL) {
+        return 0;
+    }
+
+    return crtn->flags;
+}
+
+int ce_set_coroutine_flags(int crtn_id, int flags)
+{
+    ce_coroutine *crtn;
+
+    if (crtn_id < 0 || crtn_id >= scheduler.slots) {
+        return CE_FAILURE;
+    }
+    crtn = scheduler.coroutine_list[crtn_id];
+    if (crtn == NULL) {
+        return CE_FAILURE;
+    }
+    crtn->flags = flags;
+
     return CE_SUCCESS;
 }
@@ -1,22 +1,43 @@
 #ifndef _COEVT_COROUTINE_H_
 #define _COEVT_COROUTINE_H_
 
+#include <stddef.h>
+#include "arena.h"
+
 typedef struct ce_scheduler ce_scheduler;
 typedef struct ce_coroutine ce_coroutine;
 typedef void (*coroutine_func)(void *arg); 
 
+int ce_set_run_stack_num(int num);
 int ce_init_scheduler(int stack_size, int init_cap);
 int ce_close_scheduler();
 int ce_cur_coroutine();
 int ce_coroutine_cnt();
+int ce_coroutine_runnable();
+int ce_coroutine_slots();
+unsigned long ce_coroutine_switches();
+int ce_coroutine_switching();
+coroutine_func ce_coroutine_running_func();
+int ce_coroutine_level_cnt(int prio);
+int ce_coroutine_level_at(int prio, int idx);
+void ce_coroutine_level_begin_scan(int prio);
+void ce_coroutine_level_end_scan(int prio);
 
 int ce_coroutine_create(coroutine_func func, void *arg);
+int ce_coroutine_create_prio(coroutine_func func, void *arg, int prio);
+int ce_coroutine_create_inline(coroutine_func func, size_t size,
+                               coroutine_func dtor, void **space);
 void ce_coroutine_resume(int coroutine_id);
 void ce_coroutine_yield();
 void ce_coroutine_block();
+void ce_coroutine_run_next(int coroutine_id);
+int ce_coroutine_block_timeout(int timeout_ms);
 void ce_coroutine_exit(int coroutine_id);
 
 int ce_get_coroutine_status(int coroutine_id);
 int ce_set_coroutine_status(int coroutine_id, int status);
+ce_arena_chunk **ce_coroutine_arena(int coroutine_id);
+int ce_get_coroutine_flags(int coroutine_id);
+int ce_set_coroutine_flags(int coroutine_id, int flags);
 
 #endif
@@ -1,16 +1,23 @@
 #ifndef _COEVT_DEFS_H_
 #define _COEVT_DEFS_H_
 
+// private to the library, the public constants are in coevt.h
+#include "coevt.h"
+
 // contants for events
-#define MAX_FD_NUM 1024
+#define MAX_FD_NUM 1024 // initial size of the fd table, grows on demand
 #define MAX_EPOLL_EVTS (MAX_FD_NUM * 2)
-#define POLL_TIMEOUT 1
-#define CE_READ 1
-#define CE_WRITE 2
+#define POLL_TIMEOUT -1 // ce_run sleeps until the next event or timer
 
 // contants for coroutines
 #define STACK_SIZE (1024 * 1024)
+#define RUN_STACK_NUM 1 // default number of shared run stacks
 #define INIT_CAPACITY 16
+#define CRTN_CACHE_SIZE 256 // exited descriptors kept for new coroutines
+#define CRTN_CACHE_STACK 4096 // largest stack copy kept with a cached one
+#define ARENA_CHUNK_SIZE 4096 // chunks of the per coroutine arenas
+#define ARENA_CACHE_SIZE 256 // free arena chunks kept by the scheduler
+#define CE_INLINE_ARG_SIZE 64 // task arguments stored in the descriptor
 
 #define CE_COROUTINE_IDLE 0
 #define CE_COROUTINE_READY 1
@@ -20,9 +27,13 @@
 
 #define CE_DUMMY_COROUTINE_ID -1
 
+// coroutine flags
+#define CE_FLAG_HOOK 1 // libc calls are routed through the poller
+
+// resumes of a lower level between two checks for higher level work
+#define PRIO_SHARE 16
+
 // global contants
-#define CE_SUCCESS 0
-#define CE_FAILURE -1
 #define TRUE 1
 #define FALSE 0
 
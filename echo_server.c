@@ -6,103 +6,50 @@
 #include <errno.h>
 
 #include "coevt.h"
+#include "log.h"
 
-#define CHAN_SIZE 1024
-#define WORKER_NUM 128
+#define MAX_CONN_NUM 1000
 
 typedef struct fd_arg {
     int fd;
 } fd_arg;
 
-typedef struct channel { // TODO: implement mechanism like golang channels to replace this
-    int first;
-    int last;
-    int cap;
-    int is_empty;
-    int eles[CHAN_SIZE];
-} channel;
-
-static channel *chan;
-static void init_channal()
-{
-    chan = (channel *)malloc(sizeof(channel));
-    memset(chan, -1, sizeof(channel));
-    chan->first = 0;
-    chan->last = 0;
-    chan->is_empty = 1;
-    chan->cap = CHAN_SIZE;
-}
-
-static int put(int ele)
-{
-    if (chan->last == chan->first && chan->is_empty == 0) {
-        printf("WARNING: channel is full, will discard a request\n");
-        return -1;
-    }
-    chan->is_empty = 0;
-    chan->eles[chan->last] = ele;
-    chan->last = (chan->last + 1) % chan->cap;
-    return 0;
-}
-
-static int take()
+void process_io(int cli_fd, void *arg)
 {
-    int ret;
-    if (chan->is_empty) {
-        return -1;
-    }
-    ret = chan->eles[chan->first];
-    chan->first = (chan->first + 1) % chan->cap;
-    if (chan->first == chan->last) {
-        chan->is_empty = 1;
-    }
-    return ret;
-}
+    char head[64];
+    struct iovec iov[3];
+    ce_buf *buf;
+    ssize_t bytes;
 
-void process_io(void *arg)
-{
+    CE_LOG_INFO("accept connection, return fd %d", cli_fd);
     while (1) {
-        int cli_fd;
-        char rd_buf[1024];
-        char wt_buf[1024 + 128];
-        int bytes;
-
-        cli_fd = take();
-        if (cli_fd == -1) {
-            ce_yield();
-            continue;
-        }
-        while (1) {
-            bytes = ce_read(cli_fd, rd_buf, sizeof(rd_buf));
-            if (bytes <= 0) {
-                printf("ERROR: Failed to read data, will close socket %d\n", cli_fd);
-                ce_close(cli_fd);
-                break;
-            }
-            rd_buf[bytes] = '\0';
-            sprintf(wt_buf, "echo from server(coroutine id: %d):\n%s\n",
-                    ce_cur_task(), rd_buf);
-            ce_write(cli_fd, wt_buf, strlen(wt_buf) + 1);
+        // nothing but the small header is kept while the task is parked
+        bytes = ce_read_pooled(cli_fd, &buf);
+        if (bytes <= 0) {
+            CE_LOG_ERROR("Failed to read data, will close socket %d", cli_fd);
+            ce_close(cli_fd);
+            break;
         }
+        iov[0].iov_base = head;
+        iov[0].iov_len = snprintf(head, sizeof(head),
+                                  "echo from server(coroutine id: %d):\n",
+                                  ce_cur_task());
+        iov[1].iov_base = buf->data;
+        iov[1].iov_len = buf->len;
+        iov[2].iov_base = "\n";
+        iov[2].iov_len = 2;
+        ce_writev(cli_fd, iov, 3);
+        ce_buf_put(buf);
     }
 }
 
 void process_request(void *arg)
 {
     fd_arg *p_arg = (fd_arg *)arg;
-    fd_arg cli_fd_t = { -1 };
-    struct sockaddr_in addr;
 
-    socklen_t len = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
-
-    while (1) {
-        cli_fd_t.fd = accept(p_arg->fd, (struct sockaddr *)&addr, &len);
-        if (cli_fd_t.fd != -1) {
-            printf("INFO: accept connection, return fd %d\n", cli_fd_t.fd);
-            put(cli_fd_t.fd);
-        }
-        ce_yield();
+    // one task per connection, accepting parks until clients arrive
+    if (ce_serve(p_arg->fd, process_io, NULL, MAX_CONN_NUM) != 0) {
+        CE_LOG_ERROR("Failed to serve on socket %d", p_arg->fd);
     }
 }
 
@@ -111,31 +58,25 @@ int main()
     int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
     fd_arg fd_t = { sock_fd };
     struct sockaddr_in addr;
-    int w_id;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(3000);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        printf("ERROR: Failed to bind address for socket\n");
+        CE_LOG_ERROR("Failed to bind address for socket");
         if (errno == EADDRINUSE) {
-            printf("ERROR: The port is already in use\n");
+            CE_LOG_ERROR("The port is already in use");
         }
         close(sock_fd);
         return -1;
     }
     if (listen(sock_fd, 1024) != 0) {
-        printf("ERROR: Failed to listen to port\n");
+        CE_LOG_ERROR("Failed to listen to port");
         close(sock_fd);
         return -1;
     }
 
-    init_channal();
-
-    for (w_id = 0; w_id < WORKER_NUM; w_id++) {
-        ce_task(process_io, NULL);
-    }
     ce_task(process_request, &fd_t);
     ce_run();
 
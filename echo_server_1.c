@@ -10,10 +10,16 @@
 
 #include "channel.h"
 #include "coevt.h"
+#include "log.h"
 
 #define CHAN_SIZE 1024
 #define WORKER_NUM 128
 
+typedef struct server_arg {
+    ce_channel *chan;
+    int listen_fd;
+} server_arg;
+
 void process_io(void *arg)
 {
     ce_channel *chan = (ce_channel *)arg;
@@ -23,15 +29,17 @@ void process_io(void *arg)
         char wt_buf[1024 + 128];
         int bytes;
 
-        ce_chan_recvl(chan, &cli_fd);
+        if (ce_chan_recvl(chan, &cli_fd) != 0) {
+            break;
+        }
         if (cli_fd == -1) {
             ce_yield();
             continue;
         }
         while (1) {
-            bytes = ce_read(cli_fd, rd_buf, sizeof(rd_buf));
+            bytes = ce_read(cli_fd, rd_buf, sizeof(rd_buf) - 1);
             if (bytes <= 0) {
-                printf("ERROR: Failed to read data, will close socket %ld\n", cli_fd);
+                CE_LOG_ERROR("Failed to read data, will close socket %ld", cli_fd);
                 ce_close(cli_fd);
                 break;
             }
@@ -45,22 +53,18 @@ void process_io(void *arg)
 
 void process_request(void *arg)
 {
-    ce_channel *chan = (ce_channel *)arg;
-    long listen_fd;
+    server_arg *p_arg = (server_arg *)arg;
+    ce_channel *chan = p_arg->chan;
     int cli_fd;
-    struct sockaddr_in addr;
-
-    ce_chan_recvl(chan, &listen_fd); // the 1st element sent into channel is the listening fd
-    socklen_t len = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
 
     while (1) {
-        cli_fd = accept(listen_fd, (struct sockaddr *)&addr, &len);
-        if (cli_fd != -1) {
-            printf("INFO: accept connection, return fd %d\n", cli_fd);
-            ce_chan_sendl(chan, cli_fd);
+        // parks until a client arrives, then drains the backlog
+        cli_fd = ce_accept(p_arg->listen_fd, NULL, NULL);
+        if (cli_fd == -1) {
+            break;
         }
-        ce_yield();
+        CE_LOG_INFO("accept connection, return fd %d", cli_fd);
+        ce_chan_sendl(chan, cli_fd);
     }
 }
 
@@ -75,25 +79,25 @@ int main()
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        printf("ERROR: Failed to bind address for socket\n");
+        CE_LOG_ERROR("Failed to bind address for socket");
         if (errno == EADDRINUSE) {
-            printf("ERROR: The port is already in use\n");
+            CE_LOG_ERROR("The port is already in use");
         }
         close(sock_fd);
         return -1;
     }
     if (listen(sock_fd, 1024) != 0) {
-        printf("ERROR: Failed to listen to port\n");
+        CE_LOG_ERROR("Failed to listen to port");
         close(sock_fd);
         return -1;
     }
 
     ce_channel *chan = ce_chan_create(CHAN_SIZE);
+    server_arg srv_arg = { chan, sock_fd };
     for (w_id = 0; w_id < WORKER_NUM; w_id++) {
         ce_task(process_io, chan);
     }
-    ce_task(process_request, chan);
-    ce_chan_sendl(chan, sock_fd);
+    ce_task(process_request, &srv_arg);
     ce_run();
 
     return 0;
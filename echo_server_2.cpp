@@ -0,0 +1,68 @@
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "coevt.hpp"
+extern "C" {
+#include "log.h"
+}
+
+// echo server written against the C++ layer, connections report the bytes
+// they echoed to a logging task through a typed channel
+struct conn_report {
+    int fd;
+    long bytes;
+};
+
+int main()
+{
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(3002);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind address for socket");
+        if (errno == EADDRINUSE) {
+            CE_LOG_ERROR("The port is already in use");
+        }
+        close(sock_fd);
+        return -1;
+    }
+    if (listen(sock_fd, 1024) != 0) {
+        CE_LOG_ERROR("Failed to listen to port");
+        close(sock_fd);
+        return -1;
+    }
+
+    ce::chan<conn_report> reports(64);
+
+    ce::spawn([reports]() mutable {
+        conn_report r;
+        while (reports.recv(r)) {
+            CE_LOG_INFO("connection on fd %d echoed %ld bytes", r.fd, r.bytes);
+        }
+    });
+
+    ce::spawn([sock_fd, reports]() {
+        int cli_fd;
+        while ((cli_fd = ce_accept(sock_fd, NULL, NULL)) != CE_FAILURE) {
+            ce::spawn([reports, cli_fd]() mutable {
+                ce::fd conn(cli_fd);
+                char buf[1024];
+                long total = 0;
+                ssize_t bytes;
+                while ((bytes = conn.read(buf, sizeof(buf))) > 0
+                       && conn.write_all(buf, bytes)) {
+                    total += bytes;
+                }
+                reports.send(conn_report{cli_fd, total});
+            });
+        }
+    });
+
+    return ce::run();
+}
@@ -0,0 +1,82 @@
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "coevt_co.hpp"
+extern "C" {
+#include "log.h"
+}
+
+// echo server on stackless tasks, a parked connection is just its frame
+ce::co::task<bool> echo_once(int fd, char *buf, size_t size)
+{
+    ssize_t bytes = co_await ce::co::read(fd, buf, size);
+    ssize_t sent = 0;
+    ssize_t ret;
+
+    if (bytes <= 0) {
+        co_return false;
+    }
+    while (sent < bytes) {
+        ret = co_await ce::co::write(fd, buf + sent, bytes - sent);
+        if (ret <= 0) {
+            co_return false;
+        }
+        sent += ret;
+    }
+    co_return true;
+}
+
+ce::co::task<> process_io(int fd)
+{
+    while (co_await ce::co::readable(fd)) {
+        // the buffer only exists while data is in flight,
+        // an idle connection keeps nothing but this frame
+        std::unique_ptr<char[]> buf(new char[1024]);
+        if (!co_await echo_once(fd, buf.get(), 1024)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+ce::co::task<> process_request(int listen_fd)
+{
+    int cli_fd;
+
+    while ((cli_fd = co_await ce::co::accept(listen_fd)) >= 0) {
+        ce::co::spawn(process_io(cli_fd));
+    }
+    CE_LOG_ERROR("Failed to accept connection on fd %d", listen_fd);
+}
+
+int main()
+{
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    int on = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(3003);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind address for socket");
+        if (errno == EADDRINUSE) {
+            CE_LOG_ERROR("The port is already in use");
+        }
+        close(sock_fd);
+        return -1;
+    }
+    if (listen(sock_fd, 1024) != 0) {
+        CE_LOG_ERROR("Failed to listen to port");
+        close(sock_fd);
+        return -1;
+    }
+
+    ce::co::spawn(process_request(sock_fd));
+    return ce::co::run();
+}
@@ -0,0 +1,84 @@
+/*
+ * echo server written like blocking code: connection tasks call accept,
+ * read, write and sleep from libc, and the hook parks them on the poller
+ * the binary links hook.o, a program linked against the shared library
+ * would link libcoevt_hook.so or preload it instead
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include "coevt.h"
+#include "hook.h"
+#include "log.h"
+
+static int listen_fd;
+
+// what a blocking thread per connection would run
+static void process_io(void *arg)
+{
+    int cli_fd = (int)(long)arg;
+    char buf[1024];
+    ssize_t bytes;
+
+    ce_hook_enable();
+    while ((bytes = read(cli_fd, buf, sizeof(buf) - 1)) > 0) {
+        // the response ends with '\0', like the one of echo_server
+        buf[bytes] = '\0';
+        if (write(cli_fd, buf, bytes + 1) != bytes + 1) {
+            break;
+        }
+    }
+    close(cli_fd);
+}
+
+static void process_request(void *arg)
+{
+    int cli_fd;
+
+    ce_hook_enable();
+    while ((cli_fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        CE_LOG_INFO("accept connection, return fd %d", cli_fd);
+        if (ce_task(process_io, (void *)(long)cli_fd) != CE_SUCCESS) {
+            close(cli_fd);
+        }
+    }
+    CE_LOG_ERROR("Failed to accept connection on fd %d", listen_fd);
+}
+
+int main()
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    // blocking, as in the code the hook is meant for
+    listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(3004);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind address for socket");
+        if (errno == EADDRINUSE) {
+            CE_LOG_ERROR("The port is already in use");
+        }
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, 1024) != 0) {
+        CE_LOG_ERROR("Failed to listen to port");
+        close(listen_fd);
+        return -1;
+    }
+
+    ce_task(process_request, NULL);
+    ce_run();
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "defs.h"
+#include "log.h"
+#include "coroutine.h"
+#include "poller.h"
+#include "timer.h"
+#include "coevt.h"
+#include "hook.h"
+
+typedef ssize_t (*read_func)(int, void *, size_t);
+typedef ssize_t (*write_func)(int, const void *, size_t);
+typedef ssize_t (*recv_func)(int, void *, size_t, int);
+typedef ssize_t (*send_func)(int, const void *, size_t, int);
+typedef int (*accept_func)(int, struct sockaddr *, socklen_t *);
+typedef int (*connect_func)(int, const struct sockaddr *, socklen_t);
+typedef int (*poll_func)(struct pollfd *, nfds_t, int);
+typedef unsigned int (*sleep_func)(unsigned int);
+
+// the libc implementations, resolved on first use
+static read_func real_read = NULL;
+static write_func real_write = NULL;
+static recv_func real_recv = NULL;
+static send_func real_send = NULL;
+static accept_func real_accept = NULL;
+static connect_func real_connect = NULL;
+static poll_func real_poll = NULL;
+static sleep_func real_sleep = NULL;
+
+#define HOOK_SYM(name) \
+    do { \
+        if (real_##name == NULL) { \
+            real_##name = (name##_func)dlsym(RTLD_NEXT, #name); \
+        } \
+    } while (0)
+
+/*
+  the thread running the unique scheduler in the process, calls from any
+  other thread always go to libc
+*/
+static pthread_t loop_thread;
+static int loop_thread_set = FALSE;
+
+static int hooked()
+{
+    int crtn_id;
+
+    if (!loop_thread_set || !pthread_equal(pthread_self(), loop_thread)) {
+        return FALSE;
+    }
+    crtn_id = ce_cur_coroutine();
+    if (crtn_id == CE_DUMMY_COROUTINE_ID) {
+        return FALSE;
+    }
+
+    return (ce_get_coroutine_flags(crtn_id) & CE_FLAG_HOOK) != 0;
+}
+
+static int set_hook_flag(int on)
+{
+    int crtn_id = ce_cur_coroutine();
+    int flags;
+
+    if (crtn_id == CE_DUMMY_COROUTINE_ID) {
+        CE_LOG_ERROR("Hook can only be changed within a task");
+        return CE_FAILURE;
+    }
+    flags = ce_get_coroutine_flags(crtn_id);
+    flags = on ? (flags | CE_FLAG_HOOK) : (flags & ~CE_FLAG_HOOK);
+    loop_thread = pthread_self();
+    loop_thread_set = TRUE;
+
+    return ce_set_coroutine_flags(crtn_id, flags);
+}
+
+int ce_hook_enable()
+{
+    return set_hook_flag(TRUE);
+}
+
+int ce_hook_disable()
+{
+    return set_hook_flag(FALSE);
+}
+
+int ce_hook_enabled()
+{
+    return hooked();
+}
+
+// the fd was set nonblocking by the caller, who expects EAGAIN
+static int user_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    return flags >= 0 && (flags & O_NONBLOCK);
+}
+
+// park the current task until the fd is ready
+static int wait_fd(int fd, int event, int timeout_ms)
+{
+    int ret;
+
+    if (ce_listen(fd, event) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    ret = ce_wait_timeout(timeout_ms);
+    ce_unlisten(fd, event);
+
+    return ret;
+}
+
+static ssize_t sock_io(int fd, void *buf, size_t count, int flags, int event)
+{
+    ssize_t ret;
+
+    while (1) {
+        if (event == CE_READ) {
+            ret = real_recv(fd, buf, count, flags | MSG_DONTWAIT);
+        } else {
+            ret = real_send(fd, buf, count, flags | MSG_DONTWAIT);
+        }
+        if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return ret;
+        }
+        if (user_nonblock(fd)) {
+            return ret;
+        }
+        if (wait_fd(fd, event, -1) == CE_FAILURE) {
+            break;
+        }
+    }
+
+    // can not park, block the way the caller asked for
+    if (event == CE_READ) {
+        return real_recv(fd, buf, count, flags);
+    }
+    return real_send(fd, buf, count, flags);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+
+    HOOK_SYM(read);
+    HOOK_SYM(recv);
+    if (!hooked()) {
+        return real_read(fd, buf, count);
+    }
+    ret = sock_io(fd, buf, count, 0, CE_READ);
+    if (ret < 0 && errno == ENOTSOCK) {
+        return real_read(fd, buf, count);
+    }
+
+    return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+
+    HOOK_SYM(write);
+    HOOK_SYM(send);
+    if (!hooked()) {
+        return real_write(fd, buf, count);
+    }
+    ret = sock_io(fd, (void *)buf, count, 0, CE_WRITE);
+    if (ret < 0 && errno == ENOTSOCK) {
+        return real_write(fd, buf, count);
+    }
+
+    return ret;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    HOOK_SYM(recv);
+    if (!hooked() || (flags & MSG_DONTWAIT)) {
+        return real_recv(fd, buf, len, flags);
+    }
+
+    return sock_io(fd, buf, len, flags, CE_READ);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    HOOK_SYM(send);
+    if (!hooked() || (flags & MSG_DONTWAIT)) {
+        return real_send(fd, buf, len, flags);
+    }
+
+    return sock_io(fd, (void *)buf, len, flags, CE_WRITE);
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int flags;
+    int ret;
+    int err;
+
+    HOOK_SYM(accept);
+    if (!hooked()) {
+        return real_accept(fd, addr, addrlen);
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || (flags & O_NONBLOCK)) {
+        return real_accept(fd, addr, addrlen);
+    }
+
+    // nonblocking only while the task is parked, the accepted fd keeps
+    // the default blocking mode
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return real_accept(fd, addr, addrlen);
+    }
+    while ((ret = real_accept(fd, addr, addrlen)) < 0
+           && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (wait_fd(fd, CE_READ, -1) == CE_FAILURE) {
+            fcntl(fd, F_SETFL, flags);
+            return real_accept(fd, addr, addrlen);
+        }
+    }
+    err = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = err;
+
+    return ret;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct pollfd pfd;
+    int flags;
+    int ret;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    HOOK_SYM(connect);
+    HOOK_SYM(poll);
+    if (!hooked()) {
+        return real_connect(fd, addr, addrlen);
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || (flags & O_NONBLOCK)) {
+        return real_connect(fd, addr, addrlen);
+    }
+
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return real_connect(fd, addr, addrlen);
+    }
+    ret = real_connect(fd, addr, addrlen);
+    if (ret < 0 && errno == EINPROGRESS) {
+        // connection completes (or fails) when the fd becomes writable
+        if (wait_fd(fd, CE_WRITE, -1) == CE_FAILURE) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            real_poll(&pfd, 1, -1);
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) {
+            err = errno;
+        }
+        ret = err == 0 ? 0 : -1;
+    } else if (ret < 0) {
+        err = errno;
+    }
+    fcntl(fd, F_SETFL, flags);
+    if (ret < 0) {
+        errno = err;
+    }
+
+    return ret;
+}
+
+static int poll_event(short events)
+{
+    int event = 0;
+
+    if (events & (POLLIN | POLLPRI | POLLRDHUP)) {
+        event |= CE_READ;
+    }
+    if (events & POLLOUT) {
+        event |= CE_WRITE;
+    }
+    // errors and hangups are reported to readers
+    return event == 0 ? CE_READ : event;
+}
+
+// register the events of fds not watched by another task, marked in revents
+static void listen_fds(struct pollfd *fds, nfds_t nfds)
+{
+    nfds_t i;
+    int event;
+
+    for (i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        event = poll_event(fds[i].events);
+        if ((event & CE_READ) && (!ce_poller_initialized()
+                || ce_poller_lookup(fds[i].fd, CE_READ) != CE_SUCCESS)
+                && ce_listen(fds[i].fd, CE_READ) == CE_SUCCESS) {
+            fds[i].revents |= CE_READ;
+        }
+        if ((event & CE_WRITE) && (!ce_poller_initialized()
+                || ce_poller_lookup(fds[i].fd, CE_WRITE) != CE_SUCCESS)
+                && ce_listen(fds[i].fd, CE_WRITE) == CE_SUCCESS) {
+            fds[i].revents |= CE_WRITE;
+        }
+    }
+}
+
+static void unlisten_fds(struct pollfd *fds, nfds_t nfds)
+{
+    nfds_t i;
+
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].revents & CE_READ) {
+            ce_unlisten(fds[i].fd, CE_READ);
+        }
+        if (fds[i].revents & CE_WRITE) {
+            ce_unlisten(fds[i].fd, CE_WRITE);
+        }
+    }
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    long long deadline = 0;
+    int ret;
+
+    HOOK_SYM(poll);
+    if (!hooked() || timeout == 0) {
+        return real_poll(fds, nfds, timeout);
+    }
+    if (timeout > 0) {
+        deadline = ce_now_ms() + timeout;
+    }
+
+    /*
+      a wakeup is only a hint, another task may have drained the fd, or
+      it was woken for an event not asked for, so wait again until poll
+      itself sees an event or the deadline passes
+    */
+    while ((ret = real_poll(fds, nfds, 0)) == 0) {
+        if (timeout > 0) {
+            timeout = (int)(deadline - ce_now_ms());
+            if (timeout <= 0) {
+                break;
+            }
+        }
+        // revents is overwritten by the next poll, so it remembers which
+        // events this task registered until then
+        listen_fds(fds, nfds);
+        ret = ce_wait_timeout(timeout);
+        unlisten_fds(fds, nfds);
+        if (ret != CE_SUCCESS) {
+            return real_poll(fds, nfds, 0);
+        }
+    }
+
+    return ret;
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    HOOK_SYM(sleep);
+    if (!hooked()) {
+        return real_sleep(seconds);
+    }
+    // ce_sleep takes int milliseconds, longer sleeps are cut to ~24 days
+    ce_sleep(seconds > INT_MAX / 1000 ? INT_MAX : (int)seconds * 1000);
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _COEVT_HOOK_H_
+#define _COEVT_HOOK_H_
+
+/*
+  read, write, recv, send, accept, connect, poll and sleep of a task that
+  enabled the hook park the task on the poller instead of blocking the
+  scheduler; link with libcoevt_hook.so (or preload it) to interpose them
+  read and write only park on sockets, on pipes, terminals and regular
+  files they go straight to libc and block the whole scheduler
+*/
+int ce_hook_enable();
+int ce_hook_disable();
+int ce_hook_enabled();
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * coevt nested in an event loop of its own: the host epolls its timerfd
+ * and ce_backend_fd, waits no longer than ce_backend_timeout and calls
+ * ce_run_once when coevt has something to do
+ * on every host tick it adds a task and a ce_after timer from outside the
+ * run loop, while two tasks play ping-pong over a socket pair with sleeps
+ * in between; exits with 0 once all of it ran, and reports how often the
+ * host woke up, which stays near the number of events instead of spinning
+ * */
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "coevt.h"
+
+#define HOST_TICKS 20
+#define HOST_TICK_MS 25
+#define PINGS 50
+#define PING_SLEEP_MS 5
+#define TASK_YIELDS 3
+
+static int sv[2];
+static int pongs = 0;
+static int timers_fired = 0;
+static int tasks_done = 0;
+
+static void pinger(void *arg)
+{
+    char c = 'p';
+    int i;
+
+    for (i = 0; i < PINGS; i++) {
+        if (ce_write(sv[0], &c, 1) != 1 || ce_read(sv[0], &c, 1) != 1) {
+            break;
+        }
+        pongs++;
+        ce_sleep(PING_SLEEP_MS);
+    }
+    // the ponger reads the end of the stream and returns
+    ce_close(sv[0]);
+}
+
+static void ponger(void *arg)
+{
+    char c;
+
+    while (ce_read(sv[1], &c, 1) == 1) {
+        if (ce_write(sv[1], &c, 1) != 1) {
+            break;
+        }
+    }
+    ce_close(sv[1]);
+}
+
+static void on_timer(void *arg)
+{
+    timers_fired++;
+    ce_release();
+}
+
+static void host_task(void *arg)
+{
+    int i;
+
+    for (i = 0; i < TASK_YIELDS; i++) {
+        ce_yield();
+    }
+    tasks_done++;
+}
+
+// work the host hands to coevt between two calls of ce_run_once
+static int host_tick()
+{
+    if (ce_task(host_task, NULL) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    // the hold keeps ce_run_once reporting work until the timer fired
+    ce_hold();
+    if (ce_after(HOST_TICK_MS / 2, on_timer, NULL) != CE_SUCCESS) {
+        ce_release();
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+static int add_fd(int epfd, int fd)
+{
+    struct epoll_event evt;
+
+    evt.events = EPOLLIN;
+    evt.data.fd = fd;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &evt);
+}
+
+int main()
+{
+    struct itimerspec its = {{0, HOST_TICK_MS * 1000000L},
+                             {0, HOST_TICK_MS * 1000000L}};
+    struct epoll_event evts[4];
+    int host_fd, timer_fd, backend_fd;
+    int ticks = 0;
+    int wakeups = 0;
+    int busy = 1;
+    uint64_t expired;
+    int i, n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   sv) != 0) {
+        printf("ERROR: Failed to create socket pair\n");
+        return -1;
+    }
+    ce_task(pinger, NULL);
+    ce_task(ponger, NULL);
+
+    host_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    backend_fd = ce_backend_fd();
+    if (host_fd < 0 || timer_fd < 0 || backend_fd < 0
+        || timerfd_settime(timer_fd, 0, &its, NULL) != 0
+        || add_fd(host_fd, timer_fd) != 0 || add_fd(host_fd, backend_fd) != 0) {
+        printf("ERROR: Failed to set up the host loop\n");
+        return -1;
+    }
+
+    while (busy || ticks < HOST_TICKS) {
+        n = epoll_wait(host_fd, evts, 4, ce_backend_timeout());
+        wakeups++;
+        for (i = 0; i < n; i++) {
+            if (evts[i].data.fd != timer_fd
+                || read(timer_fd, &expired, sizeof(expired)) != sizeof(expired)
+                || ticks == HOST_TICKS) {
+                continue;
+            }
+            if (host_tick() != CE_SUCCESS) {
+                printf("ERROR: Failed to add work to coevt\n");
+                return -1;
+            }
+            if (++ticks == HOST_TICKS) {
+                its.it_value.tv_nsec = 0;
+                timerfd_settime(timer_fd, 0, &its, NULL);
+            }
+        }
+        // the backend fd, a due timer or both, coevt sorts it out
+        busy = ce_run_once(0);
+        if (busy == CE_FAILURE) {
+            printf("ERROR: Failed to run coevt\n");
+            return -1;
+        }
+    }
+
+    printf("{\"example\":\"host_loop\",\"pongs\":%d,\"timers\":%d,"
+           "\"tasks\":%d,\"host_wakeups\":%d}\n",
+           pongs, timers_fired, tasks_done, wakeups);
+
+    return pongs == PINGS && timers_fired == HOST_TICKS
+           && tasks_done == HOST_TICKS ? 0 : -1;
+}
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "defs.h"
+#include "log.h"
+#include "coevt.h"
+#include "http.h"
+
+#define HTTP_BUF_SIZE 16384
+#define HTTP_HEAD_SIZE 256
+#define HTTP_IOV_PER_RESP 4 // status and fixed headers, extra headers, CRLF, body
+
+// results of parse_request other than the length of a complete request
+#define PARSE_AGAIN 0
+#define PARSE_BAD -1
+#define PARSE_TOO_LARGE -2
+#define PARSE_UNSUPPORTED -3
+
+// what ce_http_serve hands to the tasks of its connections
+typedef struct http_server {
+    ce_http_handler handler;
+    void *arg;
+} http_server;
+
+typedef struct http_conn {
+    int fd;
+    http_server *server;
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;       // start of the first request not handled yet
+    int pending;      // responses waiting for the next flush
+    struct iovec iov[CE_HTTP_MAX_PIPELINE * HTTP_IOV_PER_RESP];
+    char head[CE_HTTP_MAX_PIPELINE][HTTP_HEAD_SIZE];
+    void *owned[CE_HTTP_MAX_PIPELINE];
+} http_conn;
+
+// Date header, formatted at most once per second
+static time_t date_sec = 0;
+static char date_buf[64];
+
+static const char *reason_phrase(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+static const char *http_date()
+{
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != date_sec) {
+        gmtime_r(&now, &tm);
+        strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        date_sec = now;
+    }
+
+    return date_buf;
+}
+
+static int token_eq(const char *s, int len, const char *token)
+{
+    return (int)strlen(token) == len && strncasecmp(s, token, len) == 0;
+}
+
+const char *ce_http_header_get(ce_http_request *req, const char *name,
+                               int *value_len)
+{
+    int i;
+
+    for (i = 0; i < req->header_cnt; i++) {
+        if (token_eq(req->headers[i].name, req->headers[i].name_len, name)) {
+            if (value_len != NULL) {
+                *value_len = req->headers[i].value_len;
+            }
+            return req->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+static long parse_request_line(const char *p, const char *end,
+                               ce_http_request *req)
+{
+    const char *sp;
+    const char *line = p;
+
+    sp = memchr(p, ' ', end - p);
+    if (sp == NULL || sp == p) {
+        return PARSE_BAD;
+    }
+    req->method = p;
+    req->method_len = sp - p;
+    p = sp + 1;
+
+    sp = memchr(p, ' ', end - p);
+    if (sp == NULL || sp == p) {
+        return PARSE_BAD;
+    }
+    req->path = p;
+    req->path_len = sp - p;
+    p = sp + 1;
+
+    if (end - p != 8 || memcmp(p, "HTTP/1.", 7) != 0
+        || (p[7] != '0' && p[7] != '1')) {
+        return PARSE_BAD;
+    }
+    req->minor_version = p[7] - '0';
+
+    return end - line;
+}
+
+/*
+  parse one request at the start of data,
+  returns its length or one of the PARSE_ results
+*/
+static long parse_request(const char *data, size_t len, ce_http_request *req)
+{
+    const char *head_end;
+    const char *p;
+    const char *eol;
+    const char *colon;
+    const char *value;
+    size_t head_len;
+    size_t body_len = 0;
+    int connection_close = FALSE;
+    int connection_keep = FALSE;
+    ce_http_header *hdr;
+
+    head_end = memmem(data, len, "\r\n\r\n", 4);
+    if (head_end == NULL) {
+        return len > CE_HTTP_MAX_REQUEST ? PARSE_TOO_LARGE : PARSE_AGAIN;
+    }
+    head_len = head_end + 4 - data;
+    // the buffer grows past the limit before a late CRLFCRLF is found
+    if (head_len > CE_HTTP_MAX_REQUEST) {
+        return PARSE_TOO_LARGE;
+    }
+
+    eol = memmem(data, head_len, "\r\n", 2);
+    if (parse_request_line(data, eol, req) < 0) {
+        return PARSE_BAD;
+    }
+
+    req->header_cnt = 0;
+    for (p = eol + 2; p < head_end + 2; p = eol + 2) {
+        eol = memmem(p, head_end + 2 - p, "\r\n", 2);
+        colon = memchr(p, ':', eol - p);
+        if (colon == NULL || colon == p) {
+            return PARSE_BAD;
+        }
+        if (req->header_cnt == CE_HTTP_MAX_HEADERS) {
+            return PARSE_TOO_LARGE;
+        }
+        value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        hdr = &req->headers[req->header_cnt++];
+        hdr->name = p;
+        hdr->name_len = colon - p;
+        hdr->value = value;
+        hdr->value_len = eol - value;
+        while (hdr->value_len > 0 && (value[hdr->value_len - 1] == ' '
+                                      || value[hdr->value_len - 1] == '\t')) {
+            hdr->value_len--;
+        }
+
+        if (token_eq(hdr->name, hdr->name_len, "Content-Length")) {
+            body_len = strtoul(value, NULL, 10);
+        } else if (token_eq(hdr->name, hdr->name_len, "Transfer-Encoding")) {
+            // chunked request bodies are not supported
+            return PARSE_UNSUPPORTED;
+        } else if (token_eq(hdr->name, hdr->name_len, "Connection")) {
+            connection_close = token_eq(value, hdr->value_len, "close");
+            connection_keep = token_eq(value, hdr->value_len, "keep-alive");
+        }
+    }
+
+    if (body_len > CE_HTTP_MAX_REQUEST - head_len) {
+        return PARSE_TOO_LARGE;
+    }
+    if (len < head_len + body_len) {
+        return PARSE_AGAIN;
+    }
+    req->body = data + head_len;
+    req->body_len = body_len;
+    req->keep_alive = req->minor_version == 1 ? !connection_close
+                                              : connection_keep;
+
+    return head_len + body_len;
+}
+
+static void queue_response(http_conn *conn, ce_http_response *resp,
+                           int keep_alive, int minor_version)
+{
+    struct iovec *iov = &conn->iov[conn->pending * HTTP_IOV_PER_RESP];
+    char *head = conn->head[conn->pending];
+    ce_http_response err;
+    int head_len;
+
+    head_len = snprintf(head, HTTP_HEAD_SIZE,
+                        "HTTP/1.1 %d %s\r\nDate: %s\r\nContent-Length: %zu\r\n"
+                        "Content-Type: %s\r\n%s",
+                        resp->status, reason_phrase(resp->status), http_date(),
+                        resp->body_len,
+                        resp->content_type ? resp->content_type : "text/plain",
+                        !keep_alive ? "Connection: close\r\n"
+                        : (minor_version == 0 ? "Connection: keep-alive\r\n"
+                                              : ""));
+    if (head_len < 0 || head_len >= HTTP_HEAD_SIZE) {
+        // a truncated head would lose its CRLF, answer without the handler's
+        CE_LOG_ERROR("Head of HTTP response with status %d is too long",
+                     resp->status);
+        if (resp->free_body) {
+            free((void *)resp->body);
+        }
+        memset(&err, 0, sizeof(err));
+        err.status = 500;
+        err.body = reason_phrase(err.status);
+        err.body_len = strlen(err.body);
+        queue_response(conn, &err, keep_alive, minor_version);
+        return;
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (void *)(resp->headers ? resp->headers : "");
+    iov[1].iov_len = resp->headers ? strlen(resp->headers) : 0;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    iov[3].iov_base = (void *)resp->body;
+    iov[3].iov_len = resp->body_len;
+    conn->owned[conn->pending] = resp->free_body ? (void *)resp->body : NULL;
+    conn->pending++;
+}
+
+static void queue_error(http_conn *conn, int status)
+{
+    ce_http_response resp;
+
+    memset(&resp, 0, sizeof(resp));
+    resp.status = status;
+    resp.body = reason_phrase(status);
+    resp.body_len = strlen(resp.body);
+    queue_response(conn, &resp, FALSE, 1);
+}
+
+// write all pending responses with as few syscalls as possible
+static int flush_responses(http_conn *conn)
+{
+    struct iovec *iov = conn->iov;
+    int cnt = conn->pending * HTTP_IOV_PER_RESP;
+    ssize_t bytes;
+    int ret = CE_SUCCESS;
+    int i;
+
+    while (cnt > 0) {
+        bytes = ce_writev(conn->fd, iov, cnt);
+        if (bytes < 0) {
+            ret = CE_FAILURE;
+            break;
+        }
+        while (cnt > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    for (i = 0; i < conn->pending; i++) {
+        free(conn->owned[i]);
+        conn->owned[i] = NULL;
+    }
+    conn->pending = 0;
+
+    return ret;
+}
+
+// handle all complete requests in the buffer, returns FALSE to close
+static int handle_requests(http_conn *conn)
+{
+    ce_http_request req;
+    ce_http_response resp;
+    long ret;
+
+    while (conn->pos < conn->len) {
+        ret = parse_request(conn->buf + conn->pos, conn->len - conn->pos, &req);
+        if (ret == PARSE_AGAIN) {
+            return TRUE;
+        }
+        if (ret < 0) {
+            queue_error(conn, ret == PARSE_TOO_LARGE ? 413
+                              : (ret == PARSE_UNSUPPORTED ? 501 : 400));
+            return FALSE;
+        }
+
+        memset(&resp, 0, sizeof(resp));
+        resp.status = 200;
+        conn->server->handler(&req, &resp, conn->server->arg);
+        queue_response(conn, &resp, req.keep_alive, req.minor_version);
+        conn->pos += ret;
+        if (!req.keep_alive) {
+            return FALSE;
+        }
+        if (conn->pending == CE_HTTP_MAX_PIPELINE
+            && flush_responses(conn) != CE_SUCCESS) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// make room at the end of the buffer for the next read
+static int prepare_buffer(http_conn *conn)
+{
+    char *buf;
+
+    if (conn->pos > 0) {
+        memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+        conn->len -= conn->pos;
+        conn->pos = 0;
+    }
+    if (conn->len < conn->cap) {
+        return CE_SUCCESS;
+    }
+
+    // parse_request rejects anything beyond CE_HTTP_MAX_REQUEST
+    buf = (char *)realloc(conn->buf, conn->cap * 2);
+    if (buf == NULL) {
+        CE_LOG_ERROR("Failed to enlarge buffer of HTTP connection");
+        return CE_FAILURE;
+    }
+    conn->buf = buf;
+    conn->cap *= 2;
+
+    return CE_SUCCESS;
+}
+
+static void serve_http(int fd, void *arg)
+{
+    http_conn *conn;
+    ssize_t bytes;
+    int open = TRUE;
+
+    // a connection is larger than a run stack can copy cheaply
+    conn = (http_conn *)calloc(1, sizeof(http_conn));
+    if (conn == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for HTTP connection");
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->server = (http_server *)arg;
+    conn->cap = HTTP_BUF_SIZE;
+    conn->buf = (char *)malloc(conn->cap);
+    if (conn->buf == NULL) {
+        CE_LOG_ERROR("Failed to allocate buffer of HTTP connection");
+        free(conn);
+        close(fd);
+        return;
+    }
+
+    while (open) {
+        bytes = ce_read(fd, conn->buf + conn->len, conn->cap - conn->len);
+        if (bytes <= 0) {
+            break;
+        }
+        conn->len += bytes;
+
+        // pipelined requests are answered by a single writev
+        open = handle_requests(conn);
+        if (conn->pending > 0 && flush_responses(conn) != CE_SUCCESS) {
+            break;
+        }
+        // ce_task_alloc memory of the handlers was written out
+        ce_task_arena_reset();
+        if (open && prepare_buffer(conn) != CE_SUCCESS) {
+            break;
+        }
+    }
+
+    flush_responses(conn);
+    free(conn->buf);
+    free(conn);
+    ce_close(fd);
+}
+
+int ce_http_serve(int listen_fd, ce_http_handler handler, void *arg,
+                  int max_conns)
+{
+    http_server *server;
+    int ret;
+
+    if (handler == NULL) {
+        CE_LOG_ERROR("HTTP handler is required");
+        return CE_FAILURE;
+    }
+    // shared with the connection tasks, the stack of this one is copied
+    server = (http_server *)malloc(sizeof(http_server));
+    if (server == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for HTTP server");
+        return CE_FAILURE;
+    }
+    server->handler = handler;
+    server->arg = arg;
+
+    // returns once the connection tasks are done with the server
+    ret = ce_serve(listen_fd, serve_http, server, max_conns);
+    free(server);
+
+    return ret;
+}
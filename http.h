@@ -0,0 +1,53 @@
+#ifndef _COEVT_HTTP_H_
+#define _COEVT_HTTP_H_
+
+#include <stddef.h>
+
+#define CE_HTTP_MAX_HEADERS 32
+#define CE_HTTP_MAX_PIPELINE 16       // responses written by one writev
+#define CE_HTTP_MAX_REQUEST (1 << 20) // header and body of one request
+
+typedef struct ce_http_header {
+    const char *name;
+    int name_len;
+    const char *value;
+    int value_len;
+} ce_http_header;
+
+/*
+  points into the read buffer of the connection,
+  only valid while the handler runs
+*/
+typedef struct ce_http_request {
+    const char *method;
+    int method_len;
+    const char *path;
+    int path_len;
+    int minor_version;
+    ce_http_header headers[CE_HTTP_MAX_HEADERS];
+    int header_cnt;
+    const char *body;
+    size_t body_len;
+    int keep_alive;
+} ce_http_request;
+
+typedef struct ce_http_response {
+    int status;
+    const char *content_type;
+    const char *headers;  // extra "Name: value\r\n" lines, may be NULL
+    const void *body;
+    size_t body_len;
+    int free_body;        // free() the body once it is written,
+                          // ce_task_alloc bodies need neither
+} ce_http_response;
+
+// called in the task of the connection, may block on other IO
+typedef void (*ce_http_handler)(ce_http_request *req,
+                                ce_http_response *resp, void *arg);
+
+const char *ce_http_header_get(ce_http_request *req, const char *name,
+                               int *value_len);
+int ce_http_serve(int listen_fd, ce_http_handler handler, void *arg,
+                  int max_conns);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include "coevt.h"
+#include "http.h"
+#include "log.h"
+
+#define MAX_CONN_NUM 10000
+
+static const char hello[] = "Hello, World!";
+
+typedef struct fd_arg {
+    int fd;
+} fd_arg;
+
+void handle_request(ce_http_request *req, ce_http_response *resp, void *arg)
+{
+    if (req->path_len == 1 && req->path[0] == '/') {
+        resp->body = hello;
+        resp->body_len = sizeof(hello) - 1;
+        return;
+    }
+
+    resp->status = 404;
+    resp->body = "Not Found";
+    resp->body_len = strlen(resp->body);
+}
+
+void process_request(void *arg)
+{
+    fd_arg *p_arg = (fd_arg *)arg;
+
+    if (ce_http_serve(p_arg->fd, handle_request, NULL, MAX_CONN_NUM) != 0) {
+        CE_LOG_ERROR("Failed to serve HTTP on socket %d", p_arg->fd);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    int on = 1;
+    fd_arg fd_t = { sock_fd };
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind address for socket");
+        if (errno == EADDRINUSE) {
+            CE_LOG_ERROR("The port is already in use");
+        }
+        close(sock_fd);
+        return -1;
+    }
+    if (listen(sock_fd, 1024) != 0) {
+        CE_LOG_ERROR("Failed to listen to port");
+        close(sock_fd);
+        return -1;
+    }
+
+    ce_task(process_request, &fd_t);
+    ce_run();
+
+    return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * load generator built on coevt: one coroutine per connection
+ * closed loop sends the next request as soon as the response arrives,
+ * open loop sends at a fixed rate and measures latency from the intended
+ * send time, so that a stalled server doesn't hide its own queueing delay
+ * the echo protocol is the one of echo_server, every response ends with
+ * '\0'; against a server without the terminator each request waits out
+ * the run and counts as an error
+ * -H speaks HTTP/1.1 keep-alive instead of the echo protocol, -P sends that
+ * many pipelined requests per round trip
+ * a response still missing LATE_MS after the run ends counts as an error
+ * */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "coevt.h"
+#include "stats.h"
+
+#define RESP_BUF_SIZE 4096
+#define LATE_MS 1000     // how long a response in flight at the end may take
+
+typedef struct loadgen_conf {
+    struct sockaddr_in addr;
+    int conns;
+    int req_size;
+    int duration;     // seconds
+    long rate;        // total requests per second, 0 for closed loop
+    int http;
+    int pipeline;     // requests per round trip in HTTP mode
+    char *req;
+} loadgen_conf;
+
+static loadgen_conf conf;
+static ce_hist latency;
+static unsigned long long start_ns;
+static unsigned long long end_ns;
+static unsigned long long late_ns;
+static long completed = 0;
+static long errors = 0;
+static int connected = 0;
+
+/*
+  a read that gives up LATE_MS after the end of the run, so that a server
+  that stalls or never finishes a response can't keep the generator
+  waiting, while one that is just answering the last request can finish
+*/
+static ssize_t read_until_end(int fd, void *buf, size_t count)
+{
+    unsigned long long now;
+    ssize_t bytes;
+    int ret;
+
+    while (1) {
+        bytes = read(fd, buf, count);
+        if (bytes >= 0) {
+            return bytes;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        now = ce_stats_now_ns();
+        if (now >= late_ns) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (ce_listen(fd, CE_READ) != CE_SUCCESS) {
+            return -1;
+        }
+        ret = ce_wait_timeout((int)((late_ns - now + 999999) / 1000000));
+        ce_unlisten(fd, CE_READ);
+        if (ret == CE_TIMEOUT) {
+            errno = ETIMEDOUT;
+        }
+        if (ret != CE_SUCCESS) {
+            return -1;
+        }
+    }
+}
+
+// echo_server terminates every response with '\0'
+static int read_response(int fd)
+{
+    char buf[RESP_BUF_SIZE];
+    ssize_t bytes;
+
+    while (1) {
+        bytes = read_until_end(fd, buf, sizeof(buf));
+        if (bytes <= 0) {
+            return -1;
+        }
+        if (memchr(buf, '\0', bytes) != NULL) {
+            return 0;
+        }
+    }
+}
+
+static long content_length(char *head, char *head_end)
+{
+    char saved = *head_end;
+    char *field;
+    long len = 0;
+
+    *head_end = '\0';
+    field = strcasestr(head, "\r\nContent-Length:");
+    if (field != NULL) {
+        len = atol(field + strlen("\r\nContent-Length:"));
+    }
+    *head_end = saved;
+
+    return len;
+}
+
+static int read_http_responses(int fd, int count)
+{
+    char buf[RESP_BUF_SIZE];
+    size_t len = 0;
+    size_t need;
+    ssize_t bytes;
+    char *head_end;
+
+    while (count > 0) {
+        head_end = len > 0 ? memmem(buf, len, "\r\n\r\n", 4) : NULL;
+        if (head_end != NULL) {
+            need = head_end + 4 - buf + content_length(buf, head_end);
+            if (need > sizeof(buf)) {
+                return -1;
+            }
+            if (len >= need) {
+                memmove(buf, buf + need, len - need);
+                len -= need;
+                count--;
+                continue;
+            }
+        } else if (len == sizeof(buf)) {
+            return -1;
+        }
+
+        bytes = read_until_end(fd, buf + len, sizeof(buf) - len);
+        if (bytes <= 0) {
+            return -1;
+        }
+        len += bytes;
+    }
+
+    return 0;
+}
+
+static int send_request(int fd)
+{
+    int sent = 0;
+    ssize_t bytes;
+
+    while (sent < conf.req_size) {
+        bytes = ce_write(fd, conf.req + sent, conf.req_size - sent);
+        if (bytes <= 0) {
+            return -1;
+        }
+        sent += bytes;
+    }
+
+    return 0;
+}
+
+static void run_conn(void *arg)
+{
+    long conn_idx = (long)arg;
+    unsigned long long interval = 0;
+    unsigned long long intended = 0;
+    unsigned long long now;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || ce_connect(fd, (struct sockaddr *)&conf.addr,
+                               sizeof(conf.addr), 3000) != 0) {
+        printf("ERROR: Failed to connect, %s\n", strerror(errno));
+        errors++;
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    connected++;
+
+    if (conf.rate > 0) {
+        // spread the connections evenly over one interval
+        interval = 1000000000ULL * conf.conns / conf.rate;
+        intended = start_ns + interval * conn_idx / conf.conns;
+    }
+
+    while ((now = ce_stats_now_ns()) < end_ns) {
+        if (conf.rate > 0) {
+            if (intended >= end_ns) {
+                break;
+            }
+            if (now < intended) {
+                ce_sleep((int)((intended - now) / 1000000));
+                continue;
+            }
+        } else {
+            intended = now;
+        }
+
+        if (send_request(fd) != 0
+            || (conf.http ? read_http_responses(fd, conf.pipeline)
+                          : read_response(fd)) != 0) {
+            errors++;
+            break;
+        }
+        // pipelined requests share the latency of their round trip
+        ce_hist_record(&latency, ce_stats_now_ns() - intended);
+        completed += conf.http ? conf.pipeline : 1;
+        intended += interval;
+    }
+
+    close(fd);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-a addr] [-p port] [-c conns] [-s req_size]"
+           " [-d seconds] [-r total_rate] [-H] [-P pipeline]\n", prog);
+    printf("  -r 0 (default) runs closed loop, otherwise open loop at the rate\n");
+    printf("  echo requests expect echo_server responses, ended by '\\0'\n");
+    printf("  -H sends HTTP/1.1 GET / instead of echo requests,"
+           " -P requests at once\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    int port = 3000;
+    double elapsed;
+    long i;
+    int opt;
+
+    conf.conns = 100;
+    conf.req_size = 64;
+    conf.duration = 10;
+    conf.rate = 0;
+    conf.http = FALSE;
+    conf.pipeline = 1;
+    while ((opt = getopt(argc, argv, "a:p:c:s:d:r:HP:")) != -1) {
+        switch (opt) {
+        case 'a': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': conf.conns = atoi(optarg); break;
+        case 's': conf.req_size = atoi(optarg); break;
+        case 'd': conf.duration = atoi(optarg); break;
+        case 'r': conf.rate = atol(optarg); break;
+        case 'H': conf.http = TRUE; break;
+        case 'P': conf.pipeline = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    // echo_server reads at most 1023 bytes at once and answers every read
+    if (conf.conns <= 0 || conf.req_size <= 0 || conf.req_size > 1023
+        || conf.duration <= 0 || conf.rate < 0 || conf.pipeline <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    memset(&conf.addr, 0, sizeof(conf.addr));
+    conf.addr.sin_family = AF_INET;
+    conf.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &conf.addr.sin_addr) != 1) {
+        printf("ERROR: Invalid address %s\n", host);
+        return -1;
+    }
+    if (conf.http) {
+        conf.req_size = snprintf(NULL, 0, "GET / HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                 host);
+        conf.req_size *= conf.pipeline;
+    }
+    conf.req = (char *)malloc(conf.req_size + 1);
+    if (conf.req == NULL) {
+        printf("ERROR: Failed to allocate space for request\n");
+        return -1;
+    }
+    if (conf.http) {
+        for (i = 0; i < conf.pipeline; i++) {
+            sprintf(conf.req + i * (conf.req_size / conf.pipeline),
+                    "GET / HTTP/1.1\r\nHost: %s\r\n\r\n", host);
+        }
+    } else {
+        memset(conf.req, 'x', conf.req_size);
+    }
+
+    start_ns = ce_stats_now_ns();
+    end_ns = start_ns + conf.duration * 1000000000ULL;
+    late_ns = end_ns + LATE_MS * 1000000ULL;
+    for (i = 0; i < conf.conns; i++) {
+        ce_task(run_conn, (void *)i);
+    }
+    ce_run();
+
+    elapsed = (ce_stats_now_ns() - start_ns) / 1e9;
+    printf("{\"mode\":\"%s\",\"conns\":%d,\"connected\":%d,\"req_size\":%d,"
+           "\"requests\":%ld,\"errors\":%ld,\"rps\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           conf.http ? (conf.rate > 0 ? "http_open" : "http_closed")
+                     : (conf.rate > 0 ? "open" : "closed"), conf.conns, connected,
+           conf.req_size, completed, errors, completed / elapsed,
+           ce_hist_percentile(&latency, 50.0) / 1e3,
+           ce_hist_percentile(&latency, 99.0) / 1e3,
+           ce_hist_percentile(&latency, 99.9) / 1e3,
+           latency.max / 1e3);
+    free(conf.req);
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "defs.h"
+#include "log.h"
+
+#define WRITE_BATCH 64
+
+/*
+  a slot of the ring, seq tells whose turn it is: the producer at
+  position pos owns it while seq == pos, the writer once seq == pos + 1
+*/
+typedef struct ce_log_rec {
+    unsigned long seq;
+    int len;
+    char msg[CE_LOG_MSG_SIZE];
+} ce_log_rec;
+
+/*
+  one log ring in the process, filled by any thread without locks and
+  drained by one writer thread, so logging never blocks the run loop;
+  when the ring is full the message is dropped and counted instead
+*/
+static ce_log_rec ring[CE_LOG_RING_SIZE];
+static unsigned long enq_pos = 0;
+static unsigned long deq_pos = 0;
+static unsigned long dropped = 0;
+static int log_level = CE_LOG_MIN_LEVEL;
+static int log_fd = STDOUT_FILENO;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_t writer_thread;
+static int writer_started = FALSE;
+// the writer thread and ce_log_flush take turns to drain
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// writes out what is in the ring, returns the number of messages
+static int drain()
+{
+    struct iovec iov[WRITE_BATCH];
+    ce_log_rec *rec;
+    unsigned long pos;
+    int cnt = 0;
+    int total = 0;
+    int i;
+
+    pthread_mutex_lock(&drain_lock);
+    do {
+        pos = deq_pos;
+        for (cnt = 0; cnt < WRITE_BATCH; cnt++) {
+            rec = &ring[(pos + cnt) & (CE_LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + cnt + 1) {
+                break;
+            }
+            iov[cnt].iov_base = rec->msg;
+            iov[cnt].iov_len = rec->len;
+        }
+        if (cnt > 0 && writev(log_fd, iov, cnt) < 0) {
+            // nowhere to write, the messages are lost either way
+        }
+        // hand the slots back to producers one lap later
+        for (i = 0; i < cnt; i++) {
+            rec = &ring[(pos + i) & (CE_LOG_RING_SIZE - 1)];
+            __atomic_store_n(&rec->seq, pos + i + CE_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        }
+        deq_pos = pos + cnt;
+        total += cnt;
+    } while (cnt == WRITE_BATCH);
+    pthread_mutex_unlock(&drain_lock);
+
+    return total;
+}
+
+static void *write_logs(void *arg)
+{
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = CE_LOG_FLUSH_MS * 1000000L;
+    while (TRUE) {
+        if (drain() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static void start_writer()
+{
+    unsigned long i;
+
+    for (i = 0; i < CE_LOG_RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    if (pthread_create(&writer_thread, NULL, write_logs, NULL) == 0) {
+        pthread_detach(writer_thread);
+        writer_started = TRUE;
+    }
+}
+
+void ce_log(int level, const char *fmt, ...)
+{
+    ce_log_rec *rec;
+    unsigned long pos, seq;
+    va_list args;
+    int len;
+
+    if (level < log_level || level < 0 || level >= CE_LOG_LEVEL_OFF) {
+        return;
+    }
+    pthread_once(&start_once, start_writer);
+    if (!writer_started) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // claim a slot, or give up at once if the writer is a lap behind
+    pos = __atomic_load_n(&enq_pos, __ATOMIC_RELAXED);
+    while (TRUE) {
+        rec = &ring[pos & (CE_LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&enq_pos, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((long)(seq - pos) < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    len = snprintf(rec->msg, CE_LOG_MSG_SIZE, "%s: ", level_names[level]);
+    va_start(args, fmt);
+    len += vsnprintf(rec->msg + len, CE_LOG_MSG_SIZE - len, fmt, args);
+    va_end(args);
+    if (len > CE_LOG_MSG_SIZE - 2) {
+        len = CE_LOG_MSG_SIZE - 2;
+    }
+    rec->msg[len++] = '\n';
+    rec->len = len;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+int ce_log_set_level(int level)
+{
+    if (level < CE_LOG_LEVEL_DEBUG || level > CE_LOG_LEVEL_OFF) {
+        return CE_FAILURE;
+    }
+    log_level = level;
+
+    return CE_SUCCESS;
+}
+
+int ce_log_set_fd(int fd)
+{
+    if (fd < 0) {
+        return CE_FAILURE;
+    }
+    log_fd = fd;
+
+    return CE_SUCCESS;
+}
+
+// writes pending messages on the calling thread, may block on log_fd
+void ce_log_flush()
+{
+    if (writer_started) {
+        drain();
+    }
+}
+
+unsigned long ce_log_dropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// after the atexit handlers, which may still log
+__attribute__((destructor))
+static void flush_at_exit()
+{
+    ce_log_flush();
+}
@@ -0,0 +1,50 @@
+#ifndef _COEVT_LOG_H_
+#define _COEVT_LOG_H_
+
+#define CE_LOG_LEVEL_DEBUG 0
+#define CE_LOG_LEVEL_INFO 1
+#define CE_LOG_LEVEL_WARN 2
+#define CE_LOG_LEVEL_ERROR 3
+#define CE_LOG_LEVEL_OFF 4
+
+// levels below it are compiled out, e.g. -DCE_LOG_MIN_LEVEL=2
+#ifndef CE_LOG_MIN_LEVEL
+#define CE_LOG_MIN_LEVEL CE_LOG_LEVEL_INFO
+#endif
+
+#define CE_LOG_MSG_SIZE 256    // longer messages are truncated
+#define CE_LOG_RING_SIZE 4096  // pending messages, must be a power of 2
+#define CE_LOG_FLUSH_MS 10     // how often the writer looks at an empty ring
+
+void ce_log(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int ce_log_set_level(int level);
+int ce_log_set_fd(int fd);
+void ce_log_flush();
+unsigned long ce_log_dropped();
+
+#if CE_LOG_MIN_LEVEL <= CE_LOG_LEVEL_DEBUG
+#define CE_LOG_DEBUG(...) ce_log(CE_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define CE_LOG_DEBUG(...) ((void)0)
+#endif
+
+#if CE_LOG_MIN_LEVEL <= CE_LOG_LEVEL_INFO
+#define CE_LOG_INFO(...) ce_log(CE_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define CE_LOG_INFO(...) ((void)0)
+#endif
+
+#if CE_LOG_MIN_LEVEL <= CE_LOG_LEVEL_WARN
+#define CE_LOG_WARN(...) ce_log(CE_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define CE_LOG_WARN(...) ((void)0)
+#endif
+
+#if CE_LOG_MIN_LEVEL <= CE_LOG_LEVEL_ERROR
+#define CE_LOG_ERROR(...) ce_log(CE_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define CE_LOG_ERROR(...) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "defs.h"
+#include "log.h"
+#include "poller.h"
+#include "stats.h"
+#include "coevt.h"
+#include "migrate.h"
+
+#define CE_MSG_LOAD 1
+#define CE_MSG_CONN 2
+
+typedef struct ce_migrate_msg {
+    int type;
+    int from;
+    int load;
+    int len;                            // of the state
+    char state[CE_MIGRATE_STATE_SIZE];
+} ce_migrate_msg;
+
+#define MSG_HEADER offsetof(ce_migrate_msg, state)
+
+typedef struct ce_peer {
+    struct sockaddr_un addr;
+    int load;
+    unsigned long long seen_ms;         // 0 until the first report
+} ce_peer;
+
+/*
+  one migration endpoint for the unique scheduler in the process,
+  the other workers are processes of their own
+*/
+static int sock_fd = -1;
+static int self_id;
+static int peer_cnt;
+static ce_peer peers[CE_MIGRATE_MAX_WORKERS];
+static int running = FALSE;
+static int interval = CE_MIGRATE_INTERVAL;
+static int imbalance = CE_MIGRATE_IMBALANCE;
+static int batch = CE_MIGRATE_BATCH;
+static ce_migrate_export export_func;
+static ce_migrate_adopt adopt_func;
+static ce_migrate_load load_func;
+static void *user_arg;
+static unsigned long moved_out = 0;
+static unsigned long moved_in = 0;
+// reports sent before a move are stale, no moves until fresh ones are in
+static unsigned long long quiet_until_ms = 0;
+
+// static, so that a message is never on the stack of a parked task
+static ce_migrate_msg out_msg;
+static ce_migrate_msg in_msg;
+
+static unsigned long long now_ms()
+{
+    return ce_stats_now_ns() / 1000000ULL;
+}
+
+static int sock_path(struct sockaddr_un *addr, const char *dir, int id)
+{
+    int len;
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+                   "%s/coevt-%d.sock", dir, id);
+    if (len < 0 || len >= (int)sizeof(addr->sun_path)) {
+        CE_LOG_ERROR("Migration socket path in %s is too long", dir);
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+static int current_load()
+{
+    if (load_func != NULL) {
+        return load_func(user_arg);
+    }
+    // the migration socket itself is parked in the poller too
+    return ce_poller_handler_cnt() - 1;
+}
+
+static int send_msg(int to, int len, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &out_msg;
+    iov.iov_len = MSG_HEADER + len;
+    msg.msg_name = &peers[to].addr;
+    msg.msg_namelen = sizeof(struct sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // a peer that is down or congested just misses this one
+    if (sendmsg(sock_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        return CE_FAILURE;
+    }
+    return CE_SUCCESS;
+}
+
+static void report(int load)
+{
+    int i;
+
+    out_msg.type = CE_MSG_LOAD;
+    out_msg.from = self_id;
+    out_msg.load = load;
+    out_msg.len = 0;
+    for (i = 0; i < peer_cnt; i++) {
+        if (i != self_id) {
+            send_msg(i, 0, -1);
+        }
+    }
+}
+
+// the lightest peer heard from lately, -1 if none
+static int lightest_peer()
+{
+    unsigned long long now = now_ms();
+    int target = -1;
+    int i;
+
+    for (i = 0; i < peer_cnt; i++) {
+        if (i == self_id || peers[i].seen_ms == 0
+            || now - peers[i].seen_ms > (unsigned long long)interval * 3) {
+            continue;
+        }
+        if (target < 0 || peers[i].load < peers[target].load) {
+            target = i;
+        }
+    }
+
+    return target;
+}
+
+static void rebalance(int load)
+{
+    void *conn_arg;
+    int target = lightest_peer();
+    int len;
+    int cnt;
+    int fd;
+
+    if (now_ms() < quiet_until_ms
+        || target < 0 || load - peers[target].load <= imbalance) {
+        return;
+    }
+    // half the difference evens both out
+    cnt = (load - peers[target].load) / 2;
+    if (cnt > batch) {
+        cnt = batch;
+    }
+
+    fd = -1;
+    while (cnt > 0 && (fd = ce_poller_next_idle(fd + 1, &conn_arg)) >= 0) {
+        if (fd == sock_fd) {
+            continue;
+        }
+        // nothing runs in between, so the fd is still idle when it is dropped
+        len = export_func(fd, conn_arg, out_msg.state, CE_MIGRATE_STATE_SIZE,
+                          user_arg);
+        if (len < 0 || len > CE_MIGRATE_STATE_SIZE) {
+            continue;
+        }
+        ce_poller_forget(fd);
+        out_msg.type = CE_MSG_CONN;
+        out_msg.from = self_id;
+        out_msg.load = load;
+        out_msg.len = len;
+        if (send_msg(target, len, fd) != CE_SUCCESS) {
+            CE_LOG_WARN("Failed to hand fd %d to worker %d", fd, target);
+            if (adopt_func(fd, out_msg.state, len, user_arg) != CE_SUCCESS) {
+                close(fd);
+            }
+            break;
+        }
+        // the peer holds its own reference to the connection now
+        close(fd);
+        moved_out++;
+        quiet_until_ms = now_ms() + interval * 2;
+        load--;
+        peers[target].load++;
+        cnt--;
+    }
+}
+
+static int recv_msgs(int fd, void *arg)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t bytes;
+    int conn_fd;
+
+    while (running) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &in_msg;
+        iov.iov_len = sizeof(in_msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        bytes = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                CE_LOG_ERROR("Failed to receive from migration socket");
+            }
+            // parked again until the next message
+            return CE_SUCCESS;
+        }
+
+        conn_fd = -1;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&conn_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        if (bytes < (ssize_t)MSG_HEADER || in_msg.from < 0
+            || in_msg.from >= peer_cnt || in_msg.len < 0
+            || bytes < (ssize_t)MSG_HEADER + in_msg.len) {
+            CE_LOG_WARN("Dropped a malformed migration message");
+            if (conn_fd >= 0) {
+                close(conn_fd);
+            }
+            continue;
+        }
+
+        peers[in_msg.from].load = in_msg.load;
+        peers[in_msg.from].seen_ms = now_ms();
+        if (in_msg.type != CE_MSG_CONN || conn_fd < 0) {
+            if (conn_fd >= 0) {
+                close(conn_fd);
+            }
+            continue;
+        }
+        if (adopt_func(conn_fd, in_msg.state, in_msg.len, user_arg)
+            != CE_SUCCESS) {
+            CE_LOG_ERROR("Failed to adopt fd %d from worker %d",
+                         conn_fd, in_msg.from);
+            close(conn_fd);
+            continue;
+        }
+        moved_in++;
+        quiet_until_ms = now_ms() + interval * 2;
+    }
+
+    return CE_SUCCESS;
+}
+
+static void migrate_task(void *arg)
+{
+    int load;
+
+    while (running) {
+        load = current_load();
+        report(load);
+        rebalance(load);
+        ce_sleep(interval);
+    }
+}
+
+int ce_migrate_start(const char *dir, int worker_id, int worker_cnt,
+                     ce_migrate_export export_cb, ce_migrate_adopt adopt_cb,
+                     void *arg)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    if (running) {
+        CE_LOG_ERROR("Migration is started already");
+        return CE_FAILURE;
+    }
+    if (dir == NULL || export_cb == NULL || adopt_cb == NULL
+        || worker_cnt <= 0 || worker_cnt > CE_MIGRATE_MAX_WORKERS
+        || worker_id < 0 || worker_id >= worker_cnt) {
+        return CE_FAILURE;
+    }
+    memset(peers, 0, sizeof(peers));
+    for (i = 0; i < worker_cnt; i++) {
+        if (sock_path(&peers[i].addr, dir, i) != CE_SUCCESS) {
+            return CE_FAILURE;
+        }
+    }
+    self_id = worker_id;
+    peer_cnt = worker_cnt;
+    export_func = export_cb;
+    adopt_func = adopt_cb;
+    user_arg = arg;
+
+    sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        CE_LOG_ERROR("Failed to create migration socket");
+        return CE_FAILURE;
+    }
+    // left over by an earlier run of this worker
+    addr = peers[self_id].addr;
+    unlink(addr.sun_path);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind migration socket %s", addr.sun_path);
+        close(sock_fd);
+        sock_fd = -1;
+        return CE_FAILURE;
+    }
+
+    running = TRUE;
+    if (ce_on_readable(sock_fd, recv_msgs, NULL) != CE_SUCCESS
+        || ce_task(migrate_task, NULL) != CE_SUCCESS) {
+        ce_migrate_stop();
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+int ce_migrate_set_load(ce_migrate_load load_cb)
+{
+    load_func = load_cb;
+
+    return CE_SUCCESS;
+}
+
+int ce_migrate_set_policy(int interval_ms, int imbalance_load, int max_batch)
+{
+    if (interval_ms <= 0 || imbalance_load < 0 || max_batch <= 0) {
+        return CE_FAILURE;
+    }
+    interval = interval_ms;
+    imbalance = imbalance_load;
+    batch = max_batch;
+
+    return CE_SUCCESS;
+}
+
+// the last load reported by the worker, -1 if it has not been heard from
+int ce_migrate_peer_load(int worker_id)
+{
+    if (worker_id < 0 || worker_id >= peer_cnt || peers[worker_id].seen_ms == 0) {
+        return -1;
+    }
+
+    return peers[worker_id].load;
+}
+
+unsigned long ce_migrate_moved_out()
+{
+    return moved_out;
+}
+
+unsigned long ce_migrate_moved_in()
+{
+    return moved_in;
+}
+
+// connections moved already stay where they are
+void ce_migrate_stop()
+{
+    if (sock_fd < 0) {
+        return;
+    }
+    running = FALSE;
+    ce_close(sock_fd);
+    unlink(peers[self_id].addr.sun_path);
+    sock_fd = -1;
+}
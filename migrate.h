@@ -0,0 +1,44 @@
+#ifndef _COEVT_MIGRATE_H_
+#define _COEVT_MIGRATE_H_
+
+#include <stddef.h>
+
+#define CE_MIGRATE_MAX_WORKERS 64
+#define CE_MIGRATE_STATE_SIZE 4096 // state sent along with a connection
+#define CE_MIGRATE_INTERVAL 100    // ms between load reports
+#define CE_MIGRATE_IMBALANCE 16    // load above the lightest peer to move at
+#define CE_MIGRATE_BATCH 32        // connections moved per interval at most
+
+/*
+  called for a connection parked with ce_on_readable that was chosen to
+  leave, with the arg it was registered with; fills state and returns its
+  length, or CE_FAILURE to keep it (listening sockets, say); once it
+  returns a length the fd is dropped from the poller and the connection
+  is the peer's, so conn_arg can be freed
+*/
+typedef int (*ce_migrate_export)(int fd, void *conn_arg,
+                                 void *state, size_t cap, void *arg);
+
+/*
+  called in a task for a connection arriving from a peer, or coming back
+  when it could not be sent; registers it again, usually with
+  ce_on_readable, the fd is closed if it fails
+*/
+typedef int (*ce_migrate_adopt)(int fd, const void *state, size_t len,
+                                void *arg);
+
+// the load reported to peers, connections parked in the poller by default
+typedef int (*ce_migrate_load)(void *arg);
+
+// workers 0 .. worker_cnt-1 bind "<dir>/coevt-<id>.sock"
+int ce_migrate_start(const char *dir, int worker_id, int worker_cnt,
+                     ce_migrate_export export_cb, ce_migrate_adopt adopt_cb,
+                     void *arg);
+int ce_migrate_set_load(ce_migrate_load load_cb);
+int ce_migrate_set_policy(int interval_ms, int imbalance, int batch);
+int ce_migrate_peer_load(int worker_id);
+unsigned long ce_migrate_moved_out();
+unsigned long ce_migrate_moved_in();
+void ce_migrate_stop();
+
+#endif
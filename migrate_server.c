@@ -0,0 +1,186 @@
+/*
+ * echo server in several worker processes where only worker 0 accepts,
+ * the others get their connections by migration; every response ends
+ * with '\0', so ce_loadgen can drive it, and each worker logs its load
+ * and the connections it moved once a second
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "coevt.h"
+#include "log.h"
+#include "poller.h"
+#include "migrate.h"
+
+#define READ_BUF_SIZE 1024
+
+// what a connection takes along when it moves
+typedef struct conn_state {
+    unsigned long requests;
+} conn_state;
+
+static int worker_id = 0;
+static int listen_fd = -1;
+
+static int on_input(int fd, void *arg)
+{
+    conn_state *state = (conn_state *)arg;
+    char buf[READ_BUF_SIZE];
+    ssize_t bytes;
+
+    bytes = read(fd, buf, sizeof(buf) - 1);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return CE_SUCCESS;
+    }
+    if (bytes <= 0) {
+        free(state);
+        return CE_FAILURE;
+    }
+    state->requests++;
+    buf[bytes] = '\0';
+    if (ce_write(fd, buf, bytes + 1) != bytes + 1) {
+        free(state);
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+static int park(int fd, const conn_state *from)
+{
+    conn_state *state = (conn_state *)malloc(sizeof(conn_state));
+
+    if (state == NULL) {
+        return CE_FAILURE;
+    }
+    memcpy(state, from, sizeof(conn_state));
+    if (ce_on_readable(fd, on_input, state) != CE_SUCCESS) {
+        free(state);
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+static int export_conn(int fd, void *conn_arg, void *state, size_t cap,
+                       void *arg)
+{
+    if (fd == listen_fd || cap < sizeof(conn_state)) {
+        return CE_FAILURE;
+    }
+    memcpy(state, conn_arg, sizeof(conn_state));
+    free(conn_arg);
+
+    return sizeof(conn_state);
+}
+
+static int adopt_conn(int fd, const void *state, size_t len, void *arg)
+{
+    if (len != sizeof(conn_state)) {
+        return CE_FAILURE;
+    }
+
+    return park(fd, (const conn_state *)state);
+}
+
+static void accept_conns(void *arg)
+{
+    conn_state fresh;
+    int fd;
+
+    memset(&fresh, 0, sizeof(fresh));
+    while ((fd = ce_accept(listen_fd, NULL, NULL)) != CE_FAILURE) {
+        if (ce_set_nonblock(fd) != CE_SUCCESS || park(fd, &fresh) != CE_SUCCESS) {
+            close(fd);
+        }
+    }
+    CE_LOG_ERROR("Failed to accept connection on fd %d", listen_fd);
+}
+
+static void report(void *arg)
+{
+    while (1) {
+        ce_sleep(1000);
+        CE_LOG_INFO("worker %d: load %d, moved out %lu, moved in %lu",
+                    worker_id, ce_poller_handler_cnt() - 1,
+                    ce_migrate_moved_out(), ce_migrate_moved_in());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = "/tmp";
+    int workers = 2;
+    int port = 3005;
+    int on = 1;
+    struct sockaddr_in addr;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "w:p:d:")) != -1) {
+        switch (opt) {
+        case 'w': workers = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'd': dir = optarg; break;
+        default:
+            printf("Usage: %s [-w workers] [-p port] [-d socket_dir]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (workers <= 0 || workers > CE_MIGRATE_MAX_WORKERS) {
+        printf("Usage: %s [-w workers] [-p port] [-d socket_dir]\n", argv[0]);
+        return -1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CE_LOG_ERROR("Failed to bind address for socket");
+        if (errno == EADDRINUSE) {
+            CE_LOG_ERROR("The port is already in use");
+        }
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, 1024) != 0) {
+        CE_LOG_ERROR("Failed to listen to port");
+        close(listen_fd);
+        return -1;
+    }
+
+    // worker 0 is this process, the others go down with it
+    for (i = 1; i < workers; i++) {
+        if (fork() == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            worker_id = i;
+            close(listen_fd);
+            listen_fd = -1;
+            break;
+        }
+    }
+
+    if (ce_migrate_start(dir, worker_id, workers, export_conn, adopt_conn,
+                         NULL) != CE_SUCCESS) {
+        CE_LOG_ERROR("Failed to start migration of worker %d", worker_id);
+        return -1;
+    }
+    if (listen_fd >= 0) {
+        ce_task(accept_conns, NULL);
+    }
+    ce_task(report, NULL);
+    ce_run();
+
+    return 0;
+}
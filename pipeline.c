@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "defs.h"
+#include "log.h"
+#include "coevt.h"
+#include "channel.h"
+#include "stats.h"
+#include "pipeline.h"
+
+/*
+  end of stream travels through the queues as this address, one per worker
+  of the stage, the last worker of a stage to see it passes it on
+*/
+static char eos_mark;
+#define CE_PIPELINE_EOS ((void *)&eos_mark)
+
+typedef struct ce_stage {
+    const char *name;
+    ce_stage_func func;
+    void *arg;
+    int index;
+    int workers;
+    int active;
+    int depth;
+    int peak;
+    unsigned long long in;
+    unsigned long long out;
+    unsigned long long busy_ns;
+    ce_channel *queue;           // items waiting in front of the stage
+    struct ce_pipeline *pl;
+} ce_stage;
+
+struct ce_pipeline {
+    ce_stage *stages;
+    int stage_cnt;
+    int started;
+    int closed;
+    int failed;                  // start gave up after creating workers
+    int orphaned;                // destroyed before those workers returned
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+    ce_channel *done;            // receives one mark after the last stage
+};
+
+ce_pipeline *ce_pipeline_create()
+{
+    ce_pipeline *pl = (ce_pipeline *)malloc(sizeof(ce_pipeline));
+    if (pl == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_pipeline");
+        return NULL;
+    }
+    memset(pl, 0, sizeof(ce_pipeline));
+
+    return pl;
+}
+
+int ce_pipeline_add_stage(ce_pipeline *pl, const char *name,
+                          ce_stage_func func, void *arg,
+                          int workers, int queue_depth)
+{
+    ce_stage *stages;
+    ce_stage *stage;
+
+    if (pl == NULL || func == NULL) {
+        return CE_FAILURE;
+    }
+    if (pl->started) {
+        CE_LOG_ERROR("Stages can not be added to a running pipeline");
+        return CE_FAILURE;
+    }
+    stages = (ce_stage *)realloc(pl->stages,
+                                 sizeof(ce_stage) * (pl->stage_cnt + 1));
+    if (stages == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for stages of pipeline");
+        return CE_FAILURE;
+    }
+    pl->stages = stages;
+    stage = &stages[pl->stage_cnt];
+    memset(stage, 0, sizeof(ce_stage));
+    stage->name = name;
+    stage->func = func;
+    stage->arg = arg;
+    stage->index = pl->stage_cnt;
+    stage->workers = workers > 0 ? workers : 1;
+    stage->depth = queue_depth > 0 ? queue_depth : 0;
+
+    return pl->stage_cnt++;
+}
+
+static int push(ce_stage *stage, void *item)
+{
+    int len;
+
+    if (ce_chan_send(stage->queue, item) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+    len = ce_chan_len(stage->queue);
+    if (len > stage->peak) {
+        stage->peak = len;
+    }
+
+    return CE_SUCCESS;
+}
+
+// every worker in front of the stage is gone, none will send to it again
+static void end_stream(ce_pipeline *pl, int index)
+{
+    int i;
+
+    if (index == pl->stage_cnt) {
+        pl->end_ns = ce_stats_now_ns();
+        ce_chan_send(pl->done, CE_PIPELINE_EOS);
+        return;
+    }
+    for (i = 0; i < pl->stages[index].workers; i++) {
+        if (ce_chan_send(pl->stages[index].queue, CE_PIPELINE_EOS) != CE_SUCCESS) {
+            return;
+        }
+    }
+}
+
+static void free_pipeline(ce_pipeline *pl)
+{
+    int i;
+
+    for (i = 0; i < pl->stage_cnt; i++) {
+        ce_chan_destroy(&pl->stages[i].queue);
+    }
+    ce_chan_destroy(&pl->done);
+    free(pl->stages);
+    free(pl);
+}
+
+static int workers_left(ce_pipeline *pl)
+{
+    int cnt = 0;
+    int i;
+
+    for (i = 0; i < pl->stage_cnt; i++) {
+        cnt += pl->stages[i].active;
+    }
+    return cnt;
+}
+
+static void stage_worker(void *arg)
+{
+    ce_stage *stage = (ce_stage *)arg;
+    ce_pipeline *pl = stage->pl;
+    ce_stage *next = NULL;
+    unsigned long long start;
+    void *item;
+    void *ret;
+
+    if (pl->failed) {
+        // the last one out frees a pipeline its owner already gave up on
+        stage->active--;
+        if (pl->orphaned && workers_left(pl) == 0) {
+            free_pipeline(pl);
+        }
+        return;
+    }
+    if (stage->index + 1 < pl->stage_cnt) {
+        next = &pl->stages[stage->index + 1];
+    }
+    while (ce_chan_recv(stage->queue, &item) == CE_SUCCESS
+           && item != CE_PIPELINE_EOS) {
+        stage->in++;
+        start = ce_stats_now_ns();
+        ret = stage->func(item, stage->arg);
+        stage->busy_ns += ce_stats_now_ns() - start;
+        if (ret == NULL || next == NULL) {
+            continue;
+        }
+        if (push(next, ret) != CE_SUCCESS) {
+            break;
+        }
+        stage->out++;
+    }
+
+    if (--stage->active == 0) {
+        end_stream(pl, stage->index + 1);
+    }
+}
+
+int ce_pipeline_start(ce_pipeline *pl)
+{
+    ce_stage *stage;
+    int i, j;
+
+    if (pl == NULL || pl->started || pl->failed || pl->stage_cnt == 0) {
+        return CE_FAILURE;
+    }
+    pl->done = ce_chan_create(1);
+    if (pl->done == NULL) {
+        return CE_FAILURE;
+    }
+    for (i = 0; i < pl->stage_cnt; i++) {
+        pl->stages[i].pl = pl;
+        pl->stages[i].queue = ce_chan_create(pl->stages[i].depth);
+        if (pl->stages[i].queue == NULL) {
+            goto failed;
+        }
+    }
+
+    // workers only run once the caller pauses, so none misses a queue
+    for (i = 0; i < pl->stage_cnt; i++) {
+        stage = &pl->stages[i];
+        for (j = 0; j < stage->workers; j++) {
+            if (ce_task(stage_worker, stage) != CE_SUCCESS) {
+                CE_LOG_ERROR("Failed to create worker %d of stage %d", j, i);
+                break;
+            }
+            stage->active++;
+        }
+        if (stage->active == 0) {
+            goto failed;
+        }
+        // the failed ones would wait for marks nobody sends
+        stage->workers = stage->active;
+    }
+    pl->started = TRUE;
+    pl->start_ns = ce_stats_now_ns();
+
+    return CE_SUCCESS;
+
+failed:
+    // workers created so far hold pointers into the stages, they return
+    // as soon as they run and the pipeline lives until then
+    pl->failed = TRUE;
+    return CE_FAILURE;
+}
+
+int ce_pipeline_push(ce_pipeline *pl, void *item)
+{
+    if (pl == NULL || !pl->started || pl->closed
+        || item == NULL || item == CE_PIPELINE_EOS) {
+        return CE_FAILURE;
+    }
+
+    return push(&pl->stages[0], item);
+}
+
+// items pushed before keep flowing, wait for them with ce_pipeline_wait
+int ce_pipeline_close(ce_pipeline *pl)
+{
+    if (pl == NULL || !pl->started || pl->closed) {
+        return CE_FAILURE;
+    }
+    pl->closed = TRUE;
+    end_stream(pl, 0);
+
+    return CE_SUCCESS;
+}
+
+int ce_pipeline_wait(ce_pipeline *pl)
+{
+    void *mark;
+
+    if (pl == NULL || !pl->started) {
+        return CE_FAILURE;
+    }
+    if (ce_chan_recv(pl->done, &mark) != CE_SUCCESS) {
+        return CE_FAILURE;
+    }
+
+    // put the mark back for other waiters, the slot was just freed
+    return ce_chan_send(pl->done, mark);
+}
+
+int ce_pipeline_stage_cnt(ce_pipeline *pl)
+{
+    return pl == NULL ? 0 : pl->stage_cnt;
+}
+
+int ce_pipeline_stats(ce_pipeline *pl, int stage, ce_stage_stats *out)
+{
+    ce_stage *st;
+
+    if (pl == NULL || stage < 0 || stage >= pl->stage_cnt || out == NULL) {
+        return CE_FAILURE;
+    }
+    st = &pl->stages[stage];
+    out->name = st->name;
+    out->workers = st->workers;
+    out->active = st->active > 0 ? st->active : 0;
+    out->queue_cap = st->depth;
+    out->queue_len = ce_chan_len(st->queue);
+    out->queue_peak = st->peak;
+    out->in = st->in;
+    out->out = st->out;
+    out->busy_ns = st->busy_ns;
+
+    return CE_SUCCESS;
+}
+
+/*
+  util is the share of worker time spent in the stage function, the stage
+  near 100% with a full queue in front of it is the one to scale
+*/
+int ce_pipeline_dump(ce_pipeline *pl, FILE *fp)
+{
+    ce_stage_stats st;
+    unsigned long long elapsed;
+    double secs;
+    int i;
+
+    if (pl == NULL || fp == NULL || !pl->started) {
+        return CE_FAILURE;
+    }
+    elapsed = (pl->end_ns != 0 ? pl->end_ns : ce_stats_now_ns()) - pl->start_ns;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    secs = elapsed / 1e9;
+    fprintf(fp, "%-16s %7s %11s %6s %12s %12s %12s %6s\n", "stage", "workers",
+            "queue", "peak", "in", "out", "items/s", "util");
+    for (i = 0; i < pl->stage_cnt; i++) {
+        ce_pipeline_stats(pl, i, &st);
+        fprintf(fp, "%-16s %7d %5d/%-5d %6d %12llu %12llu %12.0f %5.1f%%\n",
+                st.name != NULL ? st.name : "-", st.workers, st.queue_len,
+                st.queue_cap, st.queue_peak, st.in, st.out, st.in / secs,
+                100.0 * st.busy_ns / ((double)elapsed * st.workers));
+    }
+
+    return CE_SUCCESS;
+}
+
+void ce_pipeline_destroy(ce_pipeline **pl_ptr)
+{
+    ce_pipeline *pl = *pl_ptr;
+    int i;
+
+    if (pl == NULL) {
+        return;
+    }
+    if (pl->failed && workers_left(pl) > 0) {
+        pl->orphaned = TRUE;
+        *pl_ptr = NULL;
+        return;
+    }
+    for (i = 0; i < pl->stage_cnt; i++) {
+        if (pl->stages[i].active > 0) {
+            CE_LOG_ERROR("Pipeline is destroyed while stage %d is running", i);
+            return;
+        }
+    }
+    free_pipeline(pl);
+    *pl_ptr = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef _COEVT_PIPELINE_H_
+#define _COEVT_PIPELINE_H_
+
+#include <stdio.h>
+
+typedef struct ce_pipeline ce_pipeline;
+
+/*
+  called in a worker task of the stage, may block on IO or channels,
+  the returned item goes to the next stage, NULL drops it;
+  what the last stage returns is discarded
+*/
+typedef void *(*ce_stage_func)(void *item, void *arg);
+
+typedef struct ce_stage_stats {
+    const char *name;
+    int workers;
+    int active;                  // workers that have not seen end of stream
+    int queue_cap;
+    int queue_len;               // items waiting in front of the stage
+    int queue_peak;
+    unsigned long long in;       // items taken by the workers
+    unsigned long long out;      // items passed to the next stage
+    unsigned long long busy_ns;  // time spent in the stage function
+} ce_stage_stats;
+
+ce_pipeline *ce_pipeline_create();
+int ce_pipeline_add_stage(ce_pipeline *pl, const char *name,
+                          ce_stage_func func, void *arg,
+                          int workers, int queue_depth);
+int ce_pipeline_start(ce_pipeline *pl);
+
+// within a task, block while the queue of the first stage is full
+int ce_pipeline_push(ce_pipeline *pl, void *item);
+int ce_pipeline_close(ce_pipeline *pl);
+int ce_pipeline_wait(ce_pipeline *pl);
+
+int ce_pipeline_stage_cnt(ce_pipeline *pl);
+int ce_pipeline_stats(ce_pipeline *pl, int stage, ce_stage_stats *out);
+int ce_pipeline_dump(ce_pipeline *pl, FILE *fp);
+void ce_pipeline_destroy(ce_pipeline **pl_ptr);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * pipeline benchmark: a producer pushes items through three stages,
+ * parse burns CPU, fetch waits like a call to another service and sink
+ * adds the results up; the per stage table of ce_pipeline_dump is printed
+ * first, then one JSON object with the totals
+ * -w sets the workers of fetch, the stage that needs them
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "coevt.h"
+#include "stats.h"
+#include "pipeline.h"
+
+static long items = 10000;
+static int fetch_workers = 64;
+static int queue_depth = 128;
+static int fetch_ms = 1;
+static int parse_rounds = 1000;
+
+static ce_pipeline *pl;
+static long sunk = 0;
+static unsigned long sum = 0;
+
+// items are numbers, 0 would read as a dropped item
+static void *parse(void *item, void *arg)
+{
+    unsigned long v = (unsigned long)item;
+    int i;
+
+    for (i = 0; i < parse_rounds; i++) {
+        v = v * 6364136223846793005UL + 1442695040888963407UL;
+    }
+    return (void *)((v >> 1) | 1);
+}
+
+static void *fetch(void *item, void *arg)
+{
+    ce_sleep(fetch_ms);
+    return item;
+}
+
+static void *sink(void *item, void *arg)
+{
+    sum += (unsigned long)item;
+    sunk++;
+    return NULL;
+}
+
+static void producer(void *arg)
+{
+    unsigned long long start = ce_stats_now_ns();
+    double secs;
+    long i;
+
+    for (i = 1; i <= items; i++) {
+        if (ce_pipeline_push(pl, (void *)i) != CE_SUCCESS) {
+            printf("ERROR: Failed to push item %ld\n", i);
+            break;
+        }
+    }
+    ce_pipeline_close(pl);
+    ce_pipeline_wait(pl);
+    secs = (ce_stats_now_ns() - start) / 1e9;
+
+    ce_pipeline_dump(pl, stdout);
+    printf("{\"bench\":\"pipeline\",\"items\":%ld,\"fetch_workers\":%d,"
+           "\"queue_depth\":%d,\"items_per_sec\":%.0f,\"checksum\":%lu}\n",
+           sunk, fetch_workers, queue_depth, sunk / secs, sum);
+    ce_pipeline_destroy(&pl);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:q:f:p:")) != -1) {
+        switch (opt) {
+        case 'n': items = atol(optarg); break;
+        case 'w': fetch_workers = atoi(optarg); break;
+        case 'q': queue_depth = atoi(optarg); break;
+        case 'f': fetch_ms = atoi(optarg); break;
+        case 'p': parse_rounds = atoi(optarg); break;
+        default:
+            printf("Usage: %s [-n items] [-w fetch_workers] [-q queue_depth]"
+                   " [-f fetch_ms] [-p parse_rounds]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    pl = ce_pipeline_create();
+    if (pl == NULL
+        || ce_pipeline_add_stage(pl, "parse", parse, NULL, 1, queue_depth) < 0
+        || ce_pipeline_add_stage(pl, "fetch", fetch, NULL, fetch_workers,
+                                 queue_depth) < 0
+        || ce_pipeline_add_stage(pl, "sink", sink, NULL, 1, queue_depth) < 0
+        || ce_pipeline_start(pl) != CE_SUCCESS) {
+        printf("ERROR: Failed to start pipeline\n");
+        return -1;
+    }
+    ce_task(producer, NULL);
+    ce_run();
+
+    return sunk == items ? 0 : -1;
+}
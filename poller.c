@@ -1,34 +1,303 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include "defs.h"
+#include "log.h"
 #include "coroutine.h"
+#include "stats.h"
+#include "trace.h"
 #include "poller.h"
 
+// a coroutine blocked on one direction of an fd
+typedef struct ce_waiter {
+    int crtn_id;
+    struct ce_waiter *next;
+} ce_waiter;
+
+// waiters in arrival order, so wake-one goes round robin
+typedef struct ce_wait_q {
+    ce_waiter *head;
+    ce_waiter *tail;
+    int size;
+} ce_wait_q;
+
 typedef struct ce_fd_assoc {
     int fd;
-    int rd_crtn;
-    int wt_crtn;
-    struct epoll_event rd_evt;
-    struct epoll_event wt_evt;
+    ce_wait_q rd_q;
+    ce_wait_q wt_q;
+    int wake_mode;        // CE_WAKE_ONE or CE_WAKE_ALL
+    unsigned int events;  // registered in epoll
+    int added;            // known to epoll
+    ce_fd_handler handler; // spawns a coroutine when readable
+    void *handler_arg;
+    int busy;             // the handler coroutine is running
+    struct ce_fd_cbs *cbs; // callback waiters, NULL unless used
 } ce_fd_assoc;
 
+// one shot callbacks of stackless waiters, instead of a blocked coroutine
+typedef struct ce_fd_cbs {
+    ce_poll_cb rd_cb;
+    void *rd_arg;
+    ce_poll_cb wt_cb;
+    void *wt_arg;
+} ce_fd_cbs;
+
+typedef struct ce_ready_cb {
+    int fd;
+    int event;
+    ce_poll_cb cb;
+    void *arg;
+} ce_ready_cb;
+
 /*
 static variables in the process
 use multiple processes in multicore arch
 */
-static ce_fd_assoc *fd_assoc_arr[MAX_FD_NUM] = { 0 };
+static ce_fd_assoc **fd_assoc_arr = NULL;
+static int fd_assoc_cap = 0;
 static int poller_fd = 0;
 static int ready_cnt = 0;
 static int polling_cnt = 0;
 static struct epoll_event *poll_results;
+static int handler_cnt = 0;
+// callbacks of the last poll, run once all results were reacted to
+static ce_ready_cb *ready_cbs = NULL;
+static int ready_cb_cnt = 0;
+static int ready_cb_cap = 0;
+// released waiters, reused before malloc
+static ce_waiter *free_waiters = NULL;
+
+static ce_waiter *alloc_waiter()
+{
+    ce_waiter *waiter = free_waiters;
+
+    if (waiter != NULL) {
+        free_waiters = waiter->next;
+        return waiter;
+    }
+    waiter = (ce_waiter *)malloc(sizeof(ce_waiter));
+    if (waiter == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for fd waiter");
+    }
+
+    return waiter;
+}
+
+static void release_waiter(ce_waiter *waiter)
+{
+    waiter->next = free_waiters;
+    free_waiters = waiter;
+}
+
+static void push_waiter(ce_wait_q *q, ce_waiter *waiter)
+{
+    waiter->next = NULL;
+    if (q->size == 0) {
+        q->head = q->tail = waiter;
+    } else {
+        q->tail->next = waiter;
+        q->tail = waiter;
+    }
+    q->size++;
+}
+
+// unlinks the waiter of crtn_id, NULL if it doesn't wait in q
+static ce_waiter *take_waiter(ce_wait_q *q, int crtn_id)
+{
+    ce_waiter *prev = NULL;
+    ce_waiter *waiter;
+
+    for (waiter = q->head; waiter != NULL; prev = waiter, waiter = waiter->next) {
+        if (waiter->crtn_id != crtn_id) {
+            continue;
+        }
+        if (prev == NULL) {
+            q->head = waiter->next;
+        } else {
+            prev->next = waiter->next;
+        }
+        if (q->tail == waiter) {
+            q->tail = prev;
+        }
+        q->size--;
+        return waiter;
+    }
+
+    return NULL;
+}
+
+/*
+  waiters stay queued until they remove themselves, so a woken one may
+  still be queued when the fd is reported again; in wake-one mode it is
+  left to consume the event instead of waking another one
+*/
+static int wake_waiters(ce_wait_q *q, int wake_mode)
+{
+    ce_waiter *waiter;
+
+    for (waiter = q->head; waiter != NULL; waiter = waiter->next) {
+        if (ce_get_coroutine_status(waiter->crtn_id) != CE_COROUTINE_BLOCKED) {
+            if (wake_mode == CE_WAKE_ONE) {
+                break;
+            }
+            continue;
+        }
+        if (ce_set_coroutine_status(waiter->crtn_id,
+                                    CE_COROUTINE_SUSPENDED) != CE_SUCCESS) {
+            CE_LOG_ERROR("Failed to wake coroutine %d", waiter->crtn_id);
+            return CE_FAILURE;
+        }
+        if (wake_mode == CE_WAKE_ONE) {
+            break;
+        }
+    }
+
+    return CE_SUCCESS;
+}
+
+static unsigned int event_mask(ce_fd_assoc *fd_assoc)
+{
+    unsigned int events = 0;
+
+    if (fd_assoc->rd_q.size > 0
+        || (fd_assoc->handler != NULL && !fd_assoc->busy)
+        || (fd_assoc->cbs != NULL && fd_assoc->cbs->rd_cb != NULL)) {
+        events |= EPOLLIN;
+    }
+    if (fd_assoc->wt_q.size > 0
+        || (fd_assoc->cbs != NULL && fd_assoc->cbs->wt_cb != NULL)) {
+        events |= EPOLLOUT;
+    }
+
+    return events;
+}
+
+static int in_use(ce_fd_assoc *fd_assoc)
+{
+    return fd_assoc->rd_q.size > 0 || fd_assoc->wt_q.size > 0
+        || fd_assoc->handler != NULL || fd_assoc->busy
+        || fd_assoc->cbs != NULL || fd_assoc->wake_mode != CE_WAKE_ONE;
+}
+
+// only talks to epoll when the mask really changes
+static int update_events(ce_fd_assoc *fd_assoc)
+{
+    struct epoll_event evt;
+    unsigned int events = event_mask(fd_assoc);
+
+    if (fd_assoc->added && events == fd_assoc->events) {
+        return CE_SUCCESS;
+    }
+    if (events == 0) {
+        // an empty mask would still report hangups and errors
+        if (fd_assoc->added
+            && epoll_ctl(poller_fd, EPOLL_CTL_DEL, fd_assoc->fd, NULL) != 0
+            && errno != EBADF && errno != ENOENT) {
+            CE_LOG_ERROR("Failed to delete event in epoll_ctl");
+            return CE_FAILURE;
+        }
+        fd_assoc->added = FALSE;
+        return CE_SUCCESS;
+    }
+    evt.events = events;
+    evt.data.ptr = fd_assoc;
+    if (epoll_ctl(poller_fd, fd_assoc->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd_assoc->fd, &evt) != 0) {
+        CE_LOG_ERROR("Failed to %s event in epoll_ctl",
+                     fd_assoc->added ? "modify" : "add");
+        return CE_FAILURE;
+    }
+    fd_assoc->events = events;
+    fd_assoc->added = TRUE;
+
+    return CE_SUCCESS;
+}
+
+static int enlarge_fd_assoc_arr(int fd)
+{
+    int new_cap = fd_assoc_cap > 0 ? fd_assoc_cap : MAX_FD_NUM;
+    ce_fd_assoc **new_arr;
+
+    while (new_cap <= fd) {
+        new_cap *= 2;
+    }
+    new_arr = (ce_fd_assoc **)realloc(fd_assoc_arr,
+                                      sizeof(ce_fd_assoc *) * new_cap);
+    if (new_arr == NULL) {
+        CE_LOG_ERROR("Failed to enlarge fd table of poller");
+        return CE_FAILURE;
+    }
+    memset(new_arr + fd_assoc_cap, 0,
+           sizeof(ce_fd_assoc *) * (new_cap - fd_assoc_cap));
+    fd_assoc_arr = new_arr;
+    fd_assoc_cap = new_cap;
+
+    return CE_SUCCESS;
+}
+
+static ce_fd_assoc *get_fd_assoc(int fd)
+{
+    ce_fd_assoc *fd_assoc;
+
+    if (fd < 0) {
+        CE_LOG_ERROR("Could not add invalid fd %d in polling", fd);
+        return NULL;
+    }
+    if (fd >= fd_assoc_cap && enlarge_fd_assoc_arr(fd) != CE_SUCCESS) {
+        return NULL;
+    }
+    if (fd_assoc_arr[fd] != NULL) {
+        return fd_assoc_arr[fd];
+    }
+
+    fd_assoc = (ce_fd_assoc *)malloc(sizeof(ce_fd_assoc));
+    if (fd_assoc == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for struct ce_fd_assoc");
+        return NULL;
+    }
+    memset(fd_assoc, 0, sizeof(ce_fd_assoc));
+    fd_assoc->fd = fd;
+    fd_assoc->wake_mode = CE_WAKE_ONE;
+    // added to epoll by the first update_events
+    fd_assoc_arr[fd] = fd_assoc;
+
+    return fd_assoc;
+}
+
+static int put_fd_assoc(ce_fd_assoc *fd_assoc)
+{
+    if (in_use(fd_assoc)) {
+        return update_events(fd_assoc);
+    }
+
+    // the fd may be closed already, which removed it from epoll
+    if (fd_assoc->added
+        && epoll_ctl(poller_fd, EPOLL_CTL_DEL, fd_assoc->fd, NULL) != 0
+        && errno != EBADF && errno != ENOENT) {
+        CE_LOG_ERROR("Failed to delete event in epoll_ctl");
+        return CE_FAILURE;
+    }
+    fd_assoc_arr[fd_assoc->fd] = NULL;
+    // safe to free, results of the last poll have been reacted to
+    free(fd_assoc);
+
+    return CE_SUCCESS;
+}
 
 int ce_poller_init(int max_fd)
 {
     poller_fd = epoll_create(max_fd);
     if (poller_fd == -1) {
-        printf("ERROR: Failed to initialize poller\n");
+        CE_LOG_ERROR("Failed to initialize poller");
+        return CE_FAILURE;
+    }
+
+    // the fd table starts with max_fd slots and grows on demand
+    if (fd_assoc_cap < max_fd && enlarge_fd_assoc_arr(max_fd - 1) != CE_SUCCESS) {
         return CE_FAILURE;
     }
 
@@ -44,133 +313,466 @@ int ce_poller_initialized()
     return TRUE;
 }
 
+int ce_poller_fd()
+{
+    return poller_fd;
+}
+
+/*
+  fd of the run loop itself, its readiness only makes epoll_wait return
+  (and the poller fd readable to a host loop), it is not reacted to
+*/
+int ce_poller_add_wakeup(int fd)
+{
+    struct epoll_event evt;
+
+    evt.events = EPOLLIN;
+    evt.data.ptr = NULL;
+    if (epoll_ctl(poller_fd, EPOLL_CTL_ADD, fd, &evt) != 0) {
+        CE_LOG_ERROR("Failed to add wakeup fd %d to poller", fd);
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+static ce_wait_q *wait_q(ce_fd_assoc *fd_assoc, int event)
+{
+    return event == CE_READ ? &fd_assoc->rd_q : &fd_assoc->wt_q;
+}
+
+static int waiting(ce_fd_assoc *fd_assoc, int event, int crtn_id)
+{
+    ce_waiter *waiter;
+
+    for (waiter = wait_q(fd_assoc, event)->head; waiter != NULL;
+         waiter = waiter->next) {
+        if (waiter->crtn_id == crtn_id) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// whether the current coroutine waits for the event on fd
 int ce_poller_lookup(int fd, int event)
 {
-    ce_fd_assoc *fd_assoc = fd_assoc_arr[fd];
+    ce_fd_assoc *fd_assoc;
+
+    if (fd < 0 || fd >= fd_assoc_cap) {
+        return CE_FAILURE;
+    }
+    fd_assoc = fd_assoc_arr[fd];
+    if (fd_assoc == NULL || (event != CE_READ && event != CE_WRITE)) {
+        return CE_FAILURE;
+    }
+
+    return waiting(fd_assoc, event, ce_cur_coroutine()) ? CE_SUCCESS : CE_FAILURE;
+}
+
+// number of coroutines waiting for the event on fd
+int ce_poller_waiters(int fd, int event)
+{
+    ce_fd_assoc *fd_assoc;
+
+    if (fd < 0 || fd >= fd_assoc_cap) {
+        return 0;
+    }
+    fd_assoc = fd_assoc_arr[fd];
+    if (fd_assoc == NULL || (event != CE_READ && event != CE_WRITE)) {
+        return 0;
+    }
+
+    return wait_q(fd_assoc, event)->size;
+}
+
+int ce_poller_add(int fd, int event)
+{
+    ce_fd_assoc *fd_assoc;
+    ce_waiter *waiter;
+
+    if (event != CE_READ && event != CE_WRITE) {
+        CE_LOG_ERROR("Invalid event %d to poll", event);
+        return CE_FAILURE;
+    }
+    fd_assoc = get_fd_assoc(fd);
     if (fd_assoc == NULL) {
         return CE_FAILURE;
     }
-    if (fd_assoc->rd_crtn != CE_DUMMY_COROUTINE_ID
-        && event == CE_READ) {
-        return CE_SUCCESS;
+    waiter = alloc_waiter();
+    if (waiter == NULL) {
+        put_fd_assoc(fd_assoc);
+        return CE_FAILURE;
+    }
+    waiter->crtn_id = ce_cur_coroutine();
+    push_waiter(wait_q(fd_assoc, event), waiter);
+    if (update_events(fd_assoc) != CE_SUCCESS) {
+        release_waiter(take_waiter(wait_q(fd_assoc, event), waiter->crtn_id));
+        put_fd_assoc(fd_assoc);
+        return CE_FAILURE;
+    }
+
+    polling_cnt++;
+    return CE_SUCCESS;
+}
+
+int ce_poller_remove(int fd, int event)
+{
+    ce_fd_assoc *fd_assoc = NULL;
+    ce_waiter *waiter = NULL;
+
+    if (fd >= 0 && fd < fd_assoc_cap) {
+        fd_assoc = fd_assoc_arr[fd];
+    }
+    if (fd_assoc != NULL && (event == CE_READ || event == CE_WRITE)) {
+        waiter = take_waiter(wait_q(fd_assoc, event), ce_cur_coroutine());
     }
-    if (fd_assoc->wt_crtn != CE_DUMMY_COROUTINE_ID
-        && event == CE_WRITE) {
+    if (waiter == NULL) {
+        CE_LOG_ERROR("event is not added in polling, could not remove");
+        return CE_FAILURE;
+    }
+    release_waiter(waiter);
+    polling_cnt--;
+
+    return put_fd_assoc(fd_assoc);
+}
+
+int ce_poller_set_wake_mode(int fd, int wake_mode)
+{
+    ce_fd_assoc *fd_assoc;
+
+    if (wake_mode != CE_WAKE_ONE && wake_mode != CE_WAKE_ALL) {
+        CE_LOG_ERROR("Invalid wake mode %d", wake_mode);
+        return CE_FAILURE;
+    }
+    if (wake_mode == CE_WAKE_ONE && (fd < 0 || fd >= fd_assoc_cap
+                                     || fd_assoc_arr[fd] == NULL)) {
+        // the default, nothing to keep
         return CE_SUCCESS;
     }
-    
-    return CE_FAILURE;
+    fd_assoc = get_fd_assoc(fd);
+    if (fd_assoc == NULL) {
+        return CE_FAILURE;
+    }
+    // a non default mode keeps the fd_assoc until it is reset
+    fd_assoc->wake_mode = wake_mode;
+
+    return put_fd_assoc(fd_assoc);
 }
 
-int ce_poller_add(int fd, int event)
+static void run_handler(void *arg)
 {
+    int fd = (int)(long)arg;
     ce_fd_assoc *fd_assoc = fd_assoc_arr[fd];
-    int need_add = FALSE;
-    int cur_crtn = ce_cur_coroutine();
-    struct epoll_event *evt = NULL;
+    ce_fd_handler handler;
 
-    if (fd_assoc == NULL) {
-        size_t size_in_bytes = sizeof(ce_fd_assoc);
-        fd_assoc = (ce_fd_assoc*)malloc(size_in_bytes);
-        if (fd_assoc == NULL) {
-            printf("ERROR: Failed to allocate space for struct ce_fd_assoc\n");
-            return CE_FAILURE;
+    if (fd_assoc == NULL || fd_assoc->handler == NULL) {
+        return;
+    }
+    handler = fd_assoc->handler;
+    if (handler(fd, fd_assoc->handler_arg) == CE_SUCCESS) {
+        // park again, unless the handler dropped the fd meanwhile
+        fd_assoc = fd < fd_assoc_cap ? fd_assoc_arr[fd] : NULL;
+        if (fd_assoc != NULL && fd_assoc->handler == handler
+            && fd_assoc->busy) {
+            fd_assoc->busy = FALSE;
+            update_events(fd_assoc);
         }
-        memset(fd_assoc, 0, size_in_bytes);
-        fd_assoc->fd = fd;
-        fd_assoc->rd_crtn = fd_assoc->wt_crtn = CE_DUMMY_COROUTINE_ID;
-        fd_assoc_arr[fd] = fd_assoc;
-        need_add = TRUE;
+        return;
     }
 
-    if (event == CE_READ) {
-        fd_assoc->rd_crtn = cur_crtn;
-        evt = &(fd_assoc->rd_evt);
-    } else if (event == CE_WRITE){
-        fd_assoc->wt_crtn = cur_crtn;
-        evt = &(fd_assoc->wt_evt);
-    }
-    evt->data.ptr = fd_assoc;
-    evt->events = (fd_assoc->rd_crtn != CE_DUMMY_COROUTINE_ID ? EPOLLIN : 0)
-                | (fd_assoc->wt_crtn != CE_DUMMY_COROUTINE_ID ? EPOLLOUT : 0);
-    if (need_add) {
-        if (epoll_ctl(poller_fd, EPOLL_CTL_ADD, fd, evt) != 0) {
-            printf("ERROR: Failed to add event in epoll_ctl\n");
-            return CE_FAILURE;
+    fd_assoc = fd < fd_assoc_cap ? fd_assoc_arr[fd] : NULL;
+    if (fd_assoc != NULL && fd_assoc->handler == handler && fd_assoc->busy) {
+        ce_poller_set_handler(fd, NULL, NULL);
+        close(fd);
+    }
+}
+
+int ce_poller_set_handler(int fd, ce_fd_handler handler, void *arg)
+{
+    ce_fd_assoc *fd_assoc = NULL;
+
+    if (handler == NULL) {
+        if (fd >= 0 && fd < fd_assoc_cap) {
+            fd_assoc = fd_assoc_arr[fd];
         }
-    } else {
-        if (epoll_ctl(poller_fd, EPOLL_CTL_MOD, fd, evt) != 0) {
-            printf("ERROR: Failed to modify to add event in epoll_ctl\n");
+        if (fd_assoc == NULL || fd_assoc->handler == NULL) {
             return CE_FAILURE;
         }
+        fd_assoc->handler = NULL;
+        fd_assoc->handler_arg = NULL;
+        fd_assoc->busy = FALSE;
+        polling_cnt--;
+        handler_cnt--;
+        return put_fd_assoc(fd_assoc);
+    }
+
+    fd_assoc = get_fd_assoc(fd);
+    if (fd_assoc == NULL) {
+        return CE_FAILURE;
+    }
+    if (fd_assoc->handler == NULL) {
+        polling_cnt++;
+        handler_cnt++;
+    }
+    fd_assoc->handler = handler;
+    fd_assoc->handler_arg = arg;
+    if (update_events(fd_assoc) != CE_SUCCESS) {
+        ce_poller_set_handler(fd, NULL, NULL);
+        return CE_FAILURE;
     }
 
-    polling_cnt++;
     return CE_SUCCESS;
 }
 
-int ce_poller_remove(int fd, int event)
+int ce_poller_handler_cnt()
 {
-    ce_fd_assoc *fd_assoc = fd_assoc_arr[fd];
-    int should_del = FALSE;
-    struct epoll_event *evt = NULL;
+    return handler_cnt;
+}
+
+// only an idle handler is registered, nothing in this process is on the fd
+static int idle_handler(ce_fd_assoc *fd_assoc)
+{
+    return fd_assoc->handler != NULL && !fd_assoc->busy
+        && fd_assoc->rd_q.size == 0 && fd_assoc->wt_q.size == 0
+        && fd_assoc->cbs == NULL;
+}
+
+// the first fd from `from` on parked with an idle handler, -1 if none
+int ce_poller_next_idle(int from, void **handler_arg)
+{
+    int fd;
 
+    for (fd = from > 0 ? from : 0; fd < fd_assoc_cap; fd++) {
+        if (fd_assoc_arr[fd] != NULL && idle_handler(fd_assoc_arr[fd])) {
+            if (handler_arg != NULL) {
+                *handler_arg = fd_assoc_arr[fd]->handler_arg;
+            }
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/*
+  drops an idle fd from epoll and the fd table without closing it,
+  before it is handed to another process
+*/
+int ce_poller_forget(int fd)
+{
+    ce_fd_assoc *fd_assoc = NULL;
+
+    if (fd >= 0 && fd < fd_assoc_cap) {
+        fd_assoc = fd_assoc_arr[fd];
+    }
+    if (fd_assoc == NULL || !idle_handler(fd_assoc)) {
+        return CE_FAILURE;
+    }
+    fd_assoc->handler = NULL;
+    fd_assoc->handler_arg = NULL;
+    fd_assoc->wake_mode = CE_WAKE_ONE;
+    polling_cnt--;
+    handler_cnt--;
+
+    return put_fd_assoc(fd_assoc);
+}
+
+int ce_poller_add_cb(int fd, int event, ce_poll_cb cb, void *arg)
+{
+    ce_fd_assoc *fd_assoc;
+
+    fd_assoc = get_fd_assoc(fd);
     if (fd_assoc == NULL) {
-        printf("ERROR: event is not added in polling, could not remove\n");
         return CE_FAILURE;
     }
+    if (fd_assoc->cbs == NULL) {
+        fd_assoc->cbs = (ce_fd_cbs *)calloc(1, sizeof(ce_fd_cbs));
+        if (fd_assoc->cbs == NULL) {
+            CE_LOG_ERROR("Failed to allocate space for fd callbacks");
+            put_fd_assoc(fd_assoc);
+            return CE_FAILURE;
+        }
+    }
 
     if (event == CE_READ) {
-        fd_assoc->rd_crtn = CE_DUMMY_COROUTINE_ID;
-        evt = &(fd_assoc->rd_evt);
+        if (fd_assoc->cbs->rd_cb == NULL) {
+            polling_cnt++;
+        }
+        fd_assoc->cbs->rd_cb = cb;
+        fd_assoc->cbs->rd_arg = arg;
     } else if (event == CE_WRITE) {
-        fd_assoc->wt_crtn = CE_DUMMY_COROUTINE_ID;
-        evt = &(fd_assoc->wt_evt);
+        if (fd_assoc->cbs->wt_cb == NULL) {
+            polling_cnt++;
+        }
+        fd_assoc->cbs->wt_cb = cb;
+        fd_assoc->cbs->wt_arg = arg;
+    }
+    if (update_events(fd_assoc) != CE_SUCCESS) {
+        ce_poller_remove_cb(fd, event);
+        return CE_FAILURE;
     }
 
-    if (fd_assoc->rd_crtn == CE_DUMMY_COROUTINE_ID
-        && fd_assoc->wt_crtn == CE_DUMMY_COROUTINE_ID) {
-        should_del = TRUE;
+    return CE_SUCCESS;
+}
+
+int ce_poller_remove_cb(int fd, int event)
+{
+    ce_fd_assoc *fd_assoc = NULL;
+    ce_fd_cbs *cbs;
+
+    if (fd >= 0 && fd < fd_assoc_cap) {
+        fd_assoc = fd_assoc_arr[fd];
     }
-    evt->events = (fd_assoc->rd_crtn != CE_DUMMY_COROUTINE_ID ? EPOLLIN : 0)
-                | (fd_assoc->wt_crtn != CE_DUMMY_COROUTINE_ID ? EPOLLOUT : 0);
-    if (should_del) {
-        if (epoll_ctl(poller_fd, EPOLL_CTL_DEL, fd, evt) != 0) {
-            printf("ERROR: Failed to delete event in epoll_ctl\n");
-            return CE_FAILURE;
-        }
-        fd_assoc_arr[fd] = NULL;
-    } else {
-        if (epoll_ctl(poller_fd, EPOLL_CTL_MOD, fd, evt) != 0) {
-            printf("ERROR: Failed to modify to delete event in epoll_ctl\n");
+    if (fd_assoc == NULL || fd_assoc->cbs == NULL) {
+        return CE_FAILURE;
+    }
+    cbs = fd_assoc->cbs;
+
+    if (event == CE_READ && cbs->rd_cb != NULL) {
+        cbs->rd_cb = NULL;
+        cbs->rd_arg = NULL;
+        polling_cnt--;
+    } else if (event == CE_WRITE && cbs->wt_cb != NULL) {
+        cbs->wt_cb = NULL;
+        cbs->wt_arg = NULL;
+        polling_cnt--;
+    }
+    if (cbs->rd_cb == NULL && cbs->wt_cb == NULL) {
+        free(cbs);
+        fd_assoc->cbs = NULL;
+    }
+
+    return put_fd_assoc(fd_assoc);
+}
+
+/*
+  takes both callbacks off the fd, which leaves epoll if nothing else
+  waits on it; they are returned in cbs and args, the number of them
+  is returned
+*/
+int ce_poller_drop_cbs(int fd, ce_poll_cb *cbs, void **args)
+{
+    ce_fd_assoc *fd_assoc = NULL;
+    int cnt = 0;
+
+    if (fd >= 0 && fd < fd_assoc_cap) {
+        fd_assoc = fd_assoc_arr[fd];
+    }
+    if (fd_assoc == NULL || fd_assoc->cbs == NULL) {
+        return 0;
+    }
+    if (fd_assoc->cbs->rd_cb != NULL) {
+        cbs[cnt] = fd_assoc->cbs->rd_cb;
+        args[cnt++] = fd_assoc->cbs->rd_arg;
+    }
+    if (fd_assoc->cbs->wt_cb != NULL) {
+        cbs[cnt] = fd_assoc->cbs->wt_cb;
+        args[cnt++] = fd_assoc->cbs->wt_arg;
+    }
+    ce_poller_remove_cb(fd, CE_READ);
+    ce_poller_remove_cb(fd, CE_WRITE);
+
+    return cnt;
+}
+
+static int push_ready_cb(int fd, int event, ce_poll_cb cb, void *arg)
+{
+    ce_ready_cb *new_cbs;
+    int new_cap;
+
+    if (ready_cb_cnt == ready_cb_cap) {
+        new_cap = ready_cb_cap > 0 ? ready_cb_cap * 2 : INIT_CAPACITY;
+        new_cbs = (ce_ready_cb *)realloc(ready_cbs,
+                                         sizeof(ce_ready_cb) * new_cap);
+        if (new_cbs == NULL) {
+            CE_LOG_ERROR("Failed to enlarge ready callbacks of poller");
             return CE_FAILURE;
         }
+        ready_cbs = new_cbs;
+        ready_cb_cap = new_cap;
     }
+    ready_cbs[ready_cb_cnt].fd = fd;
+    ready_cbs[ready_cb_cnt].event = event;
+    ready_cbs[ready_cb_cnt].cb = cb;
+    ready_cbs[ready_cb_cnt].arg = arg;
+    ready_cb_cnt++;
 
-    polling_cnt--;
     return CE_SUCCESS;
 }
 
+/*
+  callbacks may add and remove fds, which frees fd_assoc the poll results
+  refer to, so they run after the results were walked through; a callback
+  is dropped if an earlier one removed or replaced it
+*/
+static void run_ready_cbs()
+{
+    ce_ready_cb ready;
+    ce_fd_assoc *fd_assoc;
+    int i;
+
+    for (i = 0; i < ready_cb_cnt; i++) {
+        ready = ready_cbs[i];
+        fd_assoc = ready.fd < fd_assoc_cap ? fd_assoc_arr[ready.fd] : NULL;
+        if (fd_assoc == NULL || fd_assoc->cbs == NULL) {
+            continue;
+        }
+        if (ready.event == CE_READ
+            ? (fd_assoc->cbs->rd_cb != ready.cb || fd_assoc->cbs->rd_arg != ready.arg)
+            : (fd_assoc->cbs->wt_cb != ready.cb || fd_assoc->cbs->wt_arg != ready.arg)) {
+            continue;
+        }
+        ce_poller_remove_cb(ready.fd, ready.event);
+        ready.cb(ready.arg);
+    }
+    ready_cb_cnt = 0;
+}
+
 int ce_poller_poll(int timeout)
 {
+    unsigned long long start_ns;
+    struct timespec ts;
     size_t size_in_bytes = sizeof(struct epoll_event) * MAX_EPOLL_EVTS;
     if (poll_results == NULL) {
         poll_results = (struct epoll_event *)malloc(size_in_bytes);
         if (poll_results == NULL) {
-            printf("ERROR: Failed to allocate space for poll_event\n");
+            CE_LOG_ERROR("Failed to allocate space for poll_event");
             return CE_FAILURE;
         }
     }
 
     if (polling_cnt == 0) {
-        return CE_SUCCESS;
+        // don't let ce_poller_react replay results of an earlier poll
+        ready_cnt = 0;
+        if (timeout <= 0) {
+            return CE_SUCCESS;
+        }
+        // nothing to poll, sleep until the timer that is due first
+        if (!ce_poller_initialized()) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000L;
+            nanosleep(&ts, NULL);
+            return CE_SUCCESS;
+        }
     }
 
+    start_ns = CE_STATS_NOW();
+    CE_TRACE_EVT(CE_TRACE_POLL_BEGIN, CE_DUMMY_COROUTINE_ID, 0);
     ready_cnt = epoll_wait(poller_fd, poll_results, MAX_EPOLL_EVTS, timeout);
     if (ready_cnt == -1) {
-        printf("ERROR: Failed to poll events\n");
+        ready_cnt = 0;
+        // a signal, such as the one of the watchdog, cut the wait short
+        if (errno == EINTR) {
+            return CE_SUCCESS;
+        }
+        CE_LOG_ERROR("Failed to poll events");
         return CE_FAILURE;
     }
+    CE_TRACE_EVT(CE_TRACE_POLL_END, CE_DUMMY_COROUTINE_ID, ready_cnt);
+    CE_STATS_RECORD(poll_ns, CE_STATS_NOW() - start_ns);
+    CE_STATS_ADD(polls, 1);
 
     return CE_SUCCESS;
 }
@@ -180,29 +782,62 @@ int ce_poller_react()
     int i;
     int evt_flags;
     ce_fd_assoc *fd_assoc;
+    int crtn_id;
 
+    CE_STATS_RECORD(react_events, ready_cnt);
+    CE_STATS_ADD(poll_events, ready_cnt);
+    CE_TRACE_EVT(CE_TRACE_REACT, CE_DUMMY_COROUTINE_ID, ready_cnt);
     for (i = 0; i < ready_cnt; i++) {
         evt_flags = poll_results[i].events;
         fd_assoc = (ce_fd_assoc *)poll_results[i].data.ptr;
-        if (evt_flags & EPOLLIN
-            && fd_assoc->rd_crtn != CE_DUMMY_COROUTINE_ID
-            && ce_get_coroutine_status(fd_assoc->rd_crtn) == CE_COROUTINE_BLOCKED) {
-            if (ce_set_coroutine_status(fd_assoc->rd_crtn,
-                                        CE_COROUTINE_SUSPENDED) != CE_SUCCESS) {
-                printf("ERROR: Failed to set reading coroutine status\n");
+        if (fd_assoc == NULL) {
+            // the wakeup fd, drained by the run loop
+            continue;
+        }
+        if (evt_flags & (EPOLLIN | EPOLLHUP | EPOLLERR)
+            && fd_assoc->rd_q.size > 0) {
+            if (wake_waiters(&fd_assoc->rd_q, fd_assoc->wake_mode) != CE_SUCCESS) {
+                return CE_FAILURE;
+            }
+        } else if (evt_flags & (EPOLLIN | EPOLLHUP | EPOLLERR)
+                   && fd_assoc->handler != NULL) {
+            if (fd_assoc->busy) {
+                // stop polling for input nobody reads until the handler
+                // finishes, or readiness would be reported on every tick
+                update_events(fd_assoc);
+            } else {
+                crtn_id = ce_coroutine_create(run_handler,
+                                              (void *)(long)fd_assoc->fd);
+                if (crtn_id == CE_DUMMY_COROUTINE_ID) {
+                    CE_LOG_ERROR("Failed to create handler coroutine");
+                    return CE_FAILURE;
+                }
+                // keep epoll reporting the fd, the handler reads right away
+                fd_assoc->busy = TRUE;
+            }
+        }
+        if (evt_flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)
+            && fd_assoc->wt_q.size > 0) {
+            if (wake_waiters(&fd_assoc->wt_q, fd_assoc->wake_mode) != CE_SUCCESS) {
                 return CE_FAILURE;
             }
         }
-        if (evt_flags & EPOLLOUT
-            && fd_assoc->wt_crtn != CE_DUMMY_COROUTINE_ID
-            && ce_get_coroutine_status(fd_assoc->wt_crtn) == CE_COROUTINE_BLOCKED) {
-            if (ce_set_coroutine_status(fd_assoc->wt_crtn,
-                                        CE_COROUTINE_SUSPENDED) != CE_SUCCESS) {
-                printf("ERROR: Failed to set writing coroutine status\n");
+        if (fd_assoc->cbs != NULL) {
+            if (evt_flags & (EPOLLIN | EPOLLHUP | EPOLLERR)
+                && fd_assoc->cbs->rd_cb != NULL
+                && push_ready_cb(fd_assoc->fd, CE_READ, fd_assoc->cbs->rd_cb,
+                                 fd_assoc->cbs->rd_arg) != CE_SUCCESS) {
+                return CE_FAILURE;
+            }
+            if (evt_flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)
+                && fd_assoc->cbs->wt_cb != NULL
+                && push_ready_cb(fd_assoc->fd, CE_WRITE, fd_assoc->cbs->wt_cb,
+                                 fd_assoc->cbs->wt_arg) != CE_SUCCESS) {
                 return CE_FAILURE;
             }
         }
     }
+    run_ready_cbs();
 
     return CE_SUCCESS;
 }
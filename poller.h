@@ -1,11 +1,27 @@
 #ifndef _COEVT_POLLER_H_
 #define _COEVT_POLLER_H_
 
+// runs in a coroutine of its own, returns CE_SUCCESS to wait for more input
+typedef int (*ce_fd_handler)(int fd, void *arg);
+// called once when the fd is ready, from the run loop instead of a coroutine
+typedef void (*ce_poll_cb)(void *arg);
+
 int ce_poller_init(int max_fd);
 int ce_poller_initialized();
+int ce_poller_fd();
+int ce_poller_add_wakeup(int fd);
 int ce_poller_lookup(int fd, int event);
 int ce_poller_add(int fd, int event);
 int ce_poller_remove(int fd, int event);
+int ce_poller_waiters(int fd, int event);
+int ce_poller_set_wake_mode(int fd, int wake_mode);
+int ce_poller_set_handler(int fd, ce_fd_handler handler, void *arg);
+int ce_poller_handler_cnt();
+int ce_poller_next_idle(int from, void **handler_arg);
+int ce_poller_forget(int fd);
+int ce_poller_add_cb(int fd, int event, ce_poll_cb cb, void *arg);
+int ce_poller_remove_cb(int fd, int event);
+int ce_poller_drop_cbs(int fd, ce_poll_cb *cbs, void **args);
 int ce_poller_poll(int timeout);
 int ce_poller_react();
 
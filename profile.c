@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#include "defs.h"
+#include "log.h"
+#include "coroutine.h"
+#include "profile.h"
+
+// the handler and the signal trampoline on top of every sampled stack
+#define SKIP_FRAMES 2
+#define MAX_PROBES 16
+
+#define ROOT_TASK 0
+#define ROOT_SCHEDULER 1 // the run loop, between coroutines
+#define ROOT_THREAD 2    // a thread other than the loop thread
+
+/*
+  one counter per distinct (task function, stack), filled in by the
+  SIGPROF handler without allocating, so it can stay on in production
+*/
+typedef struct ce_prof_slot {
+    unsigned long hash;
+    int root;
+    coroutine_func func;
+    int depth;
+    void *frames[CE_PROFILE_DEPTH];
+    unsigned long count;
+} ce_prof_slot;
+
+/*
+  one profiler for the unique scheduler in the process
+*/
+static ce_prof_slot slots[CE_PROFILE_SLOTS];
+static unsigned long dropped = 0;
+static pthread_t loop_thread;
+static int profiling = FALSE;
+
+/*
+  ITIMER_PROF signals whichever thread used the CPU, the log writer and
+  the watchdog included, so handlers on two threads, or one and a dump,
+  may meet on the table; a handler that finds it taken skips its sample
+*/
+static int slots_busy = FALSE;
+
+static int lock_slots(int wait)
+{
+    while (__atomic_exchange_n(&slots_busy, TRUE, __ATOMIC_ACQUIRE)) {
+        if (!wait) {
+            return FALSE;
+        }
+        sched_yield();
+    }
+    return TRUE;
+}
+
+static void unlock_slots()
+{
+    __atomic_store_n(&slots_busy, FALSE, __ATOMIC_RELEASE);
+}
+
+static unsigned long hash_sample(int root, coroutine_func func,
+                                 void **frames, int depth)
+{
+    unsigned long hash = 14695981039346656037UL;
+    int i;
+
+    hash = (hash ^ (unsigned long)root) * 1099511628211UL;
+    hash = (hash ^ (unsigned long)func) * 1099511628211UL;
+    for (i = 0; i < depth; i++) {
+        hash = (hash ^ (unsigned long)frames[i]) * 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static int same_sample(ce_prof_slot *slot, unsigned long hash, int root,
+                       coroutine_func func, void **frames, int depth)
+{
+    return slot->hash == hash && slot->root == root && slot->func == func
+           && slot->depth == depth
+           && memcmp(slot->frames, frames, sizeof(void *) * depth) == 0;
+}
+
+// runs on whichever thread used the CPU, between any two instructions
+static void on_profile_signal(int sig)
+{
+    void *frames[CE_PROFILE_DEPTH + SKIP_FRAMES];
+    coroutine_func func = NULL;
+    ce_prof_slot *slot;
+    unsigned long hash;
+    int root = ROOT_THREAD;
+    int saved_errno = errno;
+    int switching = FALSE;
+    int depth, i;
+
+    if (pthread_equal(pthread_self(), loop_thread)) {
+        // the coroutine list may be moving under us, only this is safe
+        func = ce_coroutine_running_func();
+        root = func == NULL ? ROOT_SCHEDULER : ROOT_TASK;
+        switching = ce_coroutine_switching();
+    }
+    // halfway through a switch the stack can't be unwound, the sample
+    // is counted with no frames
+    depth = 0;
+    if (!switching) {
+        depth = backtrace(frames, CE_PROFILE_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    }
+    if (depth < 0) {
+        depth = 0;
+    }
+    hash = hash_sample(root, func, frames + SKIP_FRAMES, depth);
+    if (!lock_slots(FALSE)) {
+        errno = saved_errno;
+        return;
+    }
+
+    for (i = 0; i < MAX_PROBES; i++) {
+        slot = &slots[(hash + i) & (CE_PROFILE_SLOTS - 1)];
+        if (slot->count == 0) {
+            slot->hash = hash;
+            slot->root = root;
+            slot->func = func;
+            slot->depth = depth;
+            memcpy(slot->frames, frames + SKIP_FRAMES, sizeof(void *) * depth);
+            slot->count = 1;
+            break;
+        }
+        if (same_sample(slot, hash, root, func, frames + SKIP_FRAMES, depth)) {
+            slot->count++;
+            break;
+        }
+    }
+    if (i == MAX_PROBES) {
+        dropped++;
+    }
+    unlock_slots();
+    // the interrupted code may be about to look at errno
+    errno = saved_errno;
+}
+
+int ce_profile_start(int hz)
+{
+    struct sigaction sa;
+    struct itimerval timer;
+    void *frames[1];
+
+    if (profiling) {
+        return CE_FAILURE;
+    }
+    if (hz <= 0) {
+        hz = CE_PROFILE_HZ;
+    }
+    // setitimer counts in microseconds
+    if (hz > 1000000) {
+        hz = 1000000;
+    }
+    // must be called on the thread running the scheduler
+    loop_thread = pthread_self();
+
+    // the first backtrace call loads libgcc, don't do it in the handler
+    backtrace(frames, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_profile_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        CE_LOG_ERROR("Failed to install profiler signal handler");
+        return CE_FAILURE;
+    }
+
+    // ITIMER_PROF counts the CPU time of the process, idle waits in
+    // epoll_wait are not sampled
+    // tv_usec must stay below a second, 1 Hz is a whole tv_sec
+    timer.it_interval.tv_sec = 1000000 / hz / 1000000;
+    timer.it_interval.tv_usec = 1000000 / hz % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        CE_LOG_ERROR("Failed to start profiler timer");
+        signal(SIGPROF, SIG_IGN);
+        return CE_FAILURE;
+    }
+    profiling = TRUE;
+
+    return CE_SUCCESS;
+}
+
+void ce_profile_stop()
+{
+    struct itimerval timer;
+
+    if (!profiling) {
+        return;
+    }
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    // a signal still in flight would terminate the process otherwise
+    signal(SIGPROF, SIG_IGN);
+    profiling = FALSE;
+}
+
+static void block_profile_signal(int block)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+void ce_profile_reset()
+{
+    block_profile_signal(TRUE);
+    lock_slots(TRUE);
+    memset(slots, 0, sizeof(slots));
+    dropped = 0;
+    unlock_slots();
+    block_profile_signal(FALSE);
+}
+
+/*
+  the function name out of "dir/binary(name+0x1f) [0x...]", or
+  "binary+0x1234" for static functions, to be resolved with addr2line
+*/
+static void write_frame(FILE *fp, const char *sym, void *addr)
+{
+    const char *begin = sym != NULL ? strchr(sym, '(') : NULL;
+    const char *module;
+    const char *end;
+
+    if (begin == NULL) {
+        fprintf(fp, "%p", addr);
+        return;
+    }
+    if (begin[1] != '+' && begin[1] != ')') {
+        end = begin + 1 + strcspn(begin + 1, "+)");
+        fprintf(fp, "%.*s", (int)(end - begin - 1), begin + 1);
+        return;
+    }
+    for (module = begin; module > sym && module[-1] != '/'; module--) {
+    }
+    end = begin + 1 + strcspn(begin + 1, ")");
+    fprintf(fp, "%.*s%.*s", (int)(begin - module), module,
+            (int)(end - begin - 1), begin + 1);
+}
+
+/*
+  folded stacks, one "root;outermost;...;innermost count" line per stack,
+  where root is the task function of the sampled coroutine;
+  feed them to flamegraph.pl or speedscope
+*/
+int ce_profile_dump(FILE *fp)
+{
+    ce_prof_slot *slot;
+    void *func_addr;
+    char **syms;
+    char **root_sym;
+    int i, j;
+
+    if (fp == NULL) {
+        return CE_FAILURE;
+    }
+    // a sample landing in the middle of a slot would garble its line
+    block_profile_signal(TRUE);
+    lock_slots(TRUE);
+    for (i = 0; i < CE_PROFILE_SLOTS; i++) {
+        slot = &slots[i];
+        if (slot->count == 0) {
+            continue;
+        }
+        if (slot->root == ROOT_TASK) {
+            func_addr = (void *)slot->func;
+            root_sym = backtrace_symbols(&func_addr, 1);
+            fprintf(fp, "task:");
+            write_frame(fp, root_sym != NULL ? root_sym[0] : NULL, func_addr);
+            free(root_sym);
+        } else {
+            fprintf(fp, slot->root == ROOT_SCHEDULER ? "[scheduler]" : "[other thread]");
+        }
+        syms = backtrace_symbols(slot->frames, slot->depth);
+        for (j = slot->depth - 1; j >= 0; j--) {
+            fprintf(fp, ";");
+            write_frame(fp, syms != NULL ? syms[j] : NULL, slot->frames[j]);
+        }
+        free(syms);
+        fprintf(fp, " %lu\n", slot->count);
+    }
+    if (dropped > 0) {
+        fprintf(fp, "[dropped] %lu\n", dropped);
+    }
+    unlock_slots();
+    block_profile_signal(FALSE);
+
+    return CE_SUCCESS;
+}
+
+static void dump_at_exit()
+{
+    FILE *fp = fopen(getenv("CE_PROFILE_FILE"), "w");
+
+    if (fp == NULL) {
+        CE_LOG_ERROR("Failed to open profile file");
+        return;
+    }
+    ce_profile_stop();
+    ce_profile_dump(fp);
+    fclose(fp);
+}
+
+__attribute__((constructor))
+static void profile_init()
+{
+    const char *hz = getenv("CE_PROFILE_HZ");
+
+    // profile the whole run and dump when the program exits normally
+    if (getenv("CE_PROFILE_FILE") != NULL
+        && ce_profile_start(hz != NULL ? atoi(hz) : CE_PROFILE_HZ) == CE_SUCCESS) {
+        atexit(dump_at_exit);
+    }
+}
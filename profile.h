@@ -0,0 +1,15 @@
+#ifndef _COEVT_PROFILE_H_
+#define _COEVT_PROFILE_H_
+
+#include <stdio.h>
+
+#define CE_PROFILE_HZ 99       // default sampling rate
+#define CE_PROFILE_DEPTH 32    // frames kept per sample
+#define CE_PROFILE_SLOTS 1024  // distinct stacks counted, must be a power of 2
+
+int ce_profile_start(int hz);
+void ce_profile_stop();
+void ce_profile_reset();
+int ce_profile_dump(FILE *fp);
+
+#endif
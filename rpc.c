@@ -0,0 +1,524 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "defs.h"
+#include "log.h"
+#include "coroutine.h"
+#include "coevt.h"
+#include "rpc.h"
+
+#define CE_RPC_READ_SIZE 65536
+
+#define CE_CALL_WAITING 0
+#define CE_CALL_DONE 1
+#define CE_CALL_FAILED 2
+
+/*
+  a call lives on the heap, its caller's stack is swapped out while the
+  writer sends the request and the reader hands over the response
+*/
+typedef struct ce_rpc_pending {
+    unsigned int id;
+    int crtn_id;
+    int status;
+    int refs;        // the caller, and the writer while queued or written
+    int queued;      // not taken by the writer yet
+    void *resp;
+    size_t resp_len;
+    size_t frame_len;
+    struct ce_rpc_pending *qnext;
+    struct ce_rpc_pending *hnext;
+    unsigned char frame[];  // header and request
+} ce_rpc_pending;
+
+typedef struct ce_rpc_buf {
+    char *data;
+    size_t cap;
+    size_t start;
+    size_t end;
+} ce_rpc_buf;
+
+struct ce_rpc_client {
+    int fd;
+    int refs;        // the owner, the reader and the writer
+    int closed;
+    int inflight;
+    unsigned int next_id;
+    int writer_id;
+    int writer_idle;
+    ce_rpc_pending *wq_head;
+    ce_rpc_pending *wq_tail;
+    ce_rpc_pending *table[CE_RPC_BUCKETS];
+    ce_rpc_buf rbuf;
+    ce_rpc_pending *batch[CE_RPC_MAX_BATCH];
+    struct iovec iov[CE_RPC_MAX_BATCH];
+};
+
+// kept off the stack of the serving task, which is copied on every switch
+typedef struct ce_rpc_conn {
+    ce_rpc_buf rbuf;
+    unsigned char hdrs[CE_RPC_MAX_BATCH][CE_RPC_HEADER_SIZE];
+    void *bodies[CE_RPC_MAX_BATCH];
+    struct iovec iov[CE_RPC_MAX_BATCH * 2];
+} ce_rpc_conn;
+
+static void put_header(unsigned char *hdr, size_t len, unsigned int id)
+{
+    unsigned int n;
+
+    n = htonl((unsigned int)len);
+    memcpy(hdr, &n, 4);
+    n = htonl(id);
+    memcpy(hdr + 4, &n, 4);
+}
+
+// reads more bytes behind the buffered ones, 0 on EOF
+static ssize_t fill_buf(int fd, ce_rpc_buf *rb)
+{
+    ssize_t bytes;
+
+    if (rb->start > 0 && rb->end == rb->cap) {
+        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+    bytes = ce_read(fd, rb->data + rb->end, rb->cap - rb->end);
+    if (bytes > 0) {
+        rb->end += bytes;
+    }
+
+    return bytes;
+}
+
+/*
+  1 with the next complete frame, which points into the buffer until it is
+  filled again, 0 if more bytes are needed, CE_FAILURE on a bad frame
+*/
+static int next_frame(ce_rpc_buf *rb, unsigned int *id,
+                      char **payload, size_t *len)
+{
+    unsigned int n;
+    size_t frame_len;
+    char *data;
+
+    if (rb->end - rb->start < CE_RPC_HEADER_SIZE) {
+        return 0;
+    }
+    memcpy(&n, rb->data + rb->start, 4);
+    *len = ntohl(n);
+    if (*len > CE_RPC_MAX_FRAME) {
+        CE_LOG_ERROR("RPC frame of %zu bytes is too large", *len);
+        return CE_FAILURE;
+    }
+    frame_len = CE_RPC_HEADER_SIZE + *len;
+    if (rb->end - rb->start < frame_len) {
+        if (frame_len > rb->cap) {
+            data = (char *)realloc(rb->data, frame_len);
+            if (data == NULL) {
+                CE_LOG_ERROR("Failed to allocate space for a RPC frame");
+                return CE_FAILURE;
+            }
+            rb->data = data;
+            rb->cap = frame_len;
+        }
+        if (rb->start + frame_len > rb->cap) {
+            memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+            rb->end -= rb->start;
+            rb->start = 0;
+        }
+        return 0;
+    }
+
+    memcpy(&n, rb->data + rb->start + 4, 4);
+    *id = ntohl(n);
+    *payload = rb->data + rb->start + CE_RPC_HEADER_SIZE;
+    rb->start += frame_len;
+    if (rb->start == rb->end) {
+        rb->start = rb->end = 0;
+    }
+
+    return 1;
+}
+
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t bytes;
+
+    while (iovcnt > 0) {
+        bytes = ce_writev(fd, iov, iovcnt);
+        if (bytes <= 0) {
+            return CE_FAILURE;
+        }
+        while (iovcnt > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    return CE_SUCCESS;
+}
+
+static void release_pending(ce_rpc_pending *p)
+{
+    if (--p->refs == 0) {
+        free(p->resp);
+        free(p);
+    }
+}
+
+static void table_add(ce_rpc_client *client, ce_rpc_pending *p)
+{
+    ce_rpc_pending **bucket = &client->table[p->id % CE_RPC_BUCKETS];
+
+    p->hnext = *bucket;
+    *bucket = p;
+    client->inflight++;
+}
+
+static ce_rpc_pending *table_remove(ce_rpc_client *client, unsigned int id)
+{
+    ce_rpc_pending **pp = &client->table[id % CE_RPC_BUCKETS];
+    ce_rpc_pending *p;
+
+    for (p = *pp; p != NULL; pp = &p->hnext, p = p->hnext) {
+        if (p->id == id) {
+            *pp = p->hnext;
+            p->hnext = NULL;
+            client->inflight--;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static void queue_remove(ce_rpc_client *client, ce_rpc_pending *p)
+{
+    ce_rpc_pending *prev = NULL;
+    ce_rpc_pending *cur;
+
+    for (cur = client->wq_head; cur != NULL; prev = cur, cur = cur->qnext) {
+        if (cur == p) {
+            break;
+        }
+    }
+    if (cur == NULL) {
+        return;
+    }
+    if (prev == NULL) {
+        client->wq_head = p->qnext;
+    } else {
+        prev->qnext = p->qnext;
+    }
+    if (client->wq_tail == p) {
+        client->wq_tail = prev;
+    }
+    p->qnext = NULL;
+    p->queued = FALSE;
+}
+
+static void finish(ce_rpc_pending *p, int status)
+{
+    p->status = status;
+    ce_set_coroutine_status(p->crtn_id, CE_COROUTINE_SUSPENDED);
+}
+
+static void wake_writer(ce_rpc_client *client)
+{
+    if (client->writer_idle) {
+        client->writer_idle = FALSE;
+        ce_set_coroutine_status(client->writer_id, CE_COROUTINE_SUSPENDED);
+    }
+}
+
+static void release_client(ce_rpc_client *client)
+{
+    if (--client->refs == 0) {
+        ce_close(client->fd);
+        free(client->rbuf.data);
+        free(client);
+    }
+}
+
+// no call can complete any more, the reader and the writer return
+static void fail_client(ce_rpc_client *client)
+{
+    ce_rpc_pending *p;
+    int i;
+
+    if (client->closed) {
+        return;
+    }
+    client->closed = TRUE;
+    for (i = 0; i < CE_RPC_BUCKETS; i++) {
+        while ((p = client->table[i]) != NULL) {
+            table_remove(client, p->id);
+            finish(p, CE_CALL_FAILED);
+        }
+    }
+    shutdown(client->fd, SHUT_RDWR);
+    wake_writer(client);
+}
+
+static void writer_task(void *arg)
+{
+    ce_rpc_client *client = (ce_rpc_client *)arg;
+    ce_rpc_pending **batch = client->batch;
+    struct iovec *iov = client->iov;
+    ce_rpc_pending *p;
+    int ret;
+    int i, n;
+
+    client->writer_id = ce_cur_task();
+    while (TRUE) {
+        if (client->closed) {
+            while ((p = client->wq_head) != NULL) {
+                queue_remove(client, p);
+                release_pending(p);
+            }
+            break;
+        }
+        if (client->wq_head == NULL) {
+            client->writer_idle = TRUE;
+            ce_wait();
+            client->writer_idle = FALSE;
+            continue;
+        }
+
+        // every request queued while the writer was away goes out at once
+        for (n = 0; n < CE_RPC_MAX_BATCH && client->wq_head != NULL; n++) {
+            p = client->wq_head;
+            queue_remove(client, p);
+            batch[n] = p;
+            iov[n].iov_base = p->frame;
+            iov[n].iov_len = p->frame_len;
+        }
+        ret = write_all(client->fd, iov, n);
+        for (i = 0; i < n; i++) {
+            release_pending(batch[i]);
+        }
+        if (ret != CE_SUCCESS) {
+            fail_client(client);
+        }
+    }
+
+    release_client(client);
+}
+
+static void reader_task(void *arg)
+{
+    ce_rpc_client *client = (ce_rpc_client *)arg;
+    ce_rpc_pending *p;
+    unsigned int id;
+    char *payload;
+    size_t len;
+    int ret;
+
+    while (!client->closed) {
+        if (fill_buf(client->fd, &client->rbuf) <= 0) {
+            break;
+        }
+        while ((ret = next_frame(&client->rbuf, &id, &payload, &len)) == 1) {
+            // the caller gave up on it already
+            p = table_remove(client, id);
+            if (p == NULL) {
+                continue;
+            }
+            p->resp = malloc(len > 0 ? len : 1);
+            if (p->resp == NULL) {
+                CE_LOG_ERROR("Failed to allocate space for a RPC response");
+                finish(p, CE_CALL_FAILED);
+                continue;
+            }
+            memcpy(p->resp, payload, len);
+            p->resp_len = len;
+            finish(p, CE_CALL_DONE);
+            ce_coroutine_run_next(p->crtn_id);
+        }
+        if (ret == CE_FAILURE) {
+            break;
+        }
+    }
+
+    fail_client(client);
+    release_client(client);
+}
+
+ce_rpc_client *ce_rpc_client_create(int fd)
+{
+    ce_rpc_client *client = (ce_rpc_client *)malloc(sizeof(ce_rpc_client));
+    if (client == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_rpc_client");
+        ce_close(fd);
+        return NULL;
+    }
+    memset(client, 0, sizeof(ce_rpc_client));
+    client->fd = fd;
+    client->writer_id = CE_DUMMY_COROUTINE_ID;
+    client->rbuf.cap = CE_RPC_READ_SIZE;
+    client->rbuf.data = (char *)malloc(client->rbuf.cap);
+    if (client->rbuf.data == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for buffer of ce_rpc_client");
+        ce_close(fd);
+        free(client);
+        return NULL;
+    }
+
+    client->refs = 1;
+    if (ce_task(reader_task, client) != CE_SUCCESS) {
+        release_client(client);
+        return NULL;
+    }
+    client->refs++;
+    if (ce_task(writer_task, client) != CE_SUCCESS) {
+        // the reader finds the fd shut down and frees the client
+        fail_client(client);
+        release_client(client);
+        return NULL;
+    }
+    client->refs++;
+
+    return client;
+}
+
+int ce_rpc_call(ce_rpc_client *client, const void *req, size_t req_len,
+                void **resp, size_t *resp_len, int timeout_ms)
+{
+    ce_rpc_pending *p;
+    int ret;
+
+    if (client == NULL || client->closed || req_len > CE_RPC_MAX_FRAME) {
+        return CE_FAILURE;
+    }
+    p = (ce_rpc_pending *)malloc(sizeof(ce_rpc_pending)
+                                 + CE_RPC_HEADER_SIZE + req_len);
+    if (p == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for a RPC call");
+        return CE_FAILURE;
+    }
+    memset(p, 0, sizeof(ce_rpc_pending));
+    p->id = client->next_id++;
+    p->crtn_id = ce_cur_task();
+    p->status = CE_CALL_WAITING;
+    p->refs = 2;
+    p->queued = TRUE;
+    p->frame_len = CE_RPC_HEADER_SIZE + req_len;
+    put_header(p->frame, req_len, p->id);
+    memcpy(p->frame + CE_RPC_HEADER_SIZE, req, req_len);
+
+    table_add(client, p);
+    if (client->wq_tail == NULL) {
+        client->wq_head = client->wq_tail = p;
+    } else {
+        client->wq_tail->qnext = p;
+        client->wq_tail = p;
+    }
+    wake_writer(client);
+
+    ce_wait_timeout(timeout_ms);
+    if (p->status == CE_CALL_DONE) {
+        *resp = p->resp;
+        *resp_len = p->resp_len;
+        p->resp = NULL;
+        ret = CE_SUCCESS;
+    } else if (p->status == CE_CALL_FAILED) {
+        ret = CE_FAILURE;
+    } else {
+        // still waiting, so the client is alive; a late response is dropped
+        table_remove(client, p->id);
+        if (p->queued) {
+            queue_remove(client, p);
+            p->refs--;
+        }
+        ret = CE_TIMEOUT;
+    }
+    release_pending(p);
+
+    return ret;
+}
+
+int ce_rpc_inflight(ce_rpc_client *client)
+{
+    return client == NULL ? 0 : client->inflight;
+}
+
+void ce_rpc_client_close(ce_rpc_client **client_ptr)
+{
+    if (*client_ptr == NULL) {
+        return;
+    }
+    fail_client(*client_ptr);
+    release_client(*client_ptr);
+    *client_ptr = NULL;
+}
+
+int ce_rpc_serve(int fd, ce_rpc_handler handler, void *arg)
+{
+    ce_rpc_conn *conn;
+    unsigned int id;
+    char *payload;
+    size_t len;
+    size_t resp_len;
+    int ret = CE_SUCCESS;
+    int i, n;
+
+    conn = (ce_rpc_conn *)malloc(sizeof(ce_rpc_conn));
+    if (conn == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_rpc_conn");
+        return CE_FAILURE;
+    }
+    memset(&conn->rbuf, 0, sizeof(ce_rpc_buf));
+    conn->rbuf.cap = CE_RPC_READ_SIZE;
+    conn->rbuf.data = (char *)malloc(conn->rbuf.cap);
+    if (conn->rbuf.data == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for buffer of ce_rpc_conn");
+        free(conn);
+        return CE_FAILURE;
+    }
+
+    while (ret == CE_SUCCESS && fill_buf(fd, &conn->rbuf) > 0) {
+        // requests that arrived together are answered by one writev
+        do {
+            n = 0;
+            while (n < CE_RPC_MAX_BATCH
+                   && (ret = next_frame(&conn->rbuf, &id, &payload, &len)) == 1) {
+                conn->bodies[n] = NULL;
+                resp_len = 0;
+                if (handler(payload, len, &conn->bodies[n], &resp_len, arg)
+                    != CE_SUCCESS) {
+                    free(conn->bodies[n]);
+                    conn->bodies[n] = NULL;
+                    resp_len = 0;
+                }
+                put_header(conn->hdrs[n], resp_len, id);
+                conn->iov[n * 2].iov_base = conn->hdrs[n];
+                conn->iov[n * 2].iov_len = CE_RPC_HEADER_SIZE;
+                conn->iov[n * 2 + 1].iov_base = conn->bodies[n];
+                conn->iov[n * 2 + 1].iov_len = resp_len;
+                n++;
+            }
+            if (n > 0 && write_all(fd, conn->iov, n * 2) != CE_SUCCESS) {
+                ret = CE_FAILURE;
+            }
+            for (i = 0; i < n; i++) {
+                free(conn->bodies[i]);
+            }
+        } while (ret == 1);
+        if (ret == 0) {
+            ret = CE_SUCCESS;
+        }
+    }
+
+    free(conn->rbuf.data);
+    free(conn);
+    return ret;
+}
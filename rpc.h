@@ -0,0 +1,42 @@
+#ifndef _COEVT_RPC_H_
+#define _COEVT_RPC_H_
+
+#include <stddef.h>
+
+/*
+  frames are a 4 byte payload length and a 4 byte correlation id,
+  both in network order, followed by the payload; a response carries
+  the id of its request and may arrive in any order
+*/
+#define CE_RPC_HEADER_SIZE 8
+#define CE_RPC_MAX_FRAME (16 << 20) // largest payload accepted
+#define CE_RPC_MAX_BATCH 64         // frames written by one writev
+#define CE_RPC_BUCKETS 256          // calls in flight are hashed by id
+
+typedef struct ce_rpc_client ce_rpc_client;
+
+// fills a malloc'ed response, freed once it is written,
+// an empty response is sent if it fails
+typedef int (*ce_rpc_handler)(const void *req, size_t req_len,
+                              void **resp, size_t *resp_len, void *arg);
+
+// the fd is connected and nonblocking, and owned by the client from now
+// on, even if the client can not be created
+ce_rpc_client *ce_rpc_client_create(int fd);
+
+/*
+  within a task, any number of them may call concurrently, the response
+  is malloc'ed and freed by the caller; returns CE_TIMEOUT if no response
+  came within timeout_ms (< 0 waits forever)
+*/
+int ce_rpc_call(ce_rpc_client *client, const void *req, size_t req_len,
+                void **resp, size_t *resp_len, int timeout_ms);
+int ce_rpc_inflight(ce_rpc_client *client);
+
+// fails calls in flight, the client is freed once its tasks are gone
+void ce_rpc_client_close(ce_rpc_client **client_ptr);
+
+// serves the requests of one connection in the current task until it closes
+int ce_rpc_serve(int fd, ce_rpc_handler handler, void *arg);
+
+#endif
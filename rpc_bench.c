@@ -0,0 +1,145 @@
+/*
+ * rpc benchmark: callers share one ce_rpc client, a server task answers
+ * on the other end of a socket pair, both in this process; reports calls
+ * per second and the latency of a call as one JSON object
+ * -c is the number of concurrent callers, the writer batches what they
+ * queued since its last write into one writev
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "coevt.h"
+#include "stats.h"
+#include "rpc.h"
+
+static int callers = 64;
+static long calls = 10000;       // per caller
+static int req_size = 64;
+
+static ce_rpc_client *client;
+static char *req;
+static ce_hist latency;
+static long completed = 0;
+static long errors = 0;
+static int live;
+static unsigned long long start_ns;
+
+// echoes the request back
+static int echo(const void *req, size_t req_len, void **resp, size_t *resp_len,
+                void *arg)
+{
+    *resp = malloc(req_len);
+    if (*resp == NULL) {
+        return CE_FAILURE;
+    }
+    memcpy(*resp, req, req_len);
+    *resp_len = req_len;
+
+    return CE_SUCCESS;
+}
+
+static void server(void *arg)
+{
+    int fd = (int)(long)arg;
+
+    ce_rpc_serve(fd, echo, NULL);
+    ce_close(fd);
+}
+
+static void report()
+{
+    double secs = (ce_stats_now_ns() - start_ns) / 1e9;
+
+    printf("{\"bench\":\"rpc\",\"callers\":%d,\"req_size\":%d,"
+           "\"calls\":%ld,\"errors\":%ld,\"calls_per_sec\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           callers, req_size, completed, errors, completed / secs,
+           ce_hist_percentile(&latency, 50.0) / 1e3,
+           ce_hist_percentile(&latency, 99.0) / 1e3,
+           latency.max / 1e3);
+}
+
+static void caller(void *arg)
+{
+    unsigned long long start;
+    void *resp;
+    size_t resp_len;
+    long i;
+
+    for (i = 0; i < calls; i++) {
+        start = ce_stats_now_ns();
+        if (ce_rpc_call(client, req, req_size, &resp, &resp_len, 3000)
+            != CE_SUCCESS) {
+            errors++;
+            break;
+        }
+        ce_hist_record(&latency, ce_stats_now_ns() - start);
+        if (resp_len != (size_t)req_size || memcmp(resp, req, req_size) != 0) {
+            errors++;
+        }
+        free(resp);
+        completed++;
+    }
+
+    // the last caller closes the client, which ends the server too
+    if (--live == 0) {
+        report();
+        ce_rpc_client_close(&client);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int sv[2];
+    long i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:s:")) != -1) {
+        switch (opt) {
+        case 'c': callers = atoi(optarg); break;
+        case 'n': calls = atol(optarg); break;
+        case 's': req_size = atoi(optarg); break;
+        default:
+            printf("Usage: %s [-c callers] [-n calls_each] [-s req_size]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+    if (callers <= 0 || calls <= 0 || req_size <= 0) {
+        printf("Usage: %s [-c callers] [-n calls_each] [-s req_size]\n",
+               argv[0]);
+        return -1;
+    }
+
+    req = (char *)malloc(req_size);
+    if (req == NULL) {
+        printf("ERROR: Failed to allocate space for request\n");
+        return -1;
+    }
+    memset(req, 'x', req_size);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   sv) != 0) {
+        printf("ERROR: Failed to create socket pair\n");
+        return -1;
+    }
+    client = ce_rpc_client_create(sv[0]);
+    if (client == NULL) {
+        printf("ERROR: Failed to create RPC client\n");
+        return -1;
+    }
+
+    start_ns = ce_stats_now_ns();
+    ce_task(server, (void *)(long)sv[1]);
+    live = callers;
+    for (i = 0; i < callers; i++) {
+        ce_task(caller, NULL);
+    }
+    ce_run();
+    free(req);
+
+    return errors == 0 ? 0 : -1;
+}
@@ -0,0 +1,295 @@
+/*
+ * scale benchmark: ramps up parked coroutines and idle loopback connections,
+ * reports memory per coroutine / connection, creation rate and tick cost
+ * every result is printed as one JSON object per line
+ * -l parks server connections with ce_on_readable instead of a task each
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "coevt.h"
+#include "stats.h"
+
+#define CONNECTOR_NUM 256
+#define TICK_SAMPLES 50
+
+static long max_crtns = 100000;
+static long max_socks = 10000;
+static long max_bytes = 0;   // fail if a level costs more per unit, 0 to skip
+static int failed = 0;
+static int lazy = FALSE;
+
+static long parked = 0;
+static long idle_conns = 0;
+
+static int listen_fd = -1;
+static struct sockaddr_in listen_addr;
+static int *cli_fds;
+static long cli_cnt = 0;
+static long cli_reserved = 0;
+static long cli_target = 0;
+static int connectors_done = 0;
+
+static long read_rss()
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(fp);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// yields of the driver take one run loop tick each,
+// time spent waiting in epoll_wait is not part of the tick cost
+static double tick_us()
+{
+    ce_stats before, after;
+    int i;
+
+    ce_stats_snapshot(&before);
+    for (i = 0; i < TICK_SAMPLES; i++) {
+        ce_yield();
+    }
+    ce_stats_snapshot(&after);
+    if (after.ticks == before.ticks) {
+        return 0;
+    }
+    return ((after.tick_ns.sum - before.tick_ns.sum)
+            - (after.poll_ns.sum - before.poll_ns.sum))
+           / 1e3 / (after.ticks - before.ticks);
+}
+
+// count and rss_delta are totals so far, created is what this level added
+static void report(const char *kind, long count, long created, long rss_delta,
+                   double create_sec, double tick)
+{
+    double per_unit = (double)rss_delta / count;
+
+    printf("{\"scale\":\"%s\",\"count\":%ld,\"rss_bytes\":%ld,"
+           "\"bytes_per_unit\":%.0f,\"create_per_sec\":%.0f,\"tick_us\":%.1f}\n",
+           kind, count, rss_delta, per_unit, created / create_sec, tick);
+    fflush(stdout);
+    if (max_bytes > 0 && per_unit > max_bytes) {
+        printf("ERROR: %s costs %.0f bytes each, limit is %ld\n",
+               kind, per_unit, max_bytes);
+        failed = 1;
+    }
+}
+
+static void park(void *arg)
+{
+    parked++;
+    // never woken up, the process exits when the benchmark is done
+    ce_wait();
+}
+
+static void ramp_coroutines(long base_rss)
+{
+    long level, prev_level, i;
+    unsigned long long start;
+
+    for (level = 10000; level <= max_crtns; level *= 10) {
+        prev_level = parked;
+        start = ce_stats_now_ns();
+        for (i = parked; i < level; i++) {
+            if (ce_task(park, NULL) != 0) {
+                printf("ERROR: Failed to create coroutine %ld\n", i);
+                return;
+            }
+        }
+        while (parked < level) {
+            ce_yield();
+        }
+        report("parked_coroutine", level, level - prev_level, read_rss() - base_rss,
+               (ce_stats_now_ns() - start) / 1e9, tick_us());
+    }
+}
+
+static void idle_conn(int fd, void *arg)
+{
+    char c;
+
+    idle_conns++;
+    // the client never sends anything, so the connection stays idle
+    if (ce_read(fd, &c, 1) <= 0) {
+        idle_conns--;
+    }
+    ce_close(fd);
+}
+
+static int idle_input(int fd, void *arg)
+{
+    char c;
+
+    // only end of stream arrives, which drops the registration
+    if (read(fd, &c, 1) > 0) {
+        return CE_SUCCESS;
+    }
+    idle_conns--;
+    return CE_FAILURE;
+}
+
+static void serve(void *arg)
+{
+    int fd;
+
+    if (!lazy) {
+        ce_serve(listen_fd, idle_conn, NULL, 0);
+        return;
+    }
+    while ((fd = ce_accept(listen_fd, NULL, NULL)) != CE_FAILURE) {
+        if (ce_on_readable(fd, idle_input, NULL) != CE_SUCCESS) {
+            close(fd);
+            continue;
+        }
+        idle_conns++;
+    }
+}
+
+static void connector(void *arg)
+{
+    int fd;
+
+    while (cli_reserved < cli_target) {
+        // reserve before connecting, ce_connect parks the connector
+        cli_reserved++;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1 || ce_connect(fd, (struct sockaddr *)&listen_addr,
+                                   sizeof(listen_addr), 5000) != 0) {
+            printf("ERROR: Failed to connect, %s\n", strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            cli_reserved--;
+            break;
+        }
+        cli_fds[cli_cnt++] = fd;
+    }
+    connectors_done++;
+}
+
+static int setup_listener()
+{
+    socklen_t len = sizeof(listen_addr);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd == -1
+        || bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) != 0
+        || listen(listen_fd, 4096) != 0
+        || getsockname(listen_fd, (struct sockaddr *)&listen_addr, &len) != 0) {
+        printf("ERROR: Failed to set up loopback listener\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static long fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return 1024;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return (long)rl.rlim_cur;
+}
+
+static void ramp_sockets(long base_rss)
+{
+    long level, limit, prev_cnt, i;
+    unsigned long long start;
+
+    // each connection takes a client and a server fd
+    limit = (fd_limit() - 64) / 2;
+    if (max_socks > limit) {
+        printf("INFO: fd limit allows only %ld idle connections\n", limit);
+        max_socks = limit;
+    }
+    if (max_socks < 1 || setup_listener() != 0) {
+        return;
+    }
+    cli_fds = (int *)malloc(sizeof(int) * max_socks);
+    if (cli_fds == NULL) {
+        printf("ERROR: Failed to allocate space for client fds\n");
+        return;
+    }
+    ce_task(serve, NULL);
+
+    for (level = 1000; level <= max_socks * 10; level *= 10) {
+        if (level > max_socks) {
+            level = max_socks;
+        }
+        prev_cnt = cli_cnt;
+        start = ce_stats_now_ns();
+        cli_target = level;
+        connectors_done = 0;
+        for (i = 0; i < CONNECTOR_NUM; i++) {
+            ce_task(connector, NULL);
+        }
+        while (connectors_done < CONNECTOR_NUM || idle_conns < cli_cnt) {
+            ce_yield();
+        }
+        report(lazy ? "idle_connection_lazy" : "idle_connection", cli_cnt,
+               cli_cnt - prev_cnt, read_rss() - base_rss,
+               (ce_stats_now_ns() - start) / 1e9, tick_us());
+        if (cli_cnt < level || level == max_socks) {
+            break;
+        }
+    }
+}
+
+static void driver(void *arg)
+{
+    long base_rss;
+
+    // let the scheduler allocate its run stack before taking the baseline
+    ce_yield();
+    base_rss = read_rss();
+    ramp_coroutines(base_rss);
+
+    base_rss = read_rss();
+    ramp_sockets(base_rss);
+
+    exit(failed);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:m:l")) != -1) {
+        switch (opt) {
+        case 'c': max_crtns = atol(optarg); break;
+        case 's': max_socks = atol(optarg); break;
+        case 'm': max_bytes = atol(optarg); break;
+        case 'l': lazy = TRUE; break;
+        default:
+            printf("Usage: %s [-c max_coroutines] [-s max_connections]"
+                   " [-m max_bytes_each] [-l]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    ce_task(driver, NULL);
+    ce_run();
+
+    return failed;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+  unique scheduler in the process, so are its stats
+*/
+ce_stats ce_sched_stats;
+
+unsigned long long ce_stats_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_index(unsigned long long value)
+{
+    int msb;
+
+    if (value < CE_HIST_SUB_CNT) {
+        return (int)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    return (msb - CE_HIST_SUB_BITS + 1) * CE_HIST_SUB_CNT
+           + (int)((value >> (msb - CE_HIST_SUB_BITS)) & (CE_HIST_SUB_CNT - 1));
+}
+
+static unsigned long long bucket_upper(int idx)
+{
+    int group = idx / CE_HIST_SUB_CNT;
+    int sub = idx % CE_HIST_SUB_CNT;
+    unsigned long long low;
+
+    if (group == 0) {
+        return (unsigned long long)idx;
+    }
+    low = (unsigned long long)(CE_HIST_SUB_CNT + sub) << (group - 1);
+    return low + (1ULL << (group - 1)) - 1;
+}
+
+void ce_hist_record(ce_hist *hist, unsigned long long value)
+{
+    ce_stats_add(&hist->buckets[bucket_index(value)], 1);
+    ce_stats_add(&hist->count, 1);
+    ce_stats_add(&hist->sum, value);
+    if (value > hist->max) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void ce_stats_snapshot(ce_stats *out)
+{
+    // may run on another thread while the scheduler keeps going,
+    // every counter is read atomically but not the struct as a whole
+    const unsigned long long *src = (const unsigned long long *)&ce_sched_stats;
+    unsigned long long *dst = (unsigned long long *)out;
+    size_t i;
+
+    for (i = 0; i < sizeof(ce_stats) / sizeof(unsigned long long); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void ce_stats_reset()
+{
+    memset(&ce_sched_stats, 0, sizeof(ce_stats));
+}
+
+unsigned long long ce_hist_percentile(const ce_hist *hist, double pct)
+{
+    unsigned long long rank;
+    unsigned long long seen = 0;
+    int i;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    rank = (unsigned long long)(pct / 100.0 * hist->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < CE_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            unsigned long long upper = bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+static void dump_hist_text(FILE *fp, const char *name, const ce_hist *hist)
+{
+    fprintf(fp, "%s count=%llu mean=%llu p50=%llu p99=%llu p999=%llu max=%llu\n",
+            name, hist->count,
+            hist->count > 0 ? hist->sum / hist->count : 0,
+            ce_hist_percentile(hist, 50.0),
+            ce_hist_percentile(hist, 99.0),
+            ce_hist_percentile(hist, 99.9),
+            hist->max);
+}
+
+static void dump_hist_json(FILE *fp, const char *name, const ce_hist *hist)
+{
+    fprintf(fp, "\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,"
+                "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            name, hist->count,
+            hist->count > 0 ? hist->sum / hist->count : 0,
+            ce_hist_percentile(hist, 50.0),
+            ce_hist_percentile(hist, 99.0),
+            ce_hist_percentile(hist, 99.9),
+            hist->max);
+}
+
+int ce_stats_dump(FILE *fp, int format)
+{
+    ce_stats snap;
+    const char *names[] = {
+        "creates", "exits", "resumes", "yields", "blocks",
+        "stack_saved_bytes", "stack_restored_bytes", "stack_reuses",
+        "polls", "poll_events", "ticks", "watchdog_trips", "handoffs"
+    };
+    const unsigned long long *counters = (const unsigned long long *)&snap;
+    int i;
+
+    ce_stats_snapshot(&snap);
+    if (format == CE_STATS_TEXT) {
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            fprintf(fp, "%s %llu\n", names[i], counters[i]);
+        }
+        dump_hist_text(fp, "poll_ns", &snap.poll_ns);
+        dump_hist_text(fp, "react_events", &snap.react_events);
+        dump_hist_text(fp, "tick_ns", &snap.tick_ns);
+    } else if (format == CE_STATS_JSON) {
+        fprintf(fp, "{");
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            fprintf(fp, "\"%s\":%llu,", names[i], counters[i]);
+        }
+        dump_hist_json(fp, "poll_ns", &snap.poll_ns);
+        fprintf(fp, ",");
+        dump_hist_json(fp, "react_events", &snap.react_events);
+        fprintf(fp, ",");
+        dump_hist_json(fp, "tick_ns", &snap.tick_ns);
+        fprintf(fp, "}\n");
+    } else {
+        CE_LOG_ERROR("Unknown stats dump format %d", format);
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#ifndef _COEVT_STATS_H_
+#define _COEVT_STATS_H_
+
+#include <stdio.h>
+
+#define CE_STATS_TEXT 1
+#define CE_STATS_JSON 2
+
+/*
+  log-linear histogram in the spirit of HdrHistogram:
+  each power of two is split into 2^CE_HIST_SUB_BITS buckets,
+  so recorded values keep about 12% relative precision
+*/
+#define CE_HIST_SUB_BITS 3
+#define CE_HIST_SUB_CNT (1 << CE_HIST_SUB_BITS)
+#define CE_HIST_BUCKETS (64 * CE_HIST_SUB_CNT)
+
+typedef struct ce_hist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[CE_HIST_BUCKETS];
+} ce_hist;
+
+// only unsigned long long members, snapshots copy it word by word
+typedef struct ce_stats {
+    unsigned long long creates;
+    unsigned long long exits;
+    unsigned long long resumes;
+    unsigned long long yields;
+    unsigned long long blocks;
+    unsigned long long stack_saved_bytes;
+    unsigned long long stack_restored_bytes;
+    unsigned long long stack_reuses;
+    unsigned long long polls;
+    unsigned long long poll_events;
+    unsigned long long ticks;
+    unsigned long long watchdog_trips;
+    unsigned long long handoffs;  // switches that bypassed the run loop
+    ce_hist poll_ns;
+    ce_hist react_events;
+    ce_hist tick_ns;
+} ce_stats;
+
+void ce_stats_snapshot(ce_stats *out);
+void ce_stats_reset();
+unsigned long long ce_hist_percentile(const ce_hist *hist, double pct);
+int ce_stats_dump(FILE *fp, int format);
+
+unsigned long long ce_stats_now_ns();
+void ce_hist_record(ce_hist *hist, unsigned long long value);
+
+// counters of the scheduler, only written by the thread running it
+extern ce_stats ce_sched_stats;
+
+static inline void ce_stats_add(unsigned long long *counter,
+                                unsigned long long n)
+{
+    // single writer, a relaxed store is enough for concurrent snapshots
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+#ifndef CE_NO_STATS
+#define CE_STATS_ADD(field, n) ce_stats_add(&ce_sched_stats.field, (n))
+#define CE_STATS_RECORD(field, v) ce_hist_record(&ce_sched_stats.field, (v))
+#define CE_STATS_NOW() ce_stats_now_ns()
+#else
+#define CE_STATS_ADD(field, n) ((void)0)
+// the value still counts as used, so timestamps taken for it don't warn
+#define CE_STATS_RECORD(field, v) ((void)(v))
+#define CE_STATS_NOW() 0ULL
+#endif
+
+#endif
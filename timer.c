@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "defs.h"
+#include "log.h"
+#include "timer.h"
+
+struct ce_timer {
+    long long deadline;
+    timer_func func;
+    void *arg;
+};
+
+/*
+  min-heap of timers ordered by deadline, unique in the process
+  cancelled timers stay in the heap with a NULL func until they expire
+*/
+static ce_timer **timer_heap = NULL;
+static int heap_size = 0;
+static int heap_cap = 0;
+
+long long ce_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void swap_timer(int i, int j)
+{
+    ce_timer *tmp = timer_heap[i];
+    timer_heap[i] = timer_heap[j];
+    timer_heap[j] = tmp;
+}
+
+static void sift_up(int idx)
+{
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (timer_heap[parent]->deadline <= timer_heap[idx]->deadline) {
+            break;
+        }
+        swap_timer(parent, idx);
+        idx = parent;
+    }
+}
+
+static void sift_down(int idx)
+{
+    while (TRUE) {
+        int left = idx * 2 + 1;
+        int right = left + 1;
+        int min = idx;
+        if (left < heap_size
+            && timer_heap[left]->deadline < timer_heap[min]->deadline) {
+            min = left;
+        }
+        if (right < heap_size
+            && timer_heap[right]->deadline < timer_heap[min]->deadline) {
+            min = right;
+        }
+        if (min == idx) {
+            break;
+        }
+        swap_timer(min, idx);
+        idx = min;
+    }
+}
+
+ce_timer *ce_timer_add(int timeout_ms, timer_func func, void *arg)
+{
+    ce_timer *timer;
+
+    if (heap_size == heap_cap) {
+        int new_cap = heap_cap > 0 ? heap_cap * 2 : INIT_CAPACITY;
+        ce_timer **new_heap = (ce_timer **)realloc(timer_heap,
+                                                   sizeof(ce_timer *) * new_cap);
+        if (new_heap == NULL) {
+            CE_LOG_ERROR("Failed to enlarge timer heap");
+            return NULL;
+        }
+        timer_heap = new_heap;
+        heap_cap = new_cap;
+    }
+
+    timer = (ce_timer *)malloc(sizeof(ce_timer));
+    if (timer == NULL) {
+        CE_LOG_ERROR("Failed to allocate space for ce_timer");
+        return NULL;
+    }
+    timer->deadline = ce_now_ms() + timeout_ms;
+    timer->func = func;
+    timer->arg = arg;
+
+    timer_heap[heap_size++] = timer;
+    sift_up(heap_size - 1);
+
+    return timer;
+}
+
+void ce_timer_cancel(ce_timer *timer)
+{
+    // must not be called after the timer fired, it's freed by then
+    timer->func = NULL;
+}
+
+// time until the earliest deadline, -1 without timers
+int ce_timer_next_ms()
+{
+    long long wait;
+
+    if (heap_size == 0) {
+        return -1;
+    }
+    wait = timer_heap[0]->deadline - ce_now_ms();
+
+    return wait > 0 ? (int)wait : 0;
+}
+
+int ce_timer_process()
+{
+    long long now;
+    ce_timer *timer;
+
+    if (heap_size == 0) {
+        return CE_SUCCESS;
+    }
+
+    now = ce_now_ms();
+    while (heap_size > 0 && timer_heap[0]->deadline <= now) {
+        timer = timer_heap[0];
+        timer_heap[0] = timer_heap[--heap_size];
+        sift_down(0);
+
+        // pop before firing, so the callback may add new timers
+        if (timer->func != NULL) {
+            timer->func(timer->arg);
+        }
+        free(timer);
+    }
+
+    return CE_SUCCESS;
+}
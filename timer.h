@@ -0,0 +1,13 @@
+#ifndef _COEVT_TIMER_H_
+#define _COEVT_TIMER_H_
+
+typedef struct ce_timer ce_timer;
+typedef void (*timer_func)(void *arg);
+
+long long ce_now_ms();
+ce_timer *ce_timer_add(int timeout_ms, timer_func func, void *arg);
+void ce_timer_cancel(ce_timer *timer);
+int ce_timer_next_ms();
+int ce_timer_process();
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "defs.h"
+#include "log.h"
+#include "trace.h"
+
+#ifdef CE_TRACE
+
+/*
+  unique scheduler in the process, so is its trace ring
+*/
+ce_trace_evt ce_trace_ring[CE_TRACE_BUF_SIZE];
+unsigned long long ce_trace_head = 0;
+
+static unsigned long long base_tsc;
+static unsigned long long base_ns;
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+unsigned long long ce_trace_tsc()
+{
+    return now_ns();
+}
+#endif
+
+static void dump_at_exit()
+{
+    ce_trace_dump_chrome(getenv("CE_TRACE_FILE"));
+}
+
+__attribute__((constructor))
+static void trace_init()
+{
+    base_tsc = ce_trace_tsc();
+    base_ns = now_ns();
+    // dump automatically when the program exits normally
+    if (getenv("CE_TRACE_FILE") != NULL) {
+        atexit(dump_at_exit);
+    }
+}
+
+static void dump_evt(FILE *fp, ce_trace_evt *evt, double ticks_per_us, int first)
+{
+    double ts = (evt->tsc - base_tsc) / ticks_per_us;
+    const char *sep = first ? "" : ",\n";
+
+    // coroutines get a row each (tid = id + 1), the run loop is tid 0
+    switch (evt->type) {
+    case CE_TRACE_CREATE:
+        fprintf(fp, "%s{\"name\":\"create\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":%d}",
+                sep, ts, evt->crtn_id + 1);
+        break;
+    case CE_TRACE_RESUME:
+        fprintf(fp, "%s{\"name\":\"coroutine %d\",\"ph\":\"B\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":%d}",
+                sep, evt->crtn_id, ts, evt->crtn_id + 1);
+        break;
+    case CE_TRACE_PAUSE:
+    case CE_TRACE_EXIT:
+        fprintf(fp, "%s{\"name\":\"coroutine %d\",\"ph\":\"E\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":%d,\"args\":{\"reason\":\"%s\"}}",
+                sep, evt->crtn_id, ts, evt->crtn_id + 1,
+                evt->type == CE_TRACE_EXIT ? "exit"
+                : evt->arg == CE_COROUTINE_BLOCKED ? "block" : "yield");
+        break;
+    case CE_TRACE_POLL_BEGIN:
+        fprintf(fp, "%s{\"name\":\"poll\",\"ph\":\"B\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":0}",
+                sep, ts);
+        break;
+    case CE_TRACE_POLL_END:
+        fprintf(fp, "%s{\"name\":\"poll\",\"ph\":\"E\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":0,\"args\":{\"events\":%ld}}",
+                sep, ts, evt->arg);
+        break;
+    case CE_TRACE_REACT:
+        fprintf(fp, "%s{\"name\":\"react\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":0,\"args\":{\"events\":%ld}}",
+                sep, ts, evt->arg);
+        break;
+    case CE_TRACE_CHAN_BLOCK:
+    case CE_TRACE_CHAN_UNBLOCK:
+        fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":%d,\"args\":{\"chan\":\"0x%lx\"}}",
+                sep, evt->type == CE_TRACE_CHAN_BLOCK ? "chan block" : "chan unblock",
+                ts, evt->crtn_id + 1, evt->arg);
+        break;
+    default:
+        break;
+    }
+}
+
+int ce_trace_dump_chrome(const char *path)
+{
+    FILE *fp;
+    unsigned long long head, start, pos, end_tsc, end_ns;
+    double ticks_per_us;
+    ce_trace_evt evt;
+
+    if (path == NULL) {
+        CE_LOG_ERROR("No path to dump trace events");
+        return CE_FAILURE;
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        CE_LOG_ERROR("Failed to open trace file %s", path);
+        return CE_FAILURE;
+    }
+
+    end_tsc = ce_trace_tsc();
+    end_ns = now_ns();
+    ticks_per_us = end_ns > base_ns
+                   ? (double)(end_tsc - base_tsc) * 1000.0 / (end_ns - base_ns)
+                   : 1.0;
+
+    // only the latest CE_TRACE_BUF_SIZE events are kept, older ones are
+    // overwritten; when dumping from another thread the oldest few may be torn
+    head = __atomic_load_n(&ce_trace_head, __ATOMIC_ACQUIRE);
+    start = head > CE_TRACE_BUF_SIZE ? head - CE_TRACE_BUF_SIZE : 0;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (pos = start; pos < head; pos++) {
+        evt = ce_trace_ring[pos & (CE_TRACE_BUF_SIZE - 1)];
+        dump_evt(fp, &evt, ticks_per_us, pos == start);
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(fp);
+
+    return CE_SUCCESS;
+}
+
+#else
+
+int ce_trace_dump_chrome(const char *path)
+{
+    CE_LOG_ERROR("Tracing is not compiled in, rebuild with -DCE_TRACE");
+    return CE_FAILURE;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _COEVT_TRACE_H_
+#define _COEVT_TRACE_H_
+
+#define CE_TRACE_CREATE 1
+#define CE_TRACE_RESUME 2
+#define CE_TRACE_PAUSE 3
+#define CE_TRACE_EXIT 4
+#define CE_TRACE_POLL_BEGIN 5
+#define CE_TRACE_POLL_END 6
+#define CE_TRACE_REACT 7
+#define CE_TRACE_CHAN_BLOCK 8
+#define CE_TRACE_CHAN_UNBLOCK 9
+
+// number of events kept, must be a power of 2
+#define CE_TRACE_BUF_SIZE (1 << 16)
+
+typedef struct ce_trace_evt {
+    unsigned long long tsc;
+    int type;
+    int crtn_id;
+    long arg;
+} ce_trace_evt;
+
+int ce_trace_dump_chrome(const char *path);
+
+#ifdef CE_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ce_trace_tsc() __rdtsc()
+#else
+unsigned long long ce_trace_tsc();
+#endif
+
+// ring of the scheduler, only written by the thread running it
+extern ce_trace_evt ce_trace_ring[CE_TRACE_BUF_SIZE];
+extern unsigned long long ce_trace_head;
+
+static inline void ce_trace_record(int type, int crtn_id, long arg)
+{
+    unsigned long long pos = ce_trace_head;
+    ce_trace_evt *evt = &ce_trace_ring[pos & (CE_TRACE_BUF_SIZE - 1)];
+
+    evt->tsc = ce_trace_tsc();
+    evt->type = type;
+    evt->crtn_id = crtn_id;
+    evt->arg = arg;
+    // publish the event to readers on other threads
+    __atomic_store_n(&ce_trace_head, pos + 1, __ATOMIC_RELEASE);
+}
+
+#define CE_TRACE_EVT(type, crtn_id, arg) ce_trace_record((type), (crtn_id), (arg))
+#else
+#define CE_TRACE_EVT(type, crtn_id, arg) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include "defs.h"
+#include "log.h"
+#include "coroutine.h"
+#include "stats.h"
+#include "watchdog.h"
+
+#define BACKTRACE_DEPTH 32
+
+/*
+  one watchdog thread watching the unique scheduler in the process
+*/
+static pthread_t watchdog_thread;
+static pthread_t loop_thread;
+static volatile int watchdog_running = FALSE;
+static int threshold = 0;
+static int log_fd = STDERR_FILENO;
+static volatile int stuck_crtn = CE_DUMMY_COROUTINE_ID;
+
+// async-signal-safe replacement of printf("%d")
+static void write_int(int fd, long n)
+{
+    char buf[24];
+    int pos = sizeof(buf);
+    int neg = n < 0;
+
+    if (neg) {
+        n = -n;
+    }
+    do {
+        buf[--pos] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    if (neg) {
+        buf[--pos] = '-';
+    }
+    if (write(fd, buf + pos, sizeof(buf) - pos) < 0) {
+        return;
+    }
+}
+
+static void write_str(int fd, const char *s)
+{
+    if (write(fd, s, strlen(s)) < 0) {
+        return;
+    }
+}
+
+// runs on the loop thread, interrupting the long running coroutine
+static void on_watchdog_signal(int sig)
+{
+    void *frames[BACKTRACE_DEPTH];
+    int depth;
+
+    write_str(log_fd, "WARNING: coroutine ");
+    write_int(log_fd, stuck_crtn);
+    write_str(log_fd, " has held the scheduler for more than ");
+    write_int(log_fd, threshold);
+    write_str(log_fd, " ms, backtrace:\n");
+    depth = backtrace(frames, BACKTRACE_DEPTH);
+    backtrace_symbols_fd(frames, depth, log_fd);
+}
+
+static void *watch(void *arg)
+{
+    struct timespec interval;
+    long long quarter_ns = threshold * 250000LL;
+    long long held_ns = 0;
+    unsigned long last_seq = 0;
+    int reported = FALSE;
+
+    // sample 4 times per threshold, so a slice is caught at most 25% late
+    interval.tv_sec = quarter_ns / 1000000000LL;
+    interval.tv_nsec = quarter_ns % 1000000000LL;
+    while (watchdog_running) {
+        unsigned long seq;
+        int cur;
+
+        nanosleep(&interval, NULL);
+        seq = ce_coroutine_switches();
+        cur = ce_cur_coroutine();
+        if (seq != last_seq || cur == CE_DUMMY_COROUTINE_ID) {
+            last_seq = seq;
+            held_ns = 0;
+            reported = FALSE;
+            continue;
+        }
+
+        // no coroutine switch since last sample, the same one is running
+        held_ns += quarter_ns;
+        if (!reported && held_ns >= threshold * 1000000LL) {
+            reported = TRUE;
+            stuck_crtn = cur;
+            CE_STATS_ADD(watchdog_trips, 1);
+            pthread_kill(loop_thread, CE_WATCHDOG_SIGNAL);
+        }
+    }
+
+    return NULL;
+}
+
+int ce_watchdog_start(int threshold_ms, int fd)
+{
+    struct sigaction sa;
+    void *frames[1];
+
+    if (watchdog_running || threshold_ms <= 0) {
+        return CE_FAILURE;
+    }
+    threshold = threshold_ms;
+    log_fd = fd >= 0 ? fd : STDERR_FILENO;
+    // must be called on the thread running the scheduler
+    loop_thread = pthread_self();
+
+    // the first backtrace call loads libgcc, don't do it in the handler
+    backtrace(frames, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_watchdog_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(CE_WATCHDOG_SIGNAL, &sa, NULL) != 0) {
+        CE_LOG_ERROR("Failed to install watchdog signal handler");
+        return CE_FAILURE;
+    }
+
+    watchdog_running = TRUE;
+    if (pthread_create(&watchdog_thread, NULL, watch, NULL) != 0) {
+        CE_LOG_ERROR("Failed to start watchdog thread");
+        watchdog_running = FALSE;
+        return CE_FAILURE;
+    }
+
+    return CE_SUCCESS;
+}
+
+void ce_watchdog_stop()
+{
+    if (!watchdog_running) {
+        return;
+    }
+    watchdog_running = FALSE;
+    pthread_join(watchdog_thread, NULL);
+}
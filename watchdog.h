@@ -0,0 +1,12 @@
+#ifndef _COEVT_WATCHDOG_H_
+#define _COEVT_WATCHDOG_H_
+
+#include <signal.h>
+
+// sent to the loop thread to log the backtrace of a long running coroutine
+#define CE_WATCHDOG_SIGNAL SIGUSR2
+
+int ce_watchdog_start(int threshold_ms, int log_fd);
+void ce_watchdog_stop();
+
+#endif